@@ -688,7 +688,7 @@ static int tegra_target(struct cpufreq_policy *policy,
 		       unsigned int target_freq,
 		       unsigned int relation)
 {
-	int idx;
+	int idx, i;
 	unsigned int freq;
 	unsigned int new_speed;
 	int ret = 0;
@@ -702,7 +702,9 @@ static int tegra_target(struct cpufreq_policy *policy,
 
 	freq = freq_table[idx].frequency;
 
-	target_cpu_speed[policy->cpu] = freq;
+	/* Also covers cores that join the policy when they come online */
+	for_each_cpu(i, policy->related_cpus)
+		target_cpu_speed[i] = freq;
 	ret = tegra_cpu_set_speed_cap_locked(&new_speed);
 _out:
 	mutex_unlock(&tegra_cpu_lock);
@@ -778,7 +780,12 @@ static int tegra_cpu_init(struct cpufreq_policy *policy)
 	/* FIXME: what's the actual transition time? */
 	policy->cpuinfo.transition_latency = 300 * 1000;
 
+	/*
+	 * All cores run off the one cpu clock, so a single policy covers
+	 * them and the governor evaluates them together.
+	 */
 	policy->shared_type = CPUFREQ_SHARED_TYPE_ALL;
+	cpumask_copy(policy->cpus, cpu_online_mask);
 	cpumask_copy(policy->related_cpus, cpu_possible_mask);
 
 	return 0;
@@ -799,14 +806,15 @@ static int tegra_cpufreq_policy_notifier(
 #ifdef CONFIG_TEGRA_THERMAL_THROTTLE
 	static int once = 1;
 #endif
-	int i, ret;
+	int i, j, ret;
 	struct cpufreq_policy *policy = data;
 
 	if (event == CPUFREQ_NOTIFY) {
 		ret = cpufreq_frequency_table_target(policy, freq_table,
 			policy->max, CPUFREQ_RELATION_H, &i);
-		policy_max_speed[policy->cpu] =
-			ret ? policy->max : freq_table[i].frequency;
+		for_each_cpu(j, policy->related_cpus)
+			policy_max_speed[j] =
+				ret ? policy->max : freq_table[i].frequency;
 
 #ifdef CONFIG_TEGRA_THERMAL_THROTTLE
 		if (once &&
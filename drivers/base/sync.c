@@ -19,6 +19,8 @@
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
 #include <linux/poll.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
@@ -39,9 +41,137 @@ static void sync_dump(void);
 static LIST_HEAD(sync_timeline_list_head);
 static DEFINE_SPINLOCK(sync_timeline_list_lock);
 
+#ifdef CONFIG_DEBUG_FS
+/* only used to dump every fence; kept off the fast path without debugfs */
 static LIST_HEAD(sync_fence_list_head);
 static DEFINE_SPINLOCK(sync_fence_list_lock);
 
+static void sync_fence_debug_add(struct sync_fence *fence)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sync_fence_list_lock, flags);
+	list_add_tail(&fence->sync_fence_list, &sync_fence_list_head);
+	spin_unlock_irqrestore(&sync_fence_list_lock, flags);
+}
+
+static void sync_fence_debug_remove(struct sync_fence *fence)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sync_fence_list_lock, flags);
+	list_del(&fence->sync_fence_list);
+	spin_unlock_irqrestore(&sync_fence_list_lock, flags);
+}
+#else
+static inline void sync_fence_debug_add(struct sync_fence *fence)
+{
+}
+
+static inline void sync_fence_debug_remove(struct sync_fence *fence)
+{
+}
+#endif
+
+static struct kmem_cache *sync_fence_cache;
+
+/*
+ * sync_pts are allocated at the size their driver asks for.  Drivers use
+ * one or two sizes each, so keep a slab cache per size seen, up to
+ * SYNC_PT_CACHES of them, and fall back to kmalloc beyond that.  Entries
+ * are published before sync_pt_nr_caches is raised, so lookups need no
+ * lock.
+ */
+#define SYNC_PT_CACHES	8
+
+static struct sync_pt_cache {
+	int			size;
+	struct kmem_cache	*cache;
+	char			name[24];
+} sync_pt_caches[SYNC_PT_CACHES];
+static int sync_pt_nr_caches;
+static DEFINE_MUTEX(sync_pt_cache_lock);
+
+static struct kmem_cache *sync_pt_cache_lookup(int size)
+{
+	int nr = ACCESS_ONCE(sync_pt_nr_caches);
+	int i;
+
+	smp_rmb();
+	for (i = 0; i < nr; i++)
+		if (sync_pt_caches[i].size == size)
+			return sync_pt_caches[i].cache;
+
+	return NULL;
+}
+
+static struct kmem_cache *sync_pt_cache_get(int size)
+{
+	struct sync_pt_cache *entry;
+	struct kmem_cache *cache;
+
+	cache = sync_pt_cache_lookup(size);
+	if (cache)
+		return cache;
+
+	mutex_lock(&sync_pt_cache_lock);
+	cache = sync_pt_cache_lookup(size);
+	if (cache || sync_pt_nr_caches == SYNC_PT_CACHES)
+		goto out;
+
+	entry = &sync_pt_caches[sync_pt_nr_caches];
+	snprintf(entry->name, sizeof(entry->name), "sync_pt-%d", size);
+	cache = kmem_cache_create(entry->name, size, 0, 0, NULL);
+	if (cache == NULL)
+		goto out;
+
+	entry->size = size;
+	entry->cache = cache;
+	smp_wmb();
+	sync_pt_nr_caches++;
+out:
+	mutex_unlock(&sync_pt_cache_lock);
+	return cache;
+}
+
+/*
+ * Signal-to-wakeup latency of sync_fence_wait() callers that had to sleep:
+ * the time from a fence signaling until its waiter runs again.  Buckets
+ * are log2 microseconds.
+ */
+#define SYNC_WAKE_BUCKETS	16
+
+static struct {
+	u64	count;
+	u64	total_ns;
+	u64	max_ns;
+	u64	hist[SYNC_WAKE_BUCKETS];
+} sync_wake_stats;
+static DEFINE_SPINLOCK(sync_wake_stats_lock);
+
+static void sync_fence_account_wake(struct sync_fence *fence)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), fence->signal_time));
+	unsigned long flags;
+	int bucket;
+
+	if (ns < 0)
+		ns = 0;
+	trace_sync_wake(fence, ns);
+
+	bucket = min_t(int, ns >= NSEC_PER_USEC ?
+		       ilog2(ns / NSEC_PER_USEC) + 1 : 0,
+		       SYNC_WAKE_BUCKETS - 1);
+
+	spin_lock_irqsave(&sync_wake_stats_lock, flags);
+	sync_wake_stats.count++;
+	sync_wake_stats.total_ns += ns;
+	if (ns > sync_wake_stats.max_ns)
+		sync_wake_stats.max_ns = ns;
+	sync_wake_stats.hist[bucket]++;
+	spin_unlock_irqrestore(&sync_wake_stats_lock, flags);
+}
+
 struct sync_timeline *sync_timeline_create(const struct sync_timeline_ops *ops,
 					   int size, const char *name)
 {
@@ -167,15 +297,21 @@ EXPORT_SYMBOL(sync_timeline_signal);
 
 struct sync_pt *sync_pt_create(struct sync_timeline *parent, int size)
 {
+	struct kmem_cache *cache;
 	struct sync_pt *pt;
 
 	if (size < sizeof(struct sync_pt))
 		return NULL;
 
-	pt = kzalloc(size, GFP_KERNEL);
+	cache = sync_pt_cache_get(size);
+	if (cache)
+		pt = kmem_cache_zalloc(cache, GFP_KERNEL);
+	else
+		pt = kzalloc(size, GFP_KERNEL);
 	if (pt == NULL)
 		return NULL;
 
+	pt->cache = cache;
 	INIT_LIST_HEAD(&pt->active_list);
 	kref_get(&parent->kref);
 	sync_timeline_add_pt(parent, pt);
@@ -193,7 +329,10 @@ void sync_pt_free(struct sync_pt *pt)
 
 	kref_put(&pt->parent->kref, sync_timeline_free);
 
-	kfree(pt);
+	if (pt->cache)
+		kmem_cache_free(pt->cache, pt);
+	else
+		kfree(pt);
 }
 EXPORT_SYMBOL(sync_pt_free);
 
@@ -219,8 +358,12 @@ static struct sync_pt *sync_pt_dup(struct sync_pt *pt)
 	return pt->parent->ops->dup(pt);
 }
 
-/* Adds a sync pt to the active queue.  Called when added to a fence */
-static void sync_pt_activate(struct sync_pt *pt)
+/*
+ * Adds a sync pt to the active queue.  Called when added to a fence.
+ * Returns the pt's status; if it is non-zero the pt signaled here rather
+ * than from sync_timeline_signal() and the caller must tell the fence.
+ */
+static int sync_pt_activate(struct sync_pt *pt)
 {
 	struct sync_timeline *obj = pt->parent;
 	unsigned long flags;
@@ -236,6 +379,8 @@ static void sync_pt_activate(struct sync_pt *pt)
 
 out:
 	spin_unlock_irqrestore(&obj->active_list_lock, flags);
+
+	return err;
 }
 
 static int sync_fence_release(struct inode *inode, struct file *file);
@@ -253,9 +398,8 @@ static const struct file_operations sync_fence_fops = {
 static struct sync_fence *sync_fence_alloc(const char *name)
 {
 	struct sync_fence *fence;
-	unsigned long flags;
 
-	fence = kzalloc(sizeof(struct sync_fence), GFP_KERNEL);
+	fence = kmem_cache_zalloc(sync_fence_cache, GFP_KERNEL);
 	if (fence == NULL)
 		return NULL;
 
@@ -273,14 +417,12 @@ static struct sync_fence *sync_fence_alloc(const char *name)
 
 	init_waitqueue_head(&fence->wq);
 
-	spin_lock_irqsave(&sync_fence_list_lock, flags);
-	list_add_tail(&fence->sync_fence_list, &sync_fence_list_head);
-	spin_unlock_irqrestore(&sync_fence_list_lock, flags);
+	sync_fence_debug_add(fence);
 
 	return fence;
 
 err:
-	kfree(fence);
+	kmem_cache_free(sync_fence_cache, fence);
 	return NULL;
 }
 
@@ -298,13 +440,11 @@ struct sync_fence *sync_fence_create(const char *name, struct sync_pt *pt)
 
 	pt->fence = fence;
 	list_add(&pt->pt_list, &fence->pt_list_head);
-	sync_pt_activate(pt);
+	atomic_set(&fence->pending, 1);
 
-	/*
-	 * signal the fence in case pt was activated before
-	 * sync_pt_activate(pt) was called
-	 */
-	sync_fence_signal_pt(pt);
+	/* signal the fence in case pt has already signaled */
+	if (sync_pt_activate(pt))
+		sync_fence_signal_pt(pt);
 
 	return fence;
 }
@@ -426,31 +566,12 @@ void sync_fence_install(struct sync_fence *fence, int fd)
 }
 EXPORT_SYMBOL(sync_fence_install);
 
-static int sync_fence_get_status(struct sync_fence *fence)
-{
-	struct list_head *pos;
-	int status = 1;
-
-	list_for_each(pos, &fence->pt_list_head) {
-		struct sync_pt *pt = container_of(pos, struct sync_pt, pt_list);
-		int pt_status = pt->status;
-
-		if (pt_status < 0) {
-			status = pt_status;
-			break;
-		} else if (status == 1) {
-			status = pt_status;
-		}
-	}
-
-	return status;
-}
-
 struct sync_fence *sync_fence_merge(const char *name,
 				    struct sync_fence *a, struct sync_fence *b)
 {
 	struct sync_fence *fence;
-	struct list_head *pos;
+	struct sync_pt *pt;
+	int pending = 0;
 	int err;
 
 	fence = sync_fence_alloc(name);
@@ -465,48 +586,40 @@ struct sync_fence *sync_fence_merge(const char *name,
 	if (err < 0)
 		goto err;
 
-	list_for_each(pos, &fence->pt_list_head) {
-		struct sync_pt *pt =
-			container_of(pos, struct sync_pt, pt_list);
-		sync_pt_activate(pt);
-	}
+	list_for_each_entry(pt, &fence->pt_list_head, pt_list)
+		pending++;
+	atomic_set(&fence->pending, pending);
 
-	/*
-	 * signal the fence in case one of it's pts were activated before
-	 * they were activated
-	 */
-	sync_fence_signal_pt(list_first_entry(&fence->pt_list_head,
-					      struct sync_pt,
-					      pt_list));
+	/* signal the fence for any of its pts that have already signaled */
+	list_for_each_entry(pt, &fence->pt_list_head, pt_list)
+		if (sync_pt_activate(pt))
+			sync_fence_signal_pt(pt);
 
 	return fence;
 err:
-	sync_fence_free_pts(fence);
-	kfree(fence);
+	/* releasing the file frees the fence and the pts copied so far */
+	sync_fence_put(fence);
 	return NULL;
 }
 EXPORT_SYMBOL(sync_fence_merge);
 
-static void sync_fence_signal_pt(struct sync_pt *pt)
+static void sync_fence_signal(struct sync_fence *fence, int status)
 {
 	LIST_HEAD(signaled_waiters);
-	struct sync_fence *fence = pt->fence;
 	struct list_head *pos;
 	struct list_head *n;
 	unsigned long flags;
-	int status;
-
-	status = sync_fence_get_status(fence);
 
 	spin_lock_irqsave(&fence->waiter_list_lock, flags);
 	/*
 	 * this should protect against two threads racing on the signaled
 	 * false -> true transition
 	 */
-	if (status && !fence->status) {
+	if (!fence->status) {
 		list_for_each_safe(pos, n, &fence->waiter_list_head)
 			list_move(pos, &signaled_waiters);
 
+		fence->signal_time = ktime_get();
 		fence->status = status;
 	} else {
 		status = 0;
@@ -522,10 +635,30 @@ static void sync_fence_signal_pt(struct sync_pt *pt)
 			list_del(pos);
 			waiter->callback(fence, waiter);
 		}
-		wake_up(&fence->wq);
+		/* order the status store against the waitqueue check */
+		smp_mb();
+		if (waitqueue_active(&fence->wq))
+			wake_up(&fence->wq);
 	}
 }
 
+/*
+ * Called exactly once for every sync_pt of a fence, when the pt stops
+ * being active.  A pt in error signals the fence right away with that
+ * error; otherwise the fence signals once its last pt has, without
+ * walking or locking anything before then.
+ */
+static void sync_fence_signal_pt(struct sync_pt *pt)
+{
+	struct sync_fence *fence = pt->fence;
+	int status = pt->status;
+
+	if (status > 0 && !atomic_dec_and_test(&fence->pending))
+		return;
+
+	sync_fence_signal(fence, status);
+}
+
 int sync_fence_wait_async(struct sync_fence *fence,
 			  struct sync_fence_waiter *waiter)
 {
@@ -590,6 +723,7 @@ int sync_fence_wait(struct sync_fence *fence, long timeout)
 {
 	int err = 0;
 	struct sync_pt *pt;
+	bool signaled = sync_fence_check(fence);
 
 	trace_sync_wait(fence, 1);
 	list_for_each_entry(pt, &fence->pt_list_head, pt_list)
@@ -606,6 +740,9 @@ int sync_fence_wait(struct sync_fence *fence, long timeout)
 	}
 	trace_sync_wait(fence, 0);
 
+	if (!signaled && sync_fence_check(fence))
+		sync_fence_account_wake(fence);
+
 	if (err < 0)
 		return err;
 
@@ -628,19 +765,173 @@ int sync_fence_wait(struct sync_fence *fence, long timeout)
 }
 EXPORT_SYMBOL(sync_fence_wait);
 
+static void sync_fence_multi_free(struct kref *kref)
+{
+	struct sync_fence_multi *multi =
+		container_of(kref, struct sync_fence_multi, kref);
+
+	kfree(multi);
+}
+
+static void sync_fence_multi_fire(struct sync_fence_multi *multi,
+				  int status, int index)
+{
+	if (atomic_xchg(&multi->fired, 1))
+		return;
+
+	multi->status = status;
+	multi->index = index;
+	smp_wmb();
+	multi->done = 1;
+
+	if (multi->callback)
+		multi->callback(multi);
+	wake_up_all(&multi->wq);
+}
+
+static void sync_fence_multi_signaled(struct sync_fence_multi_entry *entry,
+				      int status)
+{
+	struct sync_fence_multi *multi = entry->multi;
+
+	if (status < 0 || !(multi->flags & SYNC_WAIT_ALL) ||
+	    atomic_dec_and_test(&multi->pending))
+		sync_fence_multi_fire(multi, status, entry->index);
+}
+
+static void sync_fence_multi_callback(struct sync_fence *fence,
+				      struct sync_fence_waiter *waiter)
+{
+	struct sync_fence_multi_entry *entry =
+		container_of(waiter, struct sync_fence_multi_entry, waiter);
+	struct sync_fence_multi *multi = entry->multi;
+
+	sync_fence_multi_signaled(entry, fence->status);
+	kref_put(&multi->kref, sync_fence_multi_free);
+}
+
+struct sync_fence_multi *sync_fence_multi_wait_async(struct sync_fence **fences,
+						     int count,
+						     unsigned int flags,
+						     sync_multi_callback_t callback,
+						     void *data)
+{
+	struct sync_fence_multi *multi;
+	int i, err;
+
+	if (count <= 0)
+		return ERR_PTR(-EINVAL);
+
+	multi = kzalloc(sizeof(*multi) + count * sizeof(multi->entries[0]),
+			GFP_KERNEL);
+	if (multi == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&multi->kref);
+	multi->flags = flags;
+	atomic_set(&multi->pending, count);
+	multi->callback = callback;
+	multi->data = data;
+	init_waitqueue_head(&multi->wq);
+	multi->count = count;
+
+	for (i = 0; i < count; i++) {
+		struct sync_fence_multi_entry *entry = &multi->entries[i];
+
+		/* a wait-any is complete as soon as one fence has signaled */
+		if (atomic_read(&multi->fired))
+			break;
+
+		entry->multi = multi;
+		entry->index = i;
+		sync_fence_waiter_init(&entry->waiter,
+				       sync_fence_multi_callback);
+
+		kref_get(&multi->kref);
+		err = sync_fence_wait_async(fences[i], &entry->waiter);
+		if (err) {
+			/* already signaled, the waiter was not queued */
+			kref_put(&multi->kref, sync_fence_multi_free);
+			sync_fence_multi_signaled(entry, err);
+			continue;
+		}
+		entry->fence = fences[i];
+	}
+
+	return multi;
+}
+EXPORT_SYMBOL(sync_fence_multi_wait_async);
+
+void sync_fence_multi_release(struct sync_fence_multi *multi)
+{
+	int i;
+
+	for (i = 0; i < multi->count; i++) {
+		struct sync_fence_multi_entry *entry = &multi->entries[i];
+
+		if (entry->fence &&
+		    !sync_fence_cancel_async(entry->fence, &entry->waiter))
+			kref_put(&multi->kref, sync_fence_multi_free);
+	}
+
+	kref_put(&multi->kref, sync_fence_multi_free);
+}
+EXPORT_SYMBOL(sync_fence_multi_release);
+
+static bool sync_fence_multi_check(struct sync_fence_multi *multi)
+{
+	/* pairs with the smp_wmb() in sync_fence_multi_fire() */
+	smp_rmb();
+	return multi->done;
+}
+
+int sync_fence_wait_multiple(struct sync_fence **fences, int count,
+			     unsigned int flags, long timeout, int *index)
+{
+	struct sync_fence_multi *multi;
+	bool signaled;
+	int err = 0;
+
+	multi = sync_fence_multi_wait_async(fences, count, flags, NULL, NULL);
+	if (IS_ERR(multi))
+		return PTR_ERR(multi);
+
+	signaled = sync_fence_multi_check(multi);
+	if (timeout > 0)
+		err = wait_event_interruptible_timeout(multi->wq,
+					sync_fence_multi_check(multi),
+					msecs_to_jiffies(timeout));
+	else if (timeout < 0)
+		err = wait_event_interruptible(multi->wq,
+					       sync_fence_multi_check(multi));
+
+	if (sync_fence_multi_check(multi)) {
+		if (!signaled)
+			sync_fence_account_wake(fences[multi->index]);
+		if (index)
+			*index = multi->index;
+		err = multi->status < 0 ? multi->status : 0;
+	} else if (err >= 0) {
+		err = -ETIME;
+	}
+
+	sync_fence_multi_release(multi);
+	return err;
+}
+EXPORT_SYMBOL(sync_fence_wait_multiple);
+
 static void sync_fence_free(struct kref *kref)
 {
 	struct sync_fence *fence = container_of(kref, struct sync_fence, kref);
 
 	sync_fence_free_pts(fence);
 
-	kfree(fence);
+	kmem_cache_free(sync_fence_cache, fence);
 }
 
 static int sync_fence_release(struct inode *inode, struct file *file)
 {
 	struct sync_fence *fence = file->private_data;
-	unsigned long flags;
 
 	/*
 	 * We need to remove all ways to access this fence before droping
@@ -648,9 +939,7 @@ static int sync_fence_release(struct inode *inode, struct file *file)
 	 *
 	 * start with its membership in the global fence list
 	 */
-	spin_lock_irqsave(&sync_fence_list_lock, flags);
-	list_del(&fence->sync_fence_list);
-	spin_unlock_irqrestore(&sync_fence_list_lock, flags);
+	sync_fence_debug_remove(fence);
 
 	/*
 	 * remove its pts from their parents so that sync_timeline_signal()
@@ -742,6 +1031,56 @@ err_put_fd:
 	return err;
 }
 
+static long sync_fence_ioctl_wait_multi(struct sync_fence *fence,
+					unsigned long arg)
+{
+	struct sync_wait_multi_data data;
+	struct sync_fence **fences;
+	__s32 *fds;
+	int i, n = 0;
+	long err;
+
+	if (copy_from_user(&data, (void __user *)arg, sizeof(data)))
+		return -EFAULT;
+
+	if (data.count == 0 || data.count > SYNC_WAIT_MULTI_MAX ||
+	    data.flags & ~SYNC_WAIT_ALL)
+		return -EINVAL;
+
+	fences = kmalloc(data.count * (sizeof(*fences) + sizeof(*fds)),
+			 GFP_KERNEL);
+	if (fences == NULL)
+		return -ENOMEM;
+	fds = (__s32 *)(fences + data.count);
+
+	if (copy_from_user(fds, (void __user *)(unsigned long)data.fds,
+			   data.count * sizeof(*fds))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	for (n = 0; n < data.count; n++) {
+		fences[n] = sync_fence_fdget(fds[n]);
+		if (fences[n] == NULL) {
+			err = -ENOENT;
+			goto out;
+		}
+	}
+
+	data.index = -1;
+	err = sync_fence_wait_multiple(fences, data.count, data.flags,
+				       data.timeout, &data.index);
+
+	if (copy_to_user((void __user *)arg, &data, sizeof(data)))
+		err = -EFAULT;
+
+out:
+	for (i = 0; i < n; i++)
+		sync_fence_put(fences[i]);
+	kfree(fences);
+	return err;
+}
+
 static int sync_fill_pt_info(struct sync_pt *pt, void *data, int size)
 {
 	struct sync_pt_info *info = data;
@@ -835,11 +1174,21 @@ static long sync_fence_ioctl(struct file *file, unsigned int cmd,
 	case SYNC_IOC_FENCE_INFO:
 		return sync_fence_ioctl_fence_info(fence, arg);
 
+	case SYNC_IOC_WAIT_MULTI:
+		return sync_fence_ioctl_wait_multi(fence, arg);
+
 	default:
 		return -ENOTTY;
 	}
 }
 
+static __init int sync_init(void)
+{
+	sync_fence_cache = KMEM_CACHE(sync_fence, SLAB_PANIC);
+	return 0;
+}
+core_initcall(sync_init);
+
 #ifdef CONFIG_DEBUG_FS
 static const char *sync_status_str(int status)
 {
@@ -977,9 +1326,46 @@ static const struct file_operations sync_debugfs_fops = {
 	.release        = single_release,
 };
 
+static int sync_stats_show(struct seq_file *s, void *unused)
+{
+	unsigned long flags;
+	u64 hist[SYNC_WAKE_BUCKETS];
+	u64 count, total_ns, max_ns;
+	int i;
+
+	spin_lock_irqsave(&sync_wake_stats_lock, flags);
+	count = sync_wake_stats.count;
+	total_ns = sync_wake_stats.total_ns;
+	max_ns = sync_wake_stats.max_ns;
+	memcpy(hist, sync_wake_stats.hist, sizeof(hist));
+	spin_unlock_irqrestore(&sync_wake_stats_lock, flags);
+
+	seq_printf(s, "signal to wakeup: %llu waits, avg %lluns, max %lluns\n",
+		   count, count ? div64_u64(total_ns, count) : 0, max_ns);
+	for (i = 0; i < SYNC_WAKE_BUCKETS - 1; i++)
+		seq_printf(s, "  < %6uus: %llu\n", 1 << i, hist[i]);
+	seq_printf(s, "  >= %5uus: %llu\n", 1 << (i - 1), hist[i]);
+
+	return 0;
+}
+
+static int sync_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sync_stats_show, inode->i_private);
+}
+
+static const struct file_operations sync_stats_fops = {
+	.open           = sync_stats_open,
+	.read           = seq_read,
+	.llseek         = seq_lseek,
+	.release        = single_release,
+};
+
 static __init int sync_debugfs_init(void)
 {
 	debugfs_create_file("sync", S_IRUGO, NULL, NULL, &sync_debugfs_fops);
+	debugfs_create_file("sync_stats", S_IRUGO, NULL, NULL,
+			    &sync_stats_fops);
 	return 0;
 }
 late_initcall(sync_debugfs_init);
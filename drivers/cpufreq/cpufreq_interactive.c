@@ -20,34 +20,60 @@
 #include <linux/cpu.h>
 #include <linux/cpumask.h>
 #include <linux/cpufreq.h>
+#include <linux/err.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/tick.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
 #include <linux/kthread.h>
-#include <linux/mutex.h>
 
 #include <asm/cputime.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/cpufreq_interactive.h>
 
-struct cpufreq_interactive_cpuinfo {
-	struct timer_list cpu_timer;
+/* Longest load history a policy keeps, in samples */
+#define MAX_LOAD_WINDOW 16
+
+/*
+ * All the cpus of a policy share one clock, so the load of all of them is
+ * evaluated together, from a single timer per policy.
+ */
+struct cpufreq_interactive_policyinfo {
+	struct timer_list policy_timer;
+	/* Protects the load samples, history and evaluation below */
+	spinlock_t load_lock;
 	int timer_idlecancel;
-	u64 time_in_idle;
-	u64 time_in_iowait;
-	u64 idle_exit_time;
 	u64 timer_run_time;
-	int idling;
 	u64 freq_change_time;
-	u64 freq_change_time_in_idle;
-	u64 freq_change_time_in_iowait;
 	u64 last_high_freq_time;
+	/* Busiest cpu's load of the last samples, a ring of load_hist_len */
+	unsigned int load_hist[MAX_LOAD_WINDOW];
+	unsigned int load_hist_idx;
+	unsigned int load_hist_len;
 	struct cpufreq_policy *policy;
 	struct cpufreq_frequency_table *freq_table;
 	unsigned int target_freq;
 	int governor_enabled;
+	/* sched_util_event seen since the last evaluation, 0 if none */
+	int sched_hint;
+};
+
+/* Indexed by policy->cpu */
+static DEFINE_PER_CPU(struct cpufreq_interactive_policyinfo, policyinfo);
+
+struct cpufreq_interactive_cpuinfo {
+	/* Idle and iowait times at time_wall, the start of the sample */
+	u64 time_in_idle;
+	u64 time_in_iowait;
+	u64 time_wall;
+	int idling;
+	struct cpufreq_interactive_policyinfo *ppol;
 };
 
 static DEFINE_PER_CPU(struct cpufreq_interactive_cpuinfo, cpuinfo);
@@ -76,6 +102,29 @@ static unsigned long io_is_busy;
  */
 static unsigned long sustain_load;
 
+/*
+ * Targeted load per frequency range, "load [freq:load ...]": each load
+ * applies from the frequency before it up to the next one. Takes over from
+ * sustain_load when set. Writing 0 clears it.
+ */
+static spinlock_t target_loads_lock;
+static unsigned int *target_loads;
+static int ntarget_loads;
+
+/*
+ * Number of samples averaged to pick the frequency under go_maxspeed_load.
+ * Bursts are still caught on the latest sample alone.
+ */
+#define DEFAULT_LOAD_WINDOW 3
+static unsigned long load_window;
+
+/*
+ * Load assumed on a cpu the scheduler just put a heavy task on, until a
+ * sample measures it. 0 ignores the scheduler's hints.
+ */
+#define DEFAULT_SCHED_HINT_LOAD DEFAULT_GO_MAXSPEED_LOAD
+static unsigned long sched_hint_load;
+
 /*
  * The minimum amount of time to spend at a frequency before we can ramp down.
  */
@@ -134,26 +183,114 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
+static unsigned int freq_to_targetload(unsigned int freq)
+{
+	int i;
+	unsigned int ret;
+	unsigned long flags;
+
+	spin_lock_irqsave(&target_loads_lock, flags);
+
+	/*
+	 * The table can be cleared after the caller saw it set; fall back
+	 * to the single sustain load it would have used instead.
+	 */
+	if (!ntarget_loads) {
+		spin_unlock_irqrestore(&target_loads_lock, flags);
+		ret = ACCESS_ONCE(sustain_load);
+		return ret ? ret : 100;
+	}
+
+	for (i = 0; i < ntarget_loads - 1 && freq >= target_loads[i+1]; i += 2)
+		;
+
+	ret = target_loads[i];
+	spin_unlock_irqrestore(&target_loads_lock, flags);
+	return ret;
+}
+
+/*
+ * Pick the lowest frequency at which the work done at policy->cur with
+ * this load runs at or below that frequency's target load. Target loads
+ * change with the frequency, so iterate until it settles.
+ */
+static unsigned int cpufreq_interactive_choose_freq(
+	struct cpufreq_interactive_policyinfo *ppol, unsigned int load)
+{
+	unsigned int loadadjfreq = load * ppol->policy->cur;
+	unsigned int freq = ppol->policy->cur;
+	unsigned int prevfreq, freqmin, freqmax;
+	unsigned int index;
+
+	freqmin = 0;
+	freqmax = UINT_MAX;
+
+	do {
+		prevfreq = freq;
+
+		if (cpufreq_frequency_table_target(
+			    ppol->policy, ppol->freq_table,
+			    loadadjfreq / freq_to_targetload(freq),
+			    CPUFREQ_RELATION_L, &index))
+			break;
+		freq = ppol->freq_table[index].frequency;
+
+		if (freq > prevfreq) {
+			/* The previous frequency is too low. */
+			freqmin = prevfreq;
+
+			if (freq >= freqmax) {
+				/* Use the highest frequency below freqmax. */
+				if (cpufreq_frequency_table_target(
+					    ppol->policy, ppol->freq_table,
+					    freqmax - 1, CPUFREQ_RELATION_H,
+					    &index))
+					break;
+				freq = ppol->freq_table[index].frequency;
+
+				if (freq == freqmin) {
+					/* Nothing in between, go with max. */
+					freq = freqmax;
+					break;
+				}
+			}
+		} else if (freq < prevfreq) {
+			/* The previous frequency is high enough. */
+			freqmax = prevfreq;
+
+			if (freq <= freqmin) {
+				/* Use the lowest frequency above freqmin. */
+				if (cpufreq_frequency_table_target(
+					    ppol->policy, ppol->freq_table,
+					    freqmin + 1, CPUFREQ_RELATION_L,
+					    &index))
+					break;
+				freq = ppol->freq_table[index].frequency;
+
+				if (freq == freqmax)
+					break;
+			}
+		}
+	} while (freq != prevfreq);
+
+	return freq;
+}
+
 static unsigned int cpufreq_interactive_get_target(
-	int cpu_load, int load_since_change, struct cpufreq_policy *policy)
+	struct cpufreq_interactive_policyinfo *ppol, int cpu_load,
+	int window_load)
 {
+	struct cpufreq_policy *policy = ppol->policy;
 	unsigned int target_freq;
 	unsigned int maxspeed_load = go_maxspeed_load;
 	unsigned int mboost = max_boost;
 
-	/*
-	 * Choose greater of short-term load (since last idle timer
-	 * started or timer function re-armed itself) or long-term load
-	 * (since last frequency change).
-	 */
-	if (load_since_change > cpu_load)
-		cpu_load = load_since_change;
-
 	if (midrange_freq && policy->cur > midrange_freq) {
 		maxspeed_load = midrange_go_maxspeed_load;
 		mboost = midrange_max_boost;
 	}
 
+	/* Bursts are judged on the latest sample alone */
 	if (cpu_load >= maxspeed_load) {
 		if (!boost_factor)
 			return policy->max;
@@ -164,10 +301,18 @@ static unsigned int cpufreq_interactive_get_target(
 			target_freq = policy->cur + mboost;
 	}
 	else {
+		/*
+		 * Below that, follow the load averaged over the window so a
+		 * single busy sample doesn't overshoot.
+		 */
+		if (ntarget_loads)
+			return cpufreq_interactive_choose_freq(ppol,
+							       window_load);
+
 		if (!sustain_load)
-			return policy->max * cpu_load / 100;
+			return policy->max * window_load / 100;
 
-		target_freq = policy->cur * cpu_load / sustain_load;
+		target_freq = policy->cur * window_load / sustain_load;
 	}
 
 	target_freq = min(target_freq, policy->max);
@@ -185,108 +330,180 @@ static inline cputime64_t get_cpu_iowait_time(
 	return iowait_time;
 }
 
-static void cpufreq_interactive_timer(unsigned long data)
+/*
+ * Start a new load sample on the cpu.
+ * Caller must hold the cpu's ppol->load_lock.
+ */
+static void cpufreq_interactive_sample_start(unsigned int cpu)
 {
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, cpu);
+
+	pcpu->time_in_idle = get_cpu_idle_time_us(cpu, &pcpu->time_wall);
+	pcpu->time_in_iowait = get_cpu_iowait_time(cpu, NULL);
+}
+
+/*
+ * Load of the cpu since its sample started, in percent of the current
+ * frequency, and start the next sample.
+ * Caller must hold the cpu's ppol->load_lock.
+ */
+static unsigned int cpufreq_interactive_cpu_load(unsigned int cpu)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, cpu);
+	u64 time_in_idle = pcpu->time_in_idle;
+	u64 time_in_iowait = pcpu->time_in_iowait;
+	u64 time_wall = pcpu->time_wall;
 	unsigned int delta_idle;
 	unsigned int delta_iowait;
 	unsigned int delta_time;
-	int cpu_load;
-	int load_since_change;
-	u64 time_in_idle;
-	u64 time_in_iowait;
-	u64 idle_exit_time;
-	struct cpufreq_interactive_cpuinfo *pcpu =
-		&per_cpu(cpuinfo, data);
-	u64 now_idle;
-	u64 now_iowait;
+
+	cpufreq_interactive_sample_start(cpu);
+
+	delta_idle = (unsigned int)(pcpu->time_in_idle - time_in_idle);
+	delta_iowait = (unsigned int)(pcpu->time_in_iowait - time_in_iowait);
+	delta_time = (unsigned int)(pcpu->time_wall - time_wall);
+
+	if (!io_is_busy)
+		delta_idle += delta_iowait;
+
+	if (!delta_time || delta_idle > delta_time)
+		return 0;
+
+	return 100 * (delta_time - delta_idle) / delta_time;
+}
+
+/*
+ * Record the load of the busiest cpu and return the average over the
+ * load window. Caller must hold ppol->load_lock.
+ */
+static unsigned int cpufreq_interactive_window_load(
+	struct cpufreq_interactive_policyinfo *ppol, unsigned int load)
+{
+	unsigned int window = clamp_t(unsigned int, load_window, 1,
+				      MAX_LOAD_WINDOW);
+	unsigned int sum = 0;
+	unsigned int i, idx;
+
+	ppol->load_hist_idx = (ppol->load_hist_idx + 1) % MAX_LOAD_WINDOW;
+	ppol->load_hist[ppol->load_hist_idx] = load;
+	if (ppol->load_hist_len < MAX_LOAD_WINDOW)
+		ppol->load_hist_len++;
+
+	window = min(window, ppol->load_hist_len);
+	for (i = 0, idx = ppol->load_hist_idx; i < window; i++) {
+		sum += ppol->load_hist[idx];
+		idx = idx ? idx - 1 : MAX_LOAD_WINDOW - 1;
+	}
+	return sum / window;
+}
+
+/*
+ * Caller must hold ppol->load_lock, which also keeps the timer from being
+ * armed again once GOV_STOP cleared governor_enabled.
+ */
+static void cpufreq_interactive_timer_start(
+	struct cpufreq_interactive_policyinfo *ppol)
+{
+	unsigned int cpu;
+
+	if (!ppol->governor_enabled)
+		return;
+
+	for_each_cpu(cpu, ppol->policy->cpus)
+		cpufreq_interactive_sample_start(cpu);
+	ppol->timer_run_time = ktime_to_us(ktime_get());
+	mod_timer(&ppol->policy_timer, jiffies + usecs_to_jiffies(timer_rate));
+}
+
+static bool cpufreq_interactive_all_idling(
+	struct cpufreq_interactive_policyinfo *ppol)
+{
+	unsigned int cpu;
+
+	smp_rmb();
+	for_each_cpu(cpu, ppol->policy->cpus)
+		if (!per_cpu(cpuinfo, cpu).idling)
+			return false;
+	return true;
+}
+
+static void cpufreq_interactive_timer(unsigned long data)
+{
+	struct cpufreq_interactive_policyinfo *ppol = (void *)data;
+	unsigned int cpu_load = 0;
+	unsigned int window_load;
+	unsigned int hint_load;
 	unsigned int new_freq;
 	unsigned int index;
+	unsigned int cpu;
 	unsigned long flags;
+	int hint;
+	u64 now;
 
 	smp_rmb();
 
-	if (!pcpu->governor_enabled)
-		goto exit;
-
-	/*
-	 * Once pcpu->timer_run_time is updated to >= pcpu->idle_exit_time,
-	 * this lets idle exit know the current idle time sample has
-	 * been processed, and idle exit can generate a new sample and
-	 * re-arm the timer.  This prevents a concurrent idle
-	 * exit on that CPU from writing a new set of info at the same time
-	 * the timer function runs (the timer function can't use that info
-	 * until more time passes).
-	 */
-	time_in_idle = pcpu->time_in_idle;
-	time_in_iowait = pcpu->time_in_iowait;
-	idle_exit_time = pcpu->idle_exit_time;
-	now_idle = get_cpu_idle_time_us(data, &pcpu->timer_run_time);
-	now_iowait = get_cpu_iowait_time(data, NULL);
-	smp_wmb();
-
-	/* If we raced with cancelling a timer, skip. */
-	if (!idle_exit_time)
-		goto exit;
+	if (!ppol->governor_enabled)
+		return;
 
-	delta_idle = (unsigned int)(now_idle - time_in_idle);
-	delta_iowait = (unsigned int)(now_iowait - time_in_iowait);
-	delta_time = (unsigned int)(pcpu->timer_run_time - idle_exit_time);
+	spin_lock_irqsave(&ppol->load_lock, flags);
 
 	/*
-	 * If timer ran less than 1ms after short-term sample started, retry.
+	 * If timer ran less than 1ms after the samples started, retry,
+	 * unless the scheduler asked for this evaluation.
 	 */
-	if (delta_time < 1000)
+	hint = xchg(&ppol->sched_hint, 0);
+	now = ktime_to_us(ktime_get());
+	if (!hint && now - ppol->timer_run_time < 1000)
 		goto rearm;
+	ppol->timer_run_time = now;
 
-	if (!io_is_busy)
-		delta_idle += delta_iowait;
-
-	if (delta_idle > delta_time)
-		cpu_load = 0;
-	else
-		cpu_load = 100 * (delta_time - delta_idle) / delta_time;
+	/* The policy has to keep up with its busiest cpu */
+	for_each_cpu_and(cpu, ppol->policy->cpus, cpu_online_mask)
+		cpu_load = max(cpu_load, cpufreq_interactive_cpu_load(cpu));
+	window_load = cpufreq_interactive_window_load(ppol, cpu_load);
 
-	delta_idle = (unsigned int)(now_idle - pcpu->freq_change_time_in_idle);
-	delta_iowait = (unsigned int)(now_iowait - pcpu->freq_change_time_in_iowait);
-	delta_time = (unsigned int)(pcpu->timer_run_time - pcpu->freq_change_time);
-
-	if (!io_is_busy)
-		delta_idle += delta_iowait;
-
-	if ((delta_time == 0) || (delta_idle > delta_time))
-		load_since_change = 0;
-	else
-		load_since_change =
-			100 * (delta_time - delta_idle) / delta_time;
 	/*
-	 * Combine short-term load (since last idle timer started or timer
-	 * function re-armed itself) and long-term load (since last frequency
-	 * change) to determine new target frequency
+	 * The samples can't have seen the load the hint is about yet, only
+	 * the history keeps what was measured.
 	 */
-	new_freq = cpufreq_interactive_get_target(cpu_load, load_since_change,
-						  pcpu->policy);
+	hint_load = sched_hint_load;
+	if (hint && hint_load) {
+		trace_cpufreq_interactive_hint(ppol->policy->cpu,
+			hint == SCHED_UTIL_MIGRATE ? "migrate" : "wakeup",
+			cpu_load, hint_load);
+		cpu_load = max(cpu_load, hint_load);
+	}
+
+	new_freq = cpufreq_interactive_get_target(ppol, cpu_load,
+						  window_load);
 
-	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
+	if (cpufreq_frequency_table_target(ppol->policy, ppol->freq_table,
 					   new_freq, CPUFREQ_RELATION_H,
 					   &index)) {
 		pr_warn_once("timer %d: cpufreq_frequency_table_target error\n",
-			     (int) data);
+			     ppol->policy->cpu);
 		goto rearm;
 	}
 
-	new_freq = pcpu->freq_table[index].frequency;
+	new_freq = ppol->freq_table[index].frequency;
 
-	if (pcpu->target_freq == new_freq)
+	if (ppol->target_freq == new_freq) {
+		trace_cpufreq_interactive_already(ppol->policy->cpu, cpu_load,
+						  ppol->target_freq, new_freq);
 		goto rearm_if_notmax;
+	}
 
 	/*
 	 * Do not scale down unless we have been at this frequency for the
 	 * minimum sample time.
 	 */
-	if (new_freq < pcpu->target_freq) {
-		if (pcpu->timer_run_time - pcpu->freq_change_time
-		    < min_sample_time)
+	if (new_freq < ppol->target_freq) {
+		if (ppol->timer_run_time - ppol->freq_change_time
+		    < min_sample_time) {
+			trace_cpufreq_interactive_notyet(ppol->policy->cpu,
+					cpu_load, ppol->target_freq, new_freq);
 			goto rearm;
+		}
 	}
 
 	/*
@@ -294,19 +511,21 @@ static void cpufreq_interactive_timer(unsigned long data)
 	 * maximum allowed normal frequency
 	 */
 	if (max_normal_freq && (new_freq > max_normal_freq)) {
-		if ((pcpu->timer_run_time - pcpu->last_high_freq_time)
+		if ((ppol->timer_run_time - ppol->last_high_freq_time)
 				< high_freq_min_delay) {
 			new_freq = max_normal_freq;
 		}
 		else {
-			pcpu->last_high_freq_time = pcpu->timer_run_time;
+			ppol->last_high_freq_time = ppol->timer_run_time;
 		}
 	}
 
-	pcpu->target_freq = new_freq;
-	spin_lock_irqsave(&speedchange_cpumask_lock, flags);
-	cpumask_set_cpu(data, &speedchange_cpumask);
-	spin_unlock_irqrestore(&speedchange_cpumask_lock, flags);
+	trace_cpufreq_interactive_target(ppol->policy->cpu, cpu_load,
+					 ppol->target_freq, new_freq);
+	ppol->target_freq = new_freq;
+	spin_lock(&speedchange_cpumask_lock);
+	cpumask_set_cpu(ppol->policy->cpu, &speedchange_cpumask);
+	spin_unlock(&speedchange_cpumask_lock);
 	wake_up_process(speedchange_task);
 
 rearm_if_notmax:
@@ -314,52 +533,47 @@ rearm_if_notmax:
 	 * Already set max speed and don't see a need to change that,
 	 * wait until next idle to re-evaluate, don't need timer.
 	 */
-	if (pcpu->target_freq == pcpu->policy->max)
+	if (ppol->target_freq == ppol->policy->max)
 		goto exit;
 
 rearm:
-	if (!timer_pending(&pcpu->cpu_timer)) {
+	if (!timer_pending(&ppol->policy_timer)) {
 		/*
-		 * If already at min: if that CPU is idle, don't set timer.
-		 * Else cancel the timer if that CPU goes idle.  We don't
-		 * need to re-evaluate speed until the next idle exit.
+		 * If already at min: if all the CPUs are idle, don't set
+		 * timer. Else cancel the timer once they all go idle.  We
+		 * don't need to re-evaluate speed until the next idle exit.
 		 */
-		if (pcpu->target_freq == pcpu->policy->min) {
-			smp_rmb();
-
-			if (pcpu->idling)
+		if (ppol->target_freq == ppol->policy->min) {
+			if (cpufreq_interactive_all_idling(ppol))
 				goto exit;
 
-			pcpu->timer_idlecancel = 1;
+			ppol->timer_idlecancel = 1;
 		}
 
-		pcpu->time_in_idle = get_cpu_idle_time_us(
-			data, &pcpu->idle_exit_time);
-		pcpu->time_in_iowait = get_cpu_iowait_time(
-			data, NULL);
-
-		mod_timer(&pcpu->cpu_timer,
+		mod_timer(&ppol->policy_timer,
 			  jiffies + usecs_to_jiffies(timer_rate));
 	}
 
 exit:
-	return;
+	spin_unlock_irqrestore(&ppol->load_lock, flags);
 }
 
 static void cpufreq_interactive_idle_start(void)
 {
 	struct cpufreq_interactive_cpuinfo *pcpu =
 		&per_cpu(cpuinfo, smp_processor_id());
+	struct cpufreq_interactive_policyinfo *ppol = pcpu->ppol;
+	unsigned long flags;
 	int pending;
 
-	if (!pcpu->governor_enabled)
+	if (!ppol || !ppol->governor_enabled)
 		return;
 
 	pcpu->idling = 1;
 	smp_wmb();
-	pending = timer_pending(&pcpu->cpu_timer);
+	pending = timer_pending(&ppol->policy_timer);
 
-	if (pcpu->target_freq != pcpu->policy->min) {
+	if (ppol->target_freq != ppol->policy->min) {
 #ifdef CONFIG_SMP
 		/*
 		 * Entering idle while not at lowest speed.  On some
@@ -370,31 +584,24 @@ static void cpufreq_interactive_idle_start(void)
 		 * the CPUFreq driver.
 		 */
 		if (!pending) {
-			pcpu->time_in_idle = get_cpu_idle_time_us(
-				smp_processor_id(), &pcpu->idle_exit_time);
-			pcpu->time_in_iowait = get_cpu_iowait_time(
-				smp_processor_id(), NULL);
-			pcpu->timer_idlecancel = 0;
-			mod_timer(&pcpu->cpu_timer,
-				  jiffies + usecs_to_jiffies(timer_rate));
+			spin_lock_irqsave(&ppol->load_lock, flags);
+			ppol->timer_idlecancel = 0;
+			cpufreq_interactive_timer_start(ppol);
+			spin_unlock_irqrestore(&ppol->load_lock, flags);
 		}
 #endif
 	} else {
 		/*
-		 * If at min speed and entering idle after load has
-		 * already been evaluated, and a timer has been set just in
-		 * case the CPU suddenly goes busy, cancel that timer.  The
-		 * CPU didn't go busy; we'll recheck things upon idle exit.
+		 * If at min speed and the last CPU of the policy is entering
+		 * idle after load has already been evaluated, and a timer
+		 * has been set just in case a CPU suddenly goes busy, cancel
+		 * that timer.  The CPUs didn't go busy; we'll recheck things
+		 * upon idle exit.
 		 */
-		if (pending && pcpu->timer_idlecancel) {
-			del_timer_sync(&pcpu->cpu_timer);
-			/*
-			 * Ensure last timer run time is after current idle
-			 * sample start time, so next idle exit will always
-			 * start a new idle sampling period.
-			 */
-			pcpu->idle_exit_time = 0;
-			pcpu->timer_idlecancel = 0;
+		if (pending && ppol->timer_idlecancel &&
+		    cpufreq_interactive_all_idling(ppol)) {
+			del_timer_sync(&ppol->policy_timer);
+			ppol->timer_idlecancel = 0;
 		}
 	}
 
@@ -404,46 +611,82 @@ static void cpufreq_interactive_idle_end(void)
 {
 	struct cpufreq_interactive_cpuinfo *pcpu =
 		&per_cpu(cpuinfo, smp_processor_id());
+	struct cpufreq_interactive_policyinfo *ppol = pcpu->ppol;
+	unsigned long flags;
 
-	if (!pcpu->governor_enabled)
+	if (!ppol || !ppol->governor_enabled)
 		return;
 
 	pcpu->idling = 0;
 	smp_wmb();
 
 	/*
-	 * Arm the timer for 1-2 ticks later if not already, and if the timer
-	 * function has already processed the previous load sampling
-	 * interval.  (If the timer is not pending but has not processed
-	 * the previous interval, it is probably racing with us on another
-	 * CPU.  Let it compute load based on the previous sample and then
-	 * re-arm the timer for another interval when it's done, rather
-	 * than updating the interval start time to be "now", which doesn't
-	 * give the timer function enough time to make a decision on this
-	 * run.)
+	 * Arm the timer for 1-2 ticks later if not already.  The samples
+	 * start now, so that the first evaluation after idle sees the load
+	 * that woke this CPU rather than the idle period before it.  The
+	 * timer function takes the same lock, so this can't race with an
+	 * evaluation on another CPU.
 	 */
-	if (timer_pending(&pcpu->cpu_timer) == 0 &&
-	    pcpu->timer_run_time >= pcpu->idle_exit_time &&
-	    pcpu->governor_enabled) {
-		pcpu->time_in_idle =
-			get_cpu_idle_time_us(smp_processor_id(),
-					     &pcpu->idle_exit_time);
-		pcpu->time_in_iowait =
-			get_cpu_iowait_time(smp_processor_id(),
-						NULL);
-		pcpu->timer_idlecancel = 0;
-		mod_timer(&pcpu->cpu_timer,
-			  jiffies + usecs_to_jiffies(timer_rate));
+	if (timer_pending(&ppol->policy_timer))
+		return;
+
+	spin_lock_irqsave(&ppol->load_lock, flags);
+	if (!timer_pending(&ppol->policy_timer)) {
+		ppol->timer_idlecancel = 0;
+		cpufreq_interactive_timer_start(ppol);
 	}
+	spin_unlock_irqrestore(&ppol->load_lock, flags);
+}
 
+/*
+ * Called from the scheduler with the rq lock held: the timer takes
+ * load_lock before waking the speedchange task, so only try for it here.
+ * If somebody holds it, the timer may already be past the point where it
+ * consumes the hint, so drop the hint and let the next wakeup retry.
+ */
+static int cpufreq_interactive_sched_notifier(struct notifier_block *nb,
+					      unsigned long val, void *data)
+{
+	struct sched_util_hint *hint = data;
+	struct cpufreq_interactive_policyinfo *ppol =
+		per_cpu(cpuinfo, hint->cpu).ppol;
+
+	if (!sched_hint_load || !ppol || !ppol->governor_enabled)
+		return NOTIFY_DONE;
+
+	/* Moving load between cpus of one clock doesn't change its needs */
+	if (val == SCHED_UTIL_MIGRATE &&
+	    per_cpu(cpuinfo, hint->src_cpu).ppol == ppol)
+		return NOTIFY_DONE;
+
+	if (ppol->target_freq == ppol->policy->max)
+		return NOTIFY_DONE;
+
+	if (xchg(&ppol->sched_hint, val))
+		return NOTIFY_DONE;
+
+	if (!spin_trylock(&ppol->load_lock)) {
+		cmpxchg(&ppol->sched_hint, val, 0);
+		return NOTIFY_DONE;
+	}
+
+	if (ppol->governor_enabled)
+		mod_timer(&ppol->policy_timer, jiffies);
+	spin_unlock(&ppol->load_lock);
+
+	return NOTIFY_OK;
 }
 
+static struct notifier_block cpufreq_interactive_sched_nb = {
+	.notifier_call = cpufreq_interactive_sched_notifier,
+};
+
 static int cpufreq_interactive_speedchange_task(void *data)
 {
 	unsigned int cpu;
 	cpumask_t tmp_mask;
 	unsigned long flags;
-	struct cpufreq_interactive_cpuinfo *pcpu;
+	struct cpufreq_interactive_policyinfo *ppol;
 
 	while (1) {
 		set_current_state(TASK_INTERRUPTIBLE);
@@ -465,33 +708,24 @@ static int cpufreq_interactive_speedchange_task(void *data)
 		cpumask_clear(&speedchange_cpumask);
 		spin_unlock_irqrestore(&speedchange_cpumask_lock, flags);
 
+		/* The mask holds the policy->cpu of the policies to change */
 		for_each_cpu(cpu, &tmp_mask) {
-			unsigned int j;
-			unsigned int max_freq = 0;
-
-			pcpu = &per_cpu(cpuinfo, cpu);
+			ppol = &per_cpu(policyinfo, cpu);
 			smp_rmb();
 
-			if (!pcpu->governor_enabled)
+			if (!ppol->governor_enabled)
 				continue;
 
-			for_each_cpu(j, pcpu->policy->cpus) {
-				struct cpufreq_interactive_cpuinfo *pjcpu =
-					&per_cpu(cpuinfo, j);
-
-				if (pjcpu->target_freq > max_freq)
-					max_freq = pjcpu->target_freq;
-			}
-
-			__cpufreq_driver_target(pcpu->policy,
-						max_freq,
+			__cpufreq_driver_target(ppol->policy,
+						ppol->target_freq,
 						CPUFREQ_RELATION_H);
+			trace_cpufreq_interactive_setspeed(cpu,
+						ppol->target_freq,
+						ppol->policy->cur);
 
-			pcpu->freq_change_time_in_idle =
-				get_cpu_idle_time_us(cpu,
-						     &pcpu->freq_change_time);
-			pcpu->freq_change_time_in_iowait =
-				get_cpu_iowait_time(cpu, NULL);
+			spin_lock_irqsave(&ppol->load_lock, flags);
+			ppol->freq_change_time = ktime_to_us(ktime_get());
+			spin_unlock_irqrestore(&ppol->load_lock, flags);
 		}
 	}
 
@@ -529,6 +763,7 @@ DECL_CPUFREQ_INTERACTIVE_ATTR(io_is_busy)
 DECL_CPUFREQ_INTERACTIVE_ATTR(max_boost)
 DECL_CPUFREQ_INTERACTIVE_ATTR(midrange_max_boost)
 DECL_CPUFREQ_INTERACTIVE_ATTR(sustain_load)
+DECL_CPUFREQ_INTERACTIVE_ATTR(sched_hint_load)
 DECL_CPUFREQ_INTERACTIVE_ATTR(min_sample_time)
 DECL_CPUFREQ_INTERACTIVE_ATTR(timer_rate)
 DECL_CPUFREQ_INTERACTIVE_ATTR(high_freq_min_delay)
@@ -536,6 +771,143 @@ DECL_CPUFREQ_INTERACTIVE_ATTR(max_normal_freq)
 
 #undef DECL_CPUFREQ_INTERACTIVE_ATTR
 
+static ssize_t show_load_window(struct kobject *kobj,
+	struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", load_window);
+}
+
+static ssize_t store_load_window(struct kobject *kobj,
+		struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	if (!val || val > MAX_LOAD_WINDOW)
+		return -EINVAL;
+	load_window = val;
+	return count;
+}
+
+static struct global_attr load_window_attr = __ATTR(load_window, 0644,
+		show_load_window, store_load_window);
+
+/* Parse "a[ :]b[ :]c..." into an array of an odd number of values */
+static unsigned int *get_tokenized_data(const char *buf, int *num_tokens)
+{
+	const char *cp;
+	int i;
+	int ntokens = 1;
+	unsigned int *tokenized_data;
+	int err = -EINVAL;
+
+	cp = buf;
+	while ((cp = strpbrk(cp + 1, " :")))
+		ntokens++;
+
+	if (!(ntokens & 0x1))
+		goto err;
+
+	tokenized_data = kmalloc(ntokens * sizeof(unsigned int), GFP_KERNEL);
+	if (!tokenized_data) {
+		err = -ENOMEM;
+		goto err;
+	}
+
+	cp = buf;
+	i = 0;
+	while (i < ntokens) {
+		if (sscanf(cp, "%u", &tokenized_data[i++]) != 1)
+			goto err_kfree;
+
+		cp = strpbrk(cp, " :");
+		if (!cp)
+			break;
+		cp++;
+	}
+
+	if (i != ntokens)
+		goto err_kfree;
+
+	*num_tokens = ntokens;
+	return tokenized_data;
+
+err_kfree:
+	kfree(tokenized_data);
+err:
+	return ERR_PTR(err);
+}
+
+static ssize_t show_target_loads(struct kobject *kobj,
+	struct attribute *attr, char *buf)
+{
+	int i;
+	ssize_t ret = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&target_loads_lock, flags);
+
+	if (!ntarget_loads)
+		ret = sprintf(buf, "0 ");
+
+	for (i = 0; i < ntarget_loads; i++)
+		ret += sprintf(buf + ret, "%u%s", target_loads[i],
+			       i & 0x1 ? ":" : " ");
+
+	buf[ret - 1] = '\n';
+	spin_unlock_irqrestore(&target_loads_lock, flags);
+	return ret;
+}
+
+static ssize_t store_target_loads(struct kobject *kobj,
+		struct attribute *attr, const char *buf, size_t count)
+{
+	int ntokens;
+	unsigned int *new_target_loads = NULL;
+	unsigned long flags;
+	int i;
+
+	new_target_loads = get_tokenized_data(buf, &ntokens);
+	if (IS_ERR(new_target_loads))
+		return PTR_ERR(new_target_loads);
+
+	if (ntokens == 1 && !new_target_loads[0]) {
+		/* Back to sustain_load */
+		kfree(new_target_loads);
+		new_target_loads = NULL;
+		ntokens = 0;
+	}
+
+	for (i = 0; i < ntokens; i++) {
+		if (i & 0x1) {
+			/* Frequencies have to go up */
+			if (i > 1 && new_target_loads[i] <=
+			    new_target_loads[i - 2])
+				goto err_inval;
+		} else if (!new_target_loads[i] ||
+			   new_target_loads[i] > 100) {
+			goto err_inval;
+		}
+	}
+
+	spin_lock_irqsave(&target_loads_lock, flags);
+	kfree(target_loads);
+	target_loads = new_target_loads;
+	ntarget_loads = ntokens;
+	spin_unlock_irqrestore(&target_loads_lock, flags);
+	return count;
+
+err_inval:
+	kfree(new_target_loads);
+	return -EINVAL;
+}
+
+static struct global_attr target_loads_attr = __ATTR(target_loads, 0644,
+		show_target_loads, store_target_loads);
+
 static struct attribute *interactive_attributes[] = {
 	&go_maxspeed_load_attr.attr,
 	&midrange_freq_attr.attr,
@@ -545,6 +917,9 @@ static struct attribute *interactive_attributes[] = {
 	&midrange_max_boost_attr.attr,
 	&io_is_busy_attr.attr,
 	&sustain_load_attr.attr,
+	&target_loads_attr.attr,
+	&load_window_attr.attr,
+	&sched_hint_load_attr.attr,
 	&min_sample_time_attr.attr,
 	&timer_rate_attr.attr,
 	&high_freq_min_delay_attr.attr,
@@ -577,44 +952,72 @@ static struct notifier_block cpufreq_interactive_idle_nb = {
 	.notifier_call = cpufreq_interactive_idle_notifier,
 };
 
+/*
+ * A cpu coming online has sampled nothing while it was down; start its
+ * sample afresh before the policy timer next looks at it.
+ */
+static int cpufreq_interactive_cpu_callback(struct notifier_block *nb,
+					    unsigned long action, void *hcpu)
+{
+	unsigned int cpu = (unsigned long)hcpu;
+	struct cpufreq_interactive_policyinfo *ppol;
+	unsigned long flags;
+
+	if ((action & ~CPU_TASKS_FROZEN) != CPU_ONLINE)
+		return NOTIFY_OK;
+
+	ppol = per_cpu(cpuinfo, cpu).ppol;
+	if (!ppol)
+		return NOTIFY_OK;
+
+	spin_lock_irqsave(&ppol->load_lock, flags);
+	cpufreq_interactive_sample_start(cpu);
+	spin_unlock_irqrestore(&ppol->load_lock, flags);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block cpufreq_interactive_cpu_nb = {
+	.notifier_call = cpufreq_interactive_cpu_callback,
+};
+
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event)
 {
 	int rc;
 	unsigned int j;
+	unsigned long flags;
 	struct cpufreq_interactive_cpuinfo *pcpu;
-	struct cpufreq_frequency_table *freq_table;
+	struct cpufreq_interactive_policyinfo *ppol;
 
 	switch (event) {
 	case CPUFREQ_GOV_START:
 		if (!cpu_online(policy->cpu))
 			return -EINVAL;
 
-		freq_table =
-			cpufreq_frequency_get_table(policy->cpu);
-
-		for_each_cpu(j, policy->cpus) {
+		ppol = &per_cpu(policyinfo, policy->cpu);
+		spin_lock_irqsave(&ppol->load_lock, flags);
+		ppol->policy = policy;
+		ppol->target_freq = policy->cur;
+		ppol->freq_table = cpufreq_frequency_get_table(policy->cpu);
+		ppol->freq_change_time = ktime_to_us(ktime_get());
+		if (!ppol->last_high_freq_time)
+			ppol->last_high_freq_time = ppol->freq_change_time;
+		ppol->load_hist_len = 0;
+		/*
+		 * Cpus that come online later join policy->cpus without the
+		 * governor being told, so point all related cpus at it now.
+		 */
+		for_each_cpu(j, policy->related_cpus) {
 			pcpu = &per_cpu(cpuinfo, j);
-			pcpu->policy = policy;
-			pcpu->target_freq = policy->cur;
-			pcpu->freq_table = freq_table;
-			pcpu->freq_change_time_in_idle =
-				get_cpu_idle_time_us(j,
-					     &pcpu->freq_change_time);
-			pcpu->time_in_idle = pcpu->freq_change_time_in_idle;
-			pcpu->idle_exit_time = pcpu->freq_change_time;
-			pcpu->freq_change_time_in_iowait =
-				get_cpu_iowait_time(j, NULL);
-			pcpu->time_in_iowait = pcpu->freq_change_time_in_iowait;
-			if (!pcpu->last_high_freq_time)
-				pcpu->last_high_freq_time = pcpu->freq_change_time;
-			pcpu->timer_idlecancel = 1;
-			pcpu->governor_enabled = 1;
-			smp_wmb();
-
-			if (!timer_pending(&pcpu->cpu_timer))
-				mod_timer(&pcpu->cpu_timer, jiffies + 2);
+			pcpu->idling = 0;
+			pcpu->ppol = ppol;
 		}
+		ppol->timer_idlecancel = 1;
+		ppol->governor_enabled = 1;
+		smp_wmb();
+		cpufreq_interactive_timer_start(ppol);
+		spin_unlock_irqrestore(&ppol->load_lock, flags);
 
 		mutex_lock(&gov_state_lock);
 		active_count++;
@@ -632,32 +1035,29 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 				return rc;
 			}
 			idle_notifier_register(&cpufreq_interactive_idle_nb);
+			sched_util_notifier_register(
+				&cpufreq_interactive_sched_nb);
 		}
 		mutex_unlock(&gov_state_lock);
 
 		break;
 
 	case CPUFREQ_GOV_STOP:
-		for_each_cpu(j, policy->cpus) {
-			pcpu = &per_cpu(cpuinfo, j);
-			pcpu->governor_enabled = 0;
-			smp_wmb();
-			del_timer_sync(&pcpu->cpu_timer);
-
-			/*
-			 * Reset idle exit time since we may cancel the timer
-			 * before it can run after the last idle exit time,
-			 * to avoid tripping the check in idle exit for a timer
-			 * that is trying to run.
-			 */
-			pcpu->idle_exit_time = 0;
-		}
+		ppol = &per_cpu(policyinfo, policy->cpu);
+		ppol->governor_enabled = 0;
+		smp_wmb();
+		/* Wait out anybody arming the timer before it was seen off */
+		spin_lock_irqsave(&ppol->load_lock, flags);
+		spin_unlock_irqrestore(&ppol->load_lock, flags);
+		del_timer_sync(&ppol->policy_timer);
 
 		mutex_lock(&gov_state_lock);
 		active_count--;
 
 		if (active_count == 0) {
 			idle_notifier_unregister(&cpufreq_interactive_idle_nb);
+			sched_util_notifier_unregister(
+				&cpufreq_interactive_sched_nb);
 
 			sysfs_remove_group(cpufreq_global_kobject,
 					&interactive_attr_group);
@@ -675,11 +1075,12 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 					policy->min, CPUFREQ_RELATION_L);
 
 		/* reschedule the timer if we stopped it */
-		pcpu = &per_cpu(cpuinfo, policy->cpu);
+		ppol = &per_cpu(policyinfo, policy->cpu);
 
-		if (pcpu && !timer_pending(&pcpu->cpu_timer))
-			mod_timer(&pcpu->cpu_timer,
-				jiffies + usecs_to_jiffies(timer_rate));
+		spin_lock_irqsave(&ppol->load_lock, flags);
+		if (!timer_pending(&ppol->policy_timer))
+			cpufreq_interactive_timer_start(ppol);
+		spin_unlock_irqrestore(&ppol->load_lock, flags);
 
 		break;
 	}
@@ -689,7 +1090,7 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 static int __init cpufreq_interactive_init(void)
 {
 	unsigned int i;
-	struct cpufreq_interactive_cpuinfo *pcpu;
+	struct cpufreq_interactive_policyinfo *ppol;
 	struct sched_param param = { .sched_priority = MAX_RT_PRIO-1 };
 
 	go_maxspeed_load = DEFAULT_GO_MAXSPEED_LOAD;
@@ -698,15 +1099,19 @@ static int __init cpufreq_interactive_init(void)
 	timer_rate = DEFAULT_TIMER_RATE;
 	high_freq_min_delay = DEFAULT_HIGH_FREQ_MIN_DELAY;
 	max_normal_freq = DEFAULT_MAX_NORMAL_FREQ;
+	load_window = DEFAULT_LOAD_WINDOW;
+	sched_hint_load = DEFAULT_SCHED_HINT_LOAD;
 
-	/* Initalize per-cpu timers */
+	/* Initalize per-policy timers, any cpu can own a policy */
 	for_each_possible_cpu(i) {
-		pcpu = &per_cpu(cpuinfo, i);
-		init_timer(&pcpu->cpu_timer);
-		pcpu->cpu_timer.function = cpufreq_interactive_timer;
-		pcpu->cpu_timer.data = i;
+		ppol = &per_cpu(policyinfo, i);
+		spin_lock_init(&ppol->load_lock);
+		init_timer(&ppol->policy_timer);
+		ppol->policy_timer.function = cpufreq_interactive_timer;
+		ppol->policy_timer.data = (unsigned long)ppol;
 	}
 
+	spin_lock_init(&target_loads_lock);
 	spin_lock_init(&speedchange_cpumask_lock);
 	speedchange_task =
 		kthread_create(cpufreq_interactive_speedchange_task, NULL,
@@ -720,6 +1125,8 @@ static int __init cpufreq_interactive_init(void)
 	/* NB: wake up so the thread does not look hung to the freezer */
 	wake_up_process(speedchange_task);
 
+	register_hotcpu_notifier(&cpufreq_interactive_cpu_nb);
+
 	return cpufreq_register_governor(&cpufreq_gov_interactive);
 }
 
@@ -732,8 +1139,10 @@ module_init(cpufreq_interactive_init);
 static void __exit cpufreq_interactive_exit(void)
 {
 	cpufreq_unregister_governor(&cpufreq_gov_interactive);
+	unregister_hotcpu_notifier(&cpufreq_interactive_cpu_nb);
 	kthread_stop(speedchange_task);
 	put_task_struct(speedchange_task);
+	kfree(target_loads);
 }
 
 module_exit(cpufreq_interactive_exit);
@@ -222,23 +222,34 @@ err:
 	return ERR_PTR(ret);
 }
 
-static void ion_buffer_destroy(struct kref *kref)
+void ion_buffer_destroy(struct ion_buffer *buffer)
 {
-	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
-	struct ion_device *dev = buffer->dev;
-
 	if (WARN_ON(buffer->kmap_cnt > 0))
 		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
 	buffer->heap->ops->unmap_dma(buffer->heap, buffer);
 	buffer->heap->ops->free(buffer);
-	mutex_lock(&dev->buffer_lock);
-	rb_erase(&buffer->node, &dev->buffers);
-	mutex_unlock(&dev->buffer_lock);
 	if (buffer->flags & ION_FLAG_CACHED)
 		kfree(buffer->dirty);
 	kfree(buffer);
 }
 
+static void _ion_buffer_destroy(struct kref *kref)
+{
+	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
+	struct ion_heap *heap = buffer->heap;
+	struct ion_device *dev = buffer->dev;
+
+	mutex_lock(&dev->buffer_lock);
+	rb_erase(&buffer->node, &dev->buffers);
+	mutex_unlock(&dev->buffer_lock);
+
+	if ((heap->flags & ION_HEAP_FLAG_DEFER_FREE) &&
+	    !IS_ERR_OR_NULL(heap->task))
+		ion_heap_freelist_add(heap, buffer);
+	else
+		ion_buffer_destroy(buffer);
+}
+
 void ion_buffer_get(struct ion_buffer *buffer)
 {
 	kref_get(&buffer->ref);
@@ -246,7 +257,7 @@ void ion_buffer_get(struct ion_buffer *buffer)
 
 static int ion_buffer_put(struct ion_buffer *buffer)
 {
-	return kref_put(&buffer->ref, ion_buffer_destroy);
+	return kref_put(&buffer->ref, _ion_buffer_destroy);
 }
 
 static void ion_buffer_add_to_handle(struct ion_buffer *buffer)
@@ -1171,6 +1182,22 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		ion_sync_for_device(client, data.fd);
 		break;
 	}
+	case ION_IOC_DRAIN:
+	{
+		struct ion_device *dev = client->dev;
+		struct rb_node *n;
+
+		down_read(&dev->lock);
+		for (n = rb_first(&dev->heaps); n; n = rb_next(n)) {
+			struct ion_heap *heap = rb_entry(n, struct ion_heap,
+							 node);
+
+			if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+				ion_heap_freelist_drain(heap, 0);
+		}
+		up_read(&dev->lock);
+		break;
+	}
 	case ION_IOC_CUSTOM:
 	{
 		struct ion_device *dev = client->dev;
@@ -1290,7 +1317,7 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 	seq_printf(s, "%16.s %16u\n", "total ", total_size);
 	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
 		seq_printf(s, "%16.s %16u\n", "deferred free",
-				heap->free_list_size);
+				ion_heap_freelist_size(heap));
 	seq_printf(s, "----------------------------------------------------\n");
 
 	if (heap->debug_show)
@@ -1311,6 +1338,27 @@ static const struct file_operations debug_heap_fops = {
 	.release = single_release,
 };
 
+/* reading gives the bytes waiting on the deferred free list, writing
+   frees at least that many bytes of them now, 0 meaning all */
+static int debug_drain_set(void *data, u64 val)
+{
+	struct ion_heap *heap = data;
+
+	ion_heap_freelist_drain(heap, val);
+	return 0;
+}
+
+static int debug_drain_get(void *data, u64 *val)
+{
+	struct ion_heap *heap = data;
+
+	*val = ion_heap_freelist_size(heap);
+	return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(debug_drain_fops, debug_drain_get, debug_drain_set,
+			"%llu\n");
+
 void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 {
 	struct rb_node **p = &dev->heaps.rb_node;
@@ -1322,6 +1370,11 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 		pr_err("%s: can not add heap with invalid ops struct.\n",
 		       __func__);
 
+	/* Without the thread, buffers are freed as they are released */
+	if ((heap->flags & ION_HEAP_FLAG_DEFER_FREE) &&
+	    ion_heap_init_deferred_free(heap))
+		heap->flags &= ~ION_HEAP_FLAG_DEFER_FREE;
+
 	heap->dev = dev;
 	down_write(&dev->lock);
 	while (*p) {
@@ -1343,6 +1396,13 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 	rb_insert_color(&heap->node, &dev->heaps);
 	debugfs_create_file(heap->name, 0664, dev->debug_root, heap,
 			    &debug_heap_fops);
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE) {
+		char debug_name[64];
+
+		snprintf(debug_name, 64, "%s_drain", heap->name);
+		debugfs_create_file(debug_name, 0644, dev->debug_root, heap,
+				    &debug_drain_fops);
+	}
 end:
 	up_write(&dev->lock);
 }
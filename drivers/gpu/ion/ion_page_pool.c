@@ -0,0 +1,401 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/dma-mapping.h>
+#include <linux/err.h>
+#include <linux/freezer.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/vmalloc.h>
+#include <linux/vmstat.h>
+#include <linux/wait.h>
+#include "ion_priv.h"
+
+/* how long the prefill worker stays away after the shrinker has run */
+#define ION_PAGE_POOL_BACKOFF	HZ
+
+/*
+ * All pools, highest order first so the shrinker gives back the largest
+ * blocks before breaking into the small ones.  Readers (the worker and
+ * the shrinker) never hold a pool's mutex across zeroing or allocation,
+ * so the shrinker can always make progress.
+ */
+static DECLARE_RWSEM(pools_sem);
+static LIST_HEAD(pools);
+
+static struct task_struct *pool_task;
+static struct vm_struct *pool_vm;
+static DECLARE_WAIT_QUEUE_HEAD(pool_wait);
+static atomic_t pool_kicked = ATOMIC_INIT(0);
+static unsigned long pool_last_shrink;
+
+static void ion_page_pool_kick(void)
+{
+	atomic_set(&pool_kicked, 1);
+	wake_up(&pool_wait);
+}
+
+static struct page *ion_page_pool_alloc_pages(struct ion_page_pool *pool,
+					      gfp_t gfp_mask)
+{
+	struct page *page = alloc_pages(gfp_mask, pool->order);
+
+	if (!page)
+		return NULL;
+	/* this is only being used to flush the page for dma,
+	   this api is not really suitable for calling from a driver
+	   but no better way to flush a page for dma exist at this time */
+	__dma_page_cpu_to_dev(page, 0, PAGE_SIZE << pool->order,
+			      DMA_BIDIRECTIONAL);
+	return page;
+}
+
+/*
+ * Zero a block through an uncached mapping: the pool's purpose is to keep
+ * its pages out of the cache, so there is nothing to flush afterwards.
+ */
+static void ion_page_pool_zero(struct ion_page_pool *pool, struct page *page,
+			       struct vm_struct *vm_struct)
+{
+	int i;
+
+	for (i = 0; i < (1 << pool->order); i++) {
+		struct page *sub_page = page + i;
+		struct page **pages = &sub_page;
+
+		map_vm_area(vm_struct, pgprot_writecombine(PAGE_KERNEL),
+			    &pages);
+		memset(vm_struct->addr, 0, PAGE_SIZE);
+		unmap_kernel_range((unsigned long)vm_struct->addr, PAGE_SIZE);
+	}
+}
+
+static struct page *ion_page_pool_remove(struct list_head *items)
+{
+	struct page *page = list_first_entry(items, struct page, lru);
+
+	list_del(&page->lru);
+	return page;
+}
+
+void *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page = NULL;
+	bool dirty = false;
+	bool kick;
+	int i;
+
+	BUG_ON(!pool);
+
+	mutex_lock(&pool->mutex);
+	if (pool->count) {
+		page = ion_page_pool_remove(&pool->items);
+		pool->count--;
+		pool->hits++;
+	} else if (pool->dirty_count) {
+		page = ion_page_pool_remove(&pool->dirty_items);
+		pool->dirty_count--;
+		pool->sync_zeroed++;
+		dirty = true;
+	} else {
+		pool->misses++;
+	}
+	kick = pool->count + pool->dirty_count < pool->target;
+	mutex_unlock(&pool->mutex);
+
+	if (kick)
+		ion_page_pool_kick();
+
+	if (!page)
+		return ion_page_pool_alloc_pages(pool, pool->gfp_mask);
+
+	if (dirty) {
+		/* the worker has not got to it yet, zero it like a new page */
+		for (i = 0; i < (1 << pool->order); i++)
+			clear_highpage(page + i);
+		__dma_page_cpu_to_dev(page, 0, PAGE_SIZE << pool->order,
+				      DMA_BIDIRECTIONAL);
+	}
+	return page;
+}
+
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	mutex_lock(&pool->mutex);
+	list_add(&page->lru, &pool->dirty_items);
+	pool->dirty_count++;
+	mutex_unlock(&pool->mutex);
+
+	ion_page_pool_kick();
+}
+
+void ion_page_pool_set_target(struct ion_page_pool *pool, unsigned int target)
+{
+	mutex_lock(&pool->mutex);
+	pool->target = min_t(unsigned int, target,
+			     ION_PAGE_POOL_HIGH_WM >> pool->order);
+	mutex_unlock(&pool->mutex);
+
+	ion_page_pool_kick();
+}
+
+static void ion_page_pool_zero_dirty(struct ion_page_pool *pool,
+				     struct vm_struct *vm_struct)
+{
+	struct page *page;
+
+	while (!kthread_should_stop()) {
+		mutex_lock(&pool->mutex);
+		if (!pool->dirty_count) {
+			mutex_unlock(&pool->mutex);
+			break;
+		}
+		page = ion_page_pool_remove(&pool->dirty_items);
+		pool->dirty_count--;
+		mutex_unlock(&pool->mutex);
+
+		ion_page_pool_zero(pool, page, vm_struct);
+
+		mutex_lock(&pool->mutex);
+		list_add(&page->lru, &pool->items);
+		pool->count++;
+		mutex_unlock(&pool->mutex);
+
+		cond_resched();
+	}
+}
+
+/*
+ * Only prefill while nobody is reclaiming and the allocation leaves free
+ * memory above the zones' reserves, so filling the pools never pushes the
+ * system into reclaim itself.  How far a pool is filled is bounded by its
+ * target, itself capped at ION_PAGE_POOL_HIGH_WM.
+ */
+static bool ion_page_pool_can_prefill(struct ion_page_pool *pool)
+{
+	if (time_before(jiffies, pool_last_shrink + ION_PAGE_POOL_BACKOFF))
+		return false;
+	return global_page_state(NR_FREE_PAGES) >
+		totalreserve_pages + (1 << pool->order);
+}
+
+static void ion_page_pool_prefill(struct ion_page_pool *pool)
+{
+	gfp_t gfp_mask = (pool->gfp_mask | __GFP_NORETRY | __GFP_NOWARN |
+			  __GFP_NO_KSWAPD | __GFP_NOMEMALLOC) & ~__GFP_WAIT;
+	struct page *page;
+	bool need;
+
+	while (!kthread_should_stop() && ion_page_pool_can_prefill(pool)) {
+		mutex_lock(&pool->mutex);
+		need = pool->count + pool->dirty_count < pool->target;
+		mutex_unlock(&pool->mutex);
+		if (!need)
+			break;
+
+		page = ion_page_pool_alloc_pages(pool, gfp_mask);
+		if (!page)
+			break;
+
+		mutex_lock(&pool->mutex);
+		list_add_tail(&page->lru, &pool->items);
+		pool->count++;
+		pool->prefilled++;
+		mutex_unlock(&pool->mutex);
+
+		cond_resched();
+	}
+}
+
+/*
+ * Runs as SCHED_IDLE so zeroing and prefilling only use otherwise idle
+ * cpu time.
+ */
+static int ion_page_pool_thread(void *data)
+{
+	struct sched_param param = { .sched_priority = 0 };
+	struct vm_struct *vm_struct = data;
+	struct ion_page_pool *pool;
+
+	sched_setscheduler(current, SCHED_IDLE, &param);
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(pool_wait,
+				     atomic_xchg(&pool_kicked, 0) ||
+				     kthread_should_stop());
+
+		down_read(&pools_sem);
+		list_for_each_entry(pool, &pools, list)
+			ion_page_pool_zero_dirty(pool, vm_struct);
+		list_for_each_entry(pool, &pools, list)
+			ion_page_pool_prefill(pool);
+		up_read(&pools_sem);
+	}
+
+	return 0;
+}
+
+/*
+ * ion_page_pool_shrink_one - release blocks from a pool until at least
+ * 'nr_to_scan' pages went back to the system, dirty blocks first since no
+ * zeroing has been spent on them.  Returns the number of pages released.
+ */
+static int ion_page_pool_shrink_one(struct ion_page_pool *pool, int nr_to_scan)
+{
+	struct page *page;
+	int freed = 0;
+
+	mutex_lock(&pool->mutex);
+	while (freed < nr_to_scan) {
+		if (pool->dirty_count) {
+			page = ion_page_pool_remove(&pool->dirty_items);
+			pool->dirty_count--;
+		} else if (pool->count) {
+			page = ion_page_pool_remove(&pool->items);
+			pool->count--;
+		} else {
+			break;
+		}
+		__free_pages(page, pool->order);
+		pool->shrunk++;
+		freed += 1 << pool->order;
+	}
+	mutex_unlock(&pool->mutex);
+
+	return freed;
+}
+
+static int ion_page_pool_shrink(struct shrinker *shrinker,
+				struct shrink_control *sc)
+{
+	struct ion_page_pool *pool;
+	int nr_to_scan = sc->nr_to_scan;
+	int total = 0;
+
+	if (nr_to_scan)
+		pool_last_shrink = jiffies;
+
+	if (!down_read_trylock(&pools_sem))
+		return -1;
+
+	list_for_each_entry(pool, &pools, list) {
+		if (nr_to_scan > 0)
+			nr_to_scan -= ion_page_pool_shrink_one(pool,
+							       nr_to_scan);
+		mutex_lock(&pool->mutex);
+		total += (pool->count + pool->dirty_count) << pool->order;
+		mutex_unlock(&pool->mutex);
+	}
+	up_read(&pools_sem);
+
+	return total;
+}
+
+static struct shrinker ion_page_pool_shrinker = {
+	.shrink = ion_page_pool_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/* Called with pools_sem held for writing when the first pool is created. */
+static void ion_page_pool_start(void)
+{
+	struct task_struct *task;
+
+	register_shrinker(&ion_page_pool_shrinker);
+
+	pool_vm = get_vm_area(PAGE_SIZE, VM_ALLOC);
+	if (!pool_vm)
+		goto err;
+
+	pool_last_shrink = jiffies - ION_PAGE_POOL_BACKOFF;
+	task = kthread_run(ion_page_pool_thread, pool_vm, "ion_pool");
+	if (IS_ERR(task)) {
+		free_vm_area(pool_vm);
+		pool_vm = NULL;
+		goto err;
+	}
+	pool_task = task;
+	return;
+err:
+	/* allocations will zero freed pages themselves */
+	pr_err("%s: could not start the pool thread\n", __func__);
+}
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
+{
+	struct ion_page_pool *pool = kzalloc(sizeof(struct ion_page_pool),
+					     GFP_KERNEL);
+	struct ion_page_pool *entry;
+
+	if (!pool)
+		return NULL;
+	INIT_LIST_HEAD(&pool->items);
+	INIT_LIST_HEAD(&pool->dirty_items);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+	mutex_init(&pool->mutex);
+
+	down_write(&pools_sem);
+	if (list_empty(&pools))
+		ion_page_pool_start();
+	list_for_each_entry(entry, &pools, list)
+		if (entry->order < order)
+			break;
+	list_add_tail(&pool->list, &entry->list);
+	up_write(&pools_sem);
+
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	struct task_struct *task = NULL;
+	struct vm_struct *vm_struct = NULL;
+
+	down_write(&pools_sem);
+	list_del(&pool->list);
+	if (list_empty(&pools)) {
+		unregister_shrinker(&ion_page_pool_shrinker);
+		task = pool_task;
+		vm_struct = pool_vm;
+		pool_task = NULL;
+		pool_vm = NULL;
+	}
+	up_write(&pools_sem);
+
+	if (task)
+		kthread_stop(task);
+	if (vm_struct)
+		free_vm_area(vm_struct);
+
+	while (pool->dirty_count) {
+		__free_pages(ion_page_pool_remove(&pool->dirty_items),
+			     pool->order);
+		pool->dirty_count--;
+	}
+	while (pool->count) {
+		__free_pages(ion_page_pool_remove(&pool->items), pool->order);
+		pool->count--;
+	}
+	kfree(pool);
+}
@@ -22,6 +22,9 @@
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
 #include <linux/sched.h>
+#include <linux/shrinker.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include <linux/ion.h>
 #include <linux/miscdevice.h>
 
@@ -57,6 +60,8 @@ int ion_remap_dma(struct ion_client *client,
  * struct ion_buffer - metadata for a particular buffer
  * @ref:		refernce count
  * @node:		node in the ion_device buffers tree
+ * @list:		element in the heap's deferred free list, once the
+ *			buffer has left the buffers tree
  * @dev:		back pointer to the ion_device
  * @heap:		back pointer to the heap the buffer came from
  * @flags:		buffer specific flags
@@ -80,12 +85,19 @@ int ion_remap_dma(struct ion_client *client,
  * @pid:		pid of last client to reference this buffer in a
  *			handle, used for debugging
 */
+/* the shrinker is freeing the buffer, so its pages skip the page pools */
+#define ION_PRIV_FLAG_SHRINKER_FREE (1 << 0)
+
 struct ion_buffer {
 	struct kref ref;
-	struct rb_node node;
+	union {
+		struct rb_node node;
+		struct list_head list;
+	};
 	struct ion_device *dev;
 	struct ion_heap *heap;
 	unsigned long flags;
+	unsigned long private_flags;
 	size_t size;
 	union {
 		void *priv_virt;
@@ -133,18 +145,30 @@ struct ion_heap_ops {
 			 struct vm_area_struct *vma);
 };
 
+/**
+ * heap flags - flags between the heaps and core ion code
+ */
+#define ION_HEAP_FLAG_DEFER_FREE (1 << 0)
+
 /**
  * struct ion_heap - represents a heap in the system
  * @node:		rb node to put the heap on the device's tree of heaps
  * @dev:		back pointer to the ion_device
  * @type:		type of heap
  * @ops:		ops struct as above
+ * @flags:		flags
  * @id:			id of heap, also indicates priority of this heap when
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
  * @debug_show:		called when heap debug file is read to add any
  *			heap specific debug info to output
+ * @free_list:		free list head if deferred free is used
+ * @free_list_size	size of the deferred free list in bytes
+ * @free_lock:		protects the free list
+ * @waitqueue:		queue to wait on from deferred free thread
+ * @task:		task struct of deferred free thread
+ * @shrinker:		drains the free list under memory pressure
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -156,9 +180,16 @@ struct ion_heap {
 	struct ion_device *dev;
 	enum ion_heap_type type;
 	struct ion_heap_ops *ops;
+	unsigned long flags;
 	int id;
 	const char *name;
 	int (*debug_show)(struct ion_heap *heap, struct seq_file *, void *);
+	struct list_head free_list;
+	size_t free_list_size;
+	spinlock_t free_lock;
+	wait_queue_head_t waitqueue;
+	struct task_struct *task;
+	struct shrinker shrinker;
 };
 
 /**
@@ -211,6 +242,61 @@ void ion_heap_unmap_kernel(struct ion_heap *, struct ion_buffer *);
 int ion_heap_map_user(struct ion_heap *, struct ion_buffer *,
 			struct vm_area_struct *);
 
+/**
+ * ion_buffer_destroy - release a buffer's memory back to its heap
+ * @buffer:		buffer that has already been removed from the device
+ */
+void ion_buffer_destroy(struct ion_buffer *buffer);
+
+/**
+ * ion_heap_init_deferred_free -- initialize deferred free functionality
+ * @heap:		the heap
+ *
+ * If a heap sets the ION_HEAP_FLAG_DEFER_FREE flag this function will
+ * be called to setup deferred frees.  Calls to free the buffer will
+ * return immediately and the actual free will occur some time later,
+ * from a low priority thread, or from the heap's shrinker when memory
+ * is needed sooner.
+ */
+int ion_heap_init_deferred_free(struct ion_heap *heap);
+
+/**
+ * ion_heap_freelist_add - add a buffer to the deferred free list
+ * @heap:		the heap
+ * @buffer:		the buffer
+ *
+ * Adds an item to the deferred freelist.
+ */
+void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer);
+
+/**
+ * ion_heap_freelist_drain - drain the deferred free list
+ * @heap:		the heap
+ * @size:		amount of memory to drain in bytes, 0 for everything
+ *
+ * Frees buffers from the deferred free list in the caller's context
+ * until at least size bytes have been released.  Returns the number of
+ * bytes drained.
+ */
+size_t ion_heap_freelist_drain(struct ion_heap *heap, size_t size);
+
+/**
+ * ion_heap_freelist_shrink - drain the deferred free list for reclaim
+ * @heap:		the heap
+ * @size:		amount of memory to drain in bytes
+ *
+ * Like ion_heap_freelist_drain(), but the buffers' pages go back to the
+ * page allocator rather than into the heap's page pools, so what is
+ * drained is actually reclaimed.
+ */
+size_t ion_heap_freelist_shrink(struct ion_heap *heap, size_t size);
+
+/**
+ * ion_heap_freelist_size - returns the size of the freelist in bytes
+ * @heap:		the heap
+ */
+size_t ion_heap_freelist_size(struct ion_heap *heap);
+
 
 /**
  * functions for creating and destroying the built in ion heaps.
@@ -256,4 +342,62 @@ static inline void ion_iommu_heap_destroy(struct ion_heap *)
  */
 #define ION_CARVEOUT_ALLOCATE_FAIL -1
 
+/**
+ * functions for creating and destroying a heap pool -- allows you
+ * to keep a pool of pre allocated pages to use from your heap.  Keeping
+ * a pool of pages that is ready for dma, ie any cached mapping have been
+ * invalidated from the cache, provides a significant peformance benefit on
+ * many systems
+ */
+
+/* most pages the prefill worker keeps in one pool, whatever the target */
+#define ION_PAGE_POOL_HIGH_WM	((16 << 20) >> PAGE_SHIFT)
+
+/**
+ * struct ion_page_pool - pagepool struct
+ * @count:		number of zeroed blocks ready to be handed out
+ * @dirty_count:	number of freed blocks waiting to be zeroed
+ * @target:		number of blocks the prefill worker keeps in the pool,
+ *			at most ION_PAGE_POOL_HIGH_WM pages' worth
+ * @hits:		allocations served by a zeroed block from the pool
+ * @sync_zeroed:	allocations served by a block zeroed on the spot
+ * @misses:		allocations that went to the page allocator
+ * @prefilled:		blocks added by the prefill worker
+ * @shrunk:		blocks released to the system by the shrinker
+ * @mutex:		protects the lists and counts
+ * @items:		list of zeroed blocks
+ * @dirty_items:	list of blocks still holding their previous contents
+ * @gfp_mask:		gfp_mask to use from alloc
+ * @order:		order of pages in the pool
+ * @list:		entry in the list of all pools
+ *
+ * Blocks are threaded through page->lru.  Freed blocks are zeroed by a
+ * background thread rather than on the free path; a block is never handed
+ * out before it has been zeroed.  The same thread tops the pool up to
+ * @target while memory is plentiful, and a shrinker hands pooled blocks
+ * back under memory pressure.
+ */
+struct ion_page_pool {
+	int count;
+	int dirty_count;
+	unsigned int target;
+	unsigned long hits;
+	unsigned long sync_zeroed;
+	unsigned long misses;
+	unsigned long prefilled;
+	unsigned long shrunk;
+	struct mutex mutex;
+	struct list_head items;
+	struct list_head dirty_items;
+	gfp_t gfp_mask;
+	unsigned int order;
+	struct list_head list;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+void *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+void ion_page_pool_set_target(struct ion_page_pool *, unsigned int target);
+
 #endif /* _ION_PRIV_H */
@@ -20,6 +20,8 @@
 #include <linux/highmem.h>
 #include <linux/ion.h>
 #include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <linux/scatterlist.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
@@ -51,8 +53,55 @@ static unsigned int order_to_size(int order)
 struct ion_system_heap {
 	struct ion_heap heap;
 	struct ion_page_pool **pools;
+	struct list_head list;
 };
 
+static DEFINE_MUTEX(system_heaps_lock);
+static LIST_HEAD(system_heaps);
+
+/*
+ * Number of blocks of each order, in the order of orders[], that the pool
+ * worker keeps zeroed and ready while memory is plentiful, so large
+ * uncached allocations do not have to go to the page allocator.  Each
+ * pool caps its target at ION_PAGE_POOL_HIGH_WM pages.
+ */
+static unsigned int prefill_target[] = {0, 0, 0};
+
+static int prefill_target_set(const char *val, const struct kernel_param *kp)
+{
+	struct ion_system_heap *sys_heap;
+	int ret, i;
+
+	mutex_lock(&system_heaps_lock);
+	ret = param_array_ops.set(val, kp);
+	if (!ret)
+		list_for_each_entry(sys_heap, &system_heaps, list)
+			for (i = 0; i < num_orders; i++)
+				ion_page_pool_set_target(sys_heap->pools[i],
+							 prefill_target[i]);
+	mutex_unlock(&system_heaps_lock);
+	return ret;
+}
+
+static int prefill_target_get(char *buffer, const struct kernel_param *kp)
+{
+	return param_array_ops.get(buffer, kp);
+}
+
+static struct kernel_param_ops prefill_target_ops = {
+	.set = prefill_target_set,
+	.get = prefill_target_get,
+};
+
+static struct kparam_array prefill_target_arr = {
+	.max = ARRAY_SIZE(prefill_target),
+	.elemsize = sizeof(prefill_target[0]),
+	.ops = &param_ops_uint,
+	.elem = prefill_target,
+};
+module_param_cb(prefill_target, &prefill_target_ops, &prefill_target_arr,
+		S_IRUGO | S_IWUSR);
+
 struct page_info {
 	struct page *page;
 	unsigned int order;
@@ -91,28 +140,16 @@ static struct page *alloc_buffer_page(struct ion_system_heap *heap,
 
 static void free_buffer_page(struct ion_system_heap *heap,
 			     struct ion_buffer *buffer, struct page *page,
-			     unsigned int order, struct vm_struct *vm_struct)
+			     unsigned int order)
 {
 	bool cached = ion_buffer_cached(buffer);
 	bool split_pages = ion_buffer_fault_user_mappings(buffer);
 	int i;
 
-	if (!cached) {
+	if (!cached && !(buffer->private_flags & ION_PRIV_FLAG_SHRINKER_FREE)) {
 		struct ion_page_pool *pool = heap->pools[order_to_index(order)];
-		/* zero the pages before returning them to the pool for
-		   security.  This uses vmap as we want to set the pgprot so
-		   the writes to occur to noncached mappings, as the pool's
-		   purpose is to keep the pages out of the cache */
-		for (i = 0; i < (1 << order); i++) {
-			struct page *sub_page = page + i;
-			struct page **pages = &sub_page;
-			map_vm_area(vm_struct,
-					 pgprot_writecombine(PAGE_KERNEL),
-					 &pages);
-			memset(vm_struct->addr, 0, PAGE_SIZE);
-			unmap_kernel_range((unsigned long)vm_struct->addr,
-					PAGE_SIZE);
-		}
+		/* the pool zeroes the pages for security before handing
+		   them out again, off this path */
 		ion_page_pool_free(pool, page);
 	} else if (split_pages) {
 		for (i = 0; i < (1 << order); i++)
@@ -167,8 +204,6 @@ static int ion_system_heap_allocate(struct ion_heap *heap,
 	long size_remaining = PAGE_ALIGN(size);
 	unsigned int max_order = orders[0];
 	bool split_pages = ion_buffer_fault_user_mappings(buffer);
-	struct vm_struct *vm_struct;
-	pte_t *ptes;
 
 	INIT_LIST_HEAD(&pages);
 	while (size_remaining > 0) {
@@ -216,13 +251,10 @@ static int ion_system_heap_allocate(struct ion_heap *heap,
 err1:
 	kfree(table);
 err:
-	vm_struct = get_vm_area(PAGE_SIZE, &ptes);
-	list_for_each_entry(info, &pages, list) {
-		free_buffer_page(sys_heap, buffer, info->page, info->order,
-				vm_struct);
+	list_for_each_entry_safe(info, tmp_info, &pages, list) {
+		free_buffer_page(sys_heap, buffer, info->page, info->order);
 		kfree(info);
 	}
-	free_vm_area(vm_struct);
 	return -ENOMEM;
 }
 
@@ -235,16 +267,11 @@ void ion_system_heap_free(struct ion_buffer *buffer)
 	struct sg_table *table = buffer->sg_table;
 	struct scatterlist *sg;
 	LIST_HEAD(pages);
-	struct vm_struct *vm_struct;
-	pte_t *ptes;
 	int i;
 
-	vm_struct = get_vm_area(PAGE_SIZE, &ptes);
-
 	for_each_sg(table->sgl, sg, table->nents, i)
 		free_buffer_page(sys_heap, buffer, sg_page(sg),
-				get_order(sg_dma_len(sg)), vm_struct);
-	free_vm_area(vm_struct);
+				get_order(sg_dma_len(sg)));
 	sg_free_table(table);
 	kfree(table);
 }
@@ -281,9 +308,18 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 	int i;
 	for (i = 0; i < num_orders; i++) {
 		struct ion_page_pool *pool = sys_heap->pools[i];
+
+		mutex_lock(&pool->mutex);
 		seq_printf(s, "%d order %u pages in pool = %lu total\n",
 			   pool->count, pool->order,
 			   (1 << pool->order) * PAGE_SIZE * pool->count);
+		seq_printf(s, "  %d waiting to be zeroed, target %u\n",
+			   pool->dirty_count, pool->target);
+		seq_printf(s, "  hits %lu zeroed on alloc %lu misses %lu\n",
+			   pool->hits, pool->sync_zeroed, pool->misses);
+		seq_printf(s, "  prefilled %lu shrunk %lu\n",
+			   pool->prefilled, pool->shrunk);
+		mutex_unlock(&pool->mutex);
 	}
 	return 0;
 }
@@ -298,6 +334,7 @@ struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 		return ERR_PTR(-ENOMEM);
 	heap->heap.ops = &system_heap_ops;
 	heap->heap.type = ION_HEAP_TYPE_SYSTEM;
+	heap->heap.flags = ION_HEAP_FLAG_DEFER_FREE;
 	heap->pools = kzalloc(sizeof(struct ion_page_pool *) * num_orders,
 			      GFP_KERNEL);
 	if (!heap->pools)
@@ -314,6 +351,12 @@ struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 		heap->pools[i] = pool;
 	}
 	heap->heap.debug_show = ion_system_heap_debug_show;
+
+	mutex_lock(&system_heaps_lock);
+	for (i = 0; i < num_orders; i++)
+		ion_page_pool_set_target(heap->pools[i], prefill_target[i]);
+	list_add(&heap->list, &system_heaps);
+	mutex_unlock(&system_heaps_lock);
 	return &heap->heap;
 err_create_pool:
 	for (i = 0; i < num_orders; i++)
@@ -332,6 +375,10 @@ void ion_system_heap_destroy(struct ion_heap *heap)
 							heap);
 	int i;
 
+	mutex_lock(&system_heaps_lock);
+	list_del(&sys_heap->list);
+	mutex_unlock(&system_heaps_lock);
+
 	for (i = 0; i < num_orders; i++)
 		ion_page_pool_destroy(sys_heap->pools[i]);
 	kfree(sys_heap->pools);
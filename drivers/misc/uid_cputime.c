@@ -21,100 +21,168 @@
 #include <linux/list.h>
 #include <linux/proc_fs.h>
 #include <linux/profile.h>
+#include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
+#include <linux/uid_cputime.h>
 
 #define UID_HASH_BITS	10
 DECLARE_HASHTABLE(hash_table, UID_HASH_BITS);
 
-static DEFINE_MUTEX(uid_lock);
+/* Serializes adding and removing uid_entries, lookups are done under RCU */
+static DEFINE_SPINLOCK(uid_lock);
 static struct proc_dir_entry *parent;
 
-struct uid_entry {
-	uid_t uid;
+/*
+ * Time charged to a uid on one cpu. Only the owning cpu writes it, from
+ * the scheduler's accounting, and readers fold all the cpus.
+ */
+struct uid_cputime_pcpu {
 	cputime_t utime;
 	cputime_t stime;
-	cputime_t active_utime;
-	cputime_t active_stime;
+};
+
+struct uid_entry {
+	uid_t uid;
+	/* Indexed by cpu id */
+	struct uid_cputime_pcpu *pcpu;
+	/*
+	 * The scheduler's utime/stime are sampled, task_times() scales them
+	 * to the task's precise runtime. When a task exits the difference is
+	 * added here so that exited tasks are reported precisely.
+	 */
+	atomic64_t exit_utime_adj;
+	atomic64_t exit_stime_adj;
 	struct hlist_node hash;
+	struct rcu_head rcu;
 };
 
+/* Caller must hold rcu_read_lock() or uid_lock */
 static struct uid_entry *find_uid_entry(uid_t uid)
 {
 	struct uid_entry *uid_entry;
 	struct hlist_node *node;
 
-	hash_for_each_possible(hash_table, uid_entry, node, hash, uid) {
+	hash_for_each_possible_rcu(hash_table, uid_entry, node, hash, uid) {
 		if (uid_entry->uid == uid)
 			return uid_entry;
 	}
 	return NULL;
 }
 
+/*
+ * Caller must hold rcu_read_lock(). May be called from the tick, so the
+ * allocations are atomic.
+ */
 static struct uid_entry *find_or_register_uid(uid_t uid)
 {
 	struct uid_entry *uid_entry;
+	unsigned long flags;
 
 	uid_entry = find_uid_entry(uid);
 	if (uid_entry)
 		return uid_entry;
 
+	spin_lock_irqsave(&uid_lock, flags);
+	uid_entry = find_uid_entry(uid);
+	if (uid_entry)
+		goto out;
+
 	uid_entry = kzalloc(sizeof(struct uid_entry), GFP_ATOMIC);
 	if (!uid_entry)
-		return NULL;
+		goto out;
+	uid_entry->pcpu = kcalloc(nr_cpu_ids, sizeof(struct uid_cputime_pcpu),
+				  GFP_ATOMIC);
+	if (!uid_entry->pcpu) {
+		kfree(uid_entry);
+		uid_entry = NULL;
+		goto out;
+	}
 
 	uid_entry->uid = uid;
 
-	hash_add(hash_table, &uid_entry->hash, uid);
-
+	hash_add_rcu(hash_table, &uid_entry->hash, uid);
+out:
+	spin_unlock_irqrestore(&uid_lock, flags);
 	return uid_entry;
 }
 
+static void free_uid_entry(struct rcu_head *head)
+{
+	struct uid_entry *uid_entry = container_of(head, struct uid_entry, rcu);
+
+	kfree(uid_entry->pcpu);
+	kfree(uid_entry);
+}
+
+static cputime_t uid_entry_time(s64 time)
+{
+	/*
+	 * A task that changed uid had its time charged to both uids but its
+	 * exit adjustment only to the last one, which can leave that slightly
+	 * behind.
+	 */
+	return (__force cputime_t)max_t(s64, time, 0);
+}
+
+static void uid_entry_times(struct uid_entry *uid_entry,
+			    cputime_t *utime, cputime_t *stime)
+{
+	s64 total_utime = atomic64_read(&uid_entry->exit_utime_adj);
+	s64 total_stime = atomic64_read(&uid_entry->exit_stime_adj);
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		total_utime += (__force s64)
+			ACCESS_ONCE(uid_entry->pcpu[cpu].utime);
+		total_stime += (__force s64)
+			ACCESS_ONCE(uid_entry->pcpu[cpu].stime);
+	}
+	*utime = uid_entry_time(total_utime);
+	*stime = uid_entry_time(total_stime);
+}
+
+/*
+ * Called by the scheduler with the time it just accounted to p, from the
+ * tick or with interrupts disabled.
+ */
+void uid_cputime_account(struct task_struct *p, cputime_t cputime, bool user)
+{
+	struct uid_entry *uid_entry;
+	struct uid_cputime_pcpu *pcpu;
+
+	rcu_read_lock();
+	uid_entry = find_or_register_uid(task_uid(p));
+	if (uid_entry) {
+		pcpu = &uid_entry->pcpu[smp_processor_id()];
+		if (user)
+			pcpu->utime += cputime;
+		else
+			pcpu->stime += cputime;
+	}
+	rcu_read_unlock();
+}
+
 static int uid_stat_show(struct seq_file *m, void *v)
 {
 	struct uid_entry *uid_entry;
-	struct task_struct *task;
 	struct hlist_node *node;
 	cputime_t utime;
 	cputime_t stime;
 	unsigned long bkt;
 
-	mutex_lock(&uid_lock);
-
-	hash_for_each(hash_table, bkt, node, uid_entry, hash) {
-		uid_entry->active_stime = 0;
-		uid_entry->active_utime = 0;
-	}
-
-	read_lock(&tasklist_lock);
-	for_each_process(task) {
-		uid_entry = find_or_register_uid(task_uid(task));
-		if (!uid_entry) {
-			read_unlock(&tasklist_lock);
-			mutex_unlock(&uid_lock);
-			pr_err("%s: failed to find the uid_entry for uid %d\n",
-						__func__, task_uid(task));
-			return -ENOMEM;
-		}
-		task_times(task, &utime, &stime);
-		uid_entry->active_utime += utime;
-		uid_entry->active_stime += stime;
-	}
-	read_unlock(&tasklist_lock);
-
-	hash_for_each(hash_table, bkt, node, uid_entry, hash) {
-		cputime_t total_utime = uid_entry->utime +
-							uid_entry->active_utime;
-		cputime_t total_stime = uid_entry->stime +
-							uid_entry->active_stime;
+	rcu_read_lock();
+	hash_for_each_rcu(hash_table, bkt, node, uid_entry, hash) {
+		uid_entry_times(uid_entry, &utime, &stime);
 		seq_printf(m, "%d: %u %u\n", uid_entry->uid,
-						cputime_to_usecs(total_utime),
-						cputime_to_usecs(total_stime));
+						cputime_to_usecs(utime),
+						cputime_to_usecs(stime));
 	}
+	rcu_read_unlock();
 
-	mutex_unlock(&uid_lock);
 	return 0;
 }
 
@@ -140,6 +208,8 @@ static ssize_t uid_remove_write(struct file *file,
 {
 	struct uid_entry *uid_entry;
 	struct hlist_node *node, *tmp;
+	unsigned long bkt;
+	unsigned long flags;
 	char uids[128];
 	char *start_uid, *end_uid = NULL;
 	long int uid_start = 0, uid_end = 0;
@@ -162,17 +232,17 @@ static ssize_t uid_remove_write(struct file *file,
 		return -EINVAL;
 	}
 
-	mutex_lock(&uid_lock);
+	/* One pass over the table, however wide the range is */
+	spin_lock_irqsave(&uid_lock, flags);
 
-	for (; uid_start <= uid_end; uid_start++) {
-		hash_for_each_possible_safe(hash_table, uid_entry, node, tmp,
-							hash, uid_start) {
-			hash_del(&uid_entry->hash);
-			kfree(uid_entry);
-		}
+	hash_for_each_safe(hash_table, bkt, node, tmp, uid_entry, hash) {
+		if (uid_entry->uid < uid_start || uid_entry->uid > uid_end)
+			continue;
+		hash_del_rcu(&uid_entry->hash);
+		call_rcu(&uid_entry->rcu, free_uid_entry);
 	}
 
-	mutex_unlock(&uid_lock);
+	spin_unlock_irqrestore(&uid_lock, flags);
 	return count;
 }
 
@@ -193,7 +263,7 @@ static int process_notifier(struct notifier_block *self,
 	if (!task)
 		return NOTIFY_OK;
 
-	mutex_lock(&uid_lock);
+	rcu_read_lock();
 	uid = task_uid(task);
 	uid_entry = find_or_register_uid(uid);
 	if (!uid_entry) {
@@ -201,12 +271,15 @@ static int process_notifier(struct notifier_block *self,
 		goto exit;
 	}
 
+	/* The sampled times were charged as they were accounted */
 	task_times(task, &utime, &stime);
-	uid_entry->utime += utime;
-	uid_entry->stime += stime;
+	atomic64_add((__force s64)utime - (__force s64)task->utime,
+		     &uid_entry->exit_utime_adj);
+	atomic64_add((__force s64)stime - (__force s64)task->stime,
+		     &uid_entry->exit_stime_adj);
 
 exit:
-	mutex_unlock(&uid_lock);
+	rcu_read_unlock();
 	return NOTIFY_OK;
 }
 
@@ -216,8 +289,10 @@ static struct notifier_block process_notifier_block = {
 
 static int __init proc_uid_cputime_init(void)
 {
-	hash_init(hash_table);
-
+	/*
+	 * No hash_init(): the scheduler may already have registered uids,
+	 * and the zeroed table is a valid empty one.
+	 */
 	parent = proc_mkdir("uid_cputime", NULL);
 	if (!parent) {
 		pr_err("%s: failed to create proc entry\n", __func__);
@@ -28,6 +28,10 @@
 #include <linux/bitops.h>
 #include <linux/mutex.h>
 #include <linux/shmem_fs.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/atomic.h>
 #include "ashmem.h"
 
 #define ASHMEM_NAME_PREFIX "dev/ashmem/"
@@ -37,43 +41,53 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its own `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
 	char name[ASHMEM_FULL_NAME_LEN]; /* optional name in /proc/pid/maps */
-	struct list_head unpinned_list;	 /* list of all ashmem areas */
+	struct rb_root unpinned_tree;	 /* unpinned ranges, by page */
 	struct file *file;		 /* the shmem-based backing file */
 	size_t size;			 /* size of the mapping, in bytes */
 	unsigned long prot_mask;	 /* allowed prot bits, as vm_flags */
+	struct mutex mutex;		 /* protects all of the above */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's mutex; `lru' by `ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
-	struct list_head unpinned;	/* entry in its area's unpinned list */
+	struct rb_node node;		/* entry in its area's unpinned tree */
 	struct ashmem_area *asma;	/* associated area */
 	size_t pgstart;			/* starting page, inclusive */
 	size_t pgend;			/* ending page, inclusive */
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and count
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock, and
+ *                asma->mutex -> i_mutex -> i_alloc_sem
+ *
+ * The shrinker walks the LRU and only trylocks areas under the lock, so
+ * it never waits for an area, and truncates with only that area locked.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/* Times an area lock was found held by someone else */
+static atomic_long_t ashmem_lock_contended = ATOMIC_LONG_INIT(0);
+/* Times the shrinker skipped a range because its area was busy */
+static atomic_long_t ashmem_shrink_skipped = ATOMIC_LONG_INIT(0);
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -97,36 +111,108 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 	(page_in_range(range, start) || page_in_range(range, end) || \
 		page_range_subsumes_range(range, start, end))
 
-#define range_before_page(range, page) \
-	((range)->pgend < (page))
-
 #define PROT_MASK		(PROT_EXEC | PROT_READ | PROT_WRITE)
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
-static inline void lru_del(struct ashmem_range *range)
+/* Caller must hold ashmem_lru_lock. */
+static inline void __lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
 	lru_count -= range_size(range);
 }
 
+static inline void lru_del(struct ashmem_range *range)
+{
+	spin_lock(&ashmem_lru_lock);
+	__lru_del(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
+static void asma_lock(struct ashmem_area *asma)
+{
+	if (!mutex_trylock(&asma->mutex)) {
+		atomic_long_inc(&ashmem_lock_contended);
+		mutex_lock(&asma->mutex);
+	}
+}
+
+static inline void asma_unlock(struct ashmem_area *asma)
+{
+	mutex_unlock(&asma->mutex);
+}
+
+/*
+ * The unpinned ranges of an area never overlap, so ordering them by
+ * their first page orders them by their last page too, and an rbtree
+ * keyed by pgstart answers interval queries in O(log n).
+ *
+ * range_first - the lowest range ending at or after 'page', or NULL
+ *
+ * Caller must hold asma->mutex.
+ */
+static struct ashmem_range *range_first(struct ashmem_area *asma,
+					size_t page)
+{
+	struct rb_node *node = asma->unpinned_tree.rb_node;
+	struct ashmem_range *range, *first = NULL;
+
+	while (node) {
+		range = rb_entry(node, struct ashmem_range, node);
+		if (range->pgend >= page) {
+			first = range;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	return first;
+}
+
+static inline struct ashmem_range *range_next(struct ashmem_range *range)
+{
+	struct rb_node *node = rb_next(&range->node);
+
+	return node ? rb_entry(node, struct ashmem_range, node) : NULL;
+}
+
+static void range_insert(struct ashmem_area *asma, struct ashmem_range *range)
+{
+	struct rb_node **p = &asma->unpinned_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct ashmem_range *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ashmem_range, node);
+		if (range->pgstart < entry->pgstart)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	rb_link_node(&range->node, parent, p);
+	rb_insert_color(&range->node, &asma->unpinned_tree);
+}
+
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
  * 'asma' - associated ashmem_area
- * 'prev_range' - the previous ashmem_range in the sorted asma->unpinned list
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
-static int range_alloc(struct ashmem_area *asma,
-		       struct ashmem_range *prev_range, unsigned int purged,
+static int range_alloc(struct ashmem_area *asma, unsigned int purged,
 		       size_t start, size_t end)
 {
 	struct ashmem_range *range;
@@ -140,7 +226,7 @@ static int range_alloc(struct ashmem_area *asma,
 	range->pgend = end;
 	range->purged = purged;
 
-	list_add_tail(&range->unpinned, &prev_range->unpinned);
+	range_insert(asma, range);
 
 	if (range_on_lru(range))
 		lru_add(range);
@@ -150,7 +236,7 @@ static int range_alloc(struct ashmem_area *asma,
 
 static void range_del(struct ashmem_range *range)
 {
-	list_del(&range->unpinned);
+	rb_erase(&range->node, &range->asma->unpinned_tree);
 	if (range_on_lru(range))
 		lru_del(range);
 	kmem_cache_free(ashmem_range_cachep, range);
@@ -159,7 +245,10 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * The range keeps its place in the tree: it only loses pages no other
+ * range can have.
+ *
+ * Caller must hold the range's asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -169,8 +258,11 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -186,7 +278,8 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	if (unlikely(!asma))
 		return -ENOMEM;
 
-	INIT_LIST_HEAD(&asma->unpinned_list);
+	asma->unpinned_tree = RB_ROOT;
+	mutex_init(&asma->mutex);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -197,12 +290,12 @@ static int ashmem_open(struct inode *inode, struct file *file)
 static int ashmem_release(struct inode *ignored, struct file *file)
 {
 	struct ashmem_area *asma = file->private_data;
-	struct ashmem_range *range, *next;
+	struct rb_node *node;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
-		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	asma_lock(asma);
+	while ((node = rb_first(&asma->unpinned_tree)))
+		range_del(rb_entry(node, struct ashmem_range, node));
+	asma_unlock(asma);
 
 	if (asma->file)
 		fput(asma->file);
@@ -217,7 +310,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0)
@@ -228,7 +321,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 		goto out_unlock;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 
 	/*
 	 * asma and asma->file are used outside the lock here.  We assume
@@ -244,7 +337,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	return ret;
 
 out_unlock:
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 	return ret;
 }
 
@@ -253,7 +346,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -273,7 +366,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 	return ret;
 }
 
@@ -289,7 +382,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -332,7 +425,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 	return ret;
 }
 
@@ -350,10 +443,20 @@ out:
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
  * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
  * pages freed.
+ *
+ * Ranges whose area is locked are skipped rather than waited for: the
+ * holder may be allocating, and so be the one who got us here.  They
+ * are set aside so each range is looked at once per call, and put back
+ * at the head of the LRU at the end.
  */
 static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *range;
+	struct ashmem_area *asma;
+	struct inode *inode;
+	loff_t start, end;
+	LIST_HEAD(skipped);
+	int ret;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (sc->nr_to_scan && !(sc->gfp_mask & __GFP_FS))
@@ -361,25 +464,48 @@ static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	if (!sc->nr_to_scan)
 		return lru_count;
 
-	if (!mutex_trylock(&ashmem_mutex))
-		return -1;
+	while (sc->nr_to_scan > 0) {
+		asma = NULL;
+		spin_lock(&ashmem_lru_lock);
+		while (!list_empty(&ashmem_lru_list)) {
+			range = list_first_entry(&ashmem_lru_list,
+						 struct ashmem_range, lru);
+			if (mutex_trylock(&range->asma->mutex)) {
+				asma = range->asma;
+				break;
+			}
+			/* Still counted in lru_count, and under the LRU lock */
+			list_move_tail(&range->lru, &skipped);
+			atomic_long_inc(&ashmem_shrink_skipped);
+		}
+		if (!asma) {
+			spin_unlock(&ashmem_lru_lock);
+			break;
+		}
 
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+		/*
+		 * The area's mutex keeps the range and the area alive, so
+		 * only the LRU lock is dropped for the truncation.
+		 */
+		__lru_del(range);
+		spin_unlock(&ashmem_lru_lock);
+		range->purged = ASHMEM_WAS_PURGED;
 
+		inode = asma->file->f_dentry->d_inode;
+		start = range->pgstart * PAGE_SIZE;
+		end = (range->pgend + 1) * PAGE_SIZE - 1;
 		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
 
 		sc->nr_to_scan -= range_size(range);
-		if (sc->nr_to_scan <= 0)
-			break;
+		asma_unlock(asma);
 	}
-	mutex_unlock(&ashmem_mutex);
 
-	return lru_count;
+	spin_lock(&ashmem_lru_lock);
+	list_splice(&skipped, &ashmem_lru_list);
+	ret = lru_count;
+	spin_unlock(&ashmem_lru_lock);
+
+	return ret;
 }
 
 static struct shrinker ashmem_shrinker = {
@@ -391,7 +517,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -406,7 +532,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 	return ret;
 }
 
@@ -421,7 +547,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 		return len;
 	if (len == ASHMEM_NAME_LEN)
 		lname[ASHMEM_NAME_LEN - 1] = '\0';
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file))
@@ -429,7 +555,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	else
 		strcpy(asma->name + ASHMEM_NAME_PREFIX_LEN, lname);
 
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 	return ret;
 }
 
@@ -439,7 +565,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 	char lname[ASHMEM_NAME_LEN];
 	size_t len;
 
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		/*
 		 * Copying only `len', instead of ASHMEM_NAME_LEN, bytes
@@ -451,7 +577,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 		len = strlen(ASHMEM_NAME_DEF) + 1;
 		memcpy(lname, ASHMEM_NAME_DEF, len);
 	}
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 	if (unlikely(copy_to_user(name, lname, len)))
 		ret = -EFAULT;
 	return ret;
@@ -461,17 +587,18 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	int ret = ASHMEM_NOT_PURGED;
 
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
+	for (range = range_first(asma, pgstart); range; range = next) {
 		/* moved past last applicable page; we can short circuit */
-		if (range_before_page(range, pgstart))
+		if (range->pgstart > pgend)
 			break;
+		next = range_next(range);
 
 		/*
 		 * The user can ask us to pin pages that span multiple ranges,
@@ -514,7 +641,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 			 * more complicated, we allocate a new range for the
 			 * second half and adjust the first chunk's endpoint.
 			 */
-			range_alloc(asma, range, range->purged,
+			range_alloc(asma, range->purged,
 				    pgend + 1, range->pgend);
 			range_shrink(range, range->pgstart, pgstart - 1);
 			break;
@@ -527,59 +654,75 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	unsigned int purged = ASHMEM_NOT_PURGED;
 
-restart:
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* short circuit: this is our insertion point */
-		if (range_before_page(range, pgstart))
+	for (range = range_first(asma, pgstart); range; range = next) {
+		/* short circuit: no further range can overlap */
+		if (range->pgstart > pgend)
 			break;
+		next = range_next(range);
 
 		/*
 		 * The user can ask us to unpin pages that are already entirely
-		 * or partially pinned. We handle those two cases here.
+		 * or partially unpinned. We handle those two cases here.
 		 */
 		if (page_range_subsumed_by_range(range, pgstart, pgend))
 			return 0;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			pgstart = min_t(size_t, range->pgstart, pgstart),
-			pgend = max_t(size_t, range->pgend, pgend);
-			purged |= range->purged;
-			range_del(range);
-			goto restart;
-		}
+		pgstart = min_t(size_t, range->pgstart, pgstart),
+		pgend = max_t(size_t, range->pgend, pgend);
+		purged |= range->purged;
+		range_del(range);
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	return range_alloc(asma, purged, pgstart, pgend);
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
 {
-	struct ashmem_range *range;
-	int ret = ASHMEM_IS_PINNED;
+	struct ashmem_range *range = range_first(asma, pgstart);
 
-	list_for_each_entry(range, &asma->unpinned_list, unpinned) {
-		if (range_before_page(range, pgstart))
-			break;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret = ASHMEM_IS_UNPINNED;
-			break;
-		}
-	}
+	if (range && range->pgstart <= pgend)
+		return ASHMEM_IS_UNPINNED;
 
-	return ret;
+	return ASHMEM_IS_PINNED;
+}
+
+/*
+ * pin_to_pages - validate a user range and convert it to pages
+ *
+ * Caller must hold asma->mutex.
+ */
+static int pin_to_pages(struct ashmem_area *asma, struct ashmem_pin *pin,
+			size_t *pgstart, size_t *pgend)
+{
+	/* per custom, you can pass zero for len to mean "everything onward" */
+	if (!pin->len)
+		pin->len = PAGE_ALIGN(asma->size) - pin->offset;
+
+	if (unlikely((pin->offset | pin->len) & ~PAGE_MASK))
+		return -EINVAL;
+
+	if (unlikely(((__u32) -1) - pin->offset < pin->len))
+		return -EINVAL;
+
+	if (unlikely(PAGE_ALIGN(asma->size) < pin->offset + pin->len))
+		return -EINVAL;
+
+	*pgstart = pin->offset / PAGE_SIZE;
+	*pgend = *pgstart + (pin->len / PAGE_SIZE) - 1;
+	return 0;
 }
 
 static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
@@ -589,29 +732,17 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	size_t pgstart, pgend;
 	int ret = -EINVAL;
 
-	if (unlikely(!asma->file))
-		return -EINVAL;
-
 	if (unlikely(copy_from_user(&pin, p, sizeof(pin))))
 		return -EFAULT;
 
-	/* per custom, you can pass zero for len to mean "everything onward" */
-	if (!pin.len)
-		pin.len = PAGE_ALIGN(asma->size) - pin.offset;
-
-	if (unlikely((pin.offset | pin.len) & ~PAGE_MASK))
-		return -EINVAL;
-
-	if (unlikely(((__u32) -1) - pin.offset < pin.len))
-		return -EINVAL;
-
-	if (unlikely(PAGE_ALIGN(asma->size) < pin.offset + pin.len))
-		return -EINVAL;
+	asma_lock(asma);
 
-	pgstart = pin.offset / PAGE_SIZE;
-	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
+	if (unlikely(!asma->file))
+		goto out_unlock;
 
-	mutex_lock(&ashmem_mutex);
+	ret = pin_to_pages(asma, &pin, &pgstart, &pgend);
+	if (ret)
+		goto out_unlock;
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -625,11 +756,80 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+out_unlock:
+	asma_unlock(asma);
 
 	return ret;
 }
 
+/*
+ * ashmem_pin_unpin_batch - pin or unpin an array of ranges under one
+ * acquisition of the area lock.  All ranges are validated before any is
+ * applied.  Pinning returns ASHMEM_WAS_PURGED if any range was purged.
+ */
+static int ashmem_pin_unpin_batch(struct ashmem_area *asma, unsigned long cmd,
+				  void __user *p)
+{
+	struct ashmem_pin_batch batch;
+	struct ashmem_pin *pins;
+	size_t *pages;
+	int ret = 0;
+	int i;
+
+	if (unlikely(copy_from_user(&batch, p, sizeof(batch))))
+		return -EFAULT;
+
+	if (!batch.count)
+		return 0;
+	if (unlikely(batch.count > ASHMEM_PIN_BATCH_MAX))
+		return -EINVAL;
+
+	pins = kmalloc(batch.count * sizeof(*pins), GFP_KERNEL);
+	pages = kmalloc(batch.count * 2 * sizeof(*pages), GFP_KERNEL);
+	if (unlikely(!pins || !pages)) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	if (unlikely(copy_from_user(pins,
+				    (void __user *)(unsigned long)batch.ranges,
+				    batch.count * sizeof(*pins)))) {
+		ret = -EFAULT;
+		goto out_free;
+	}
+
+	asma_lock(asma);
+
+	if (unlikely(!asma->file)) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		ret = pin_to_pages(asma, &pins[i], &pages[2 * i],
+				   &pages[2 * i + 1]);
+		if (ret)
+			goto out_unlock;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (cmd == ASHMEM_PIN_BATCH) {
+			ret |= ashmem_pin(asma, pages[2 * i], pages[2 * i + 1]);
+		} else {
+			ret = ashmem_unpin(asma, pages[2 * i], pages[2 * i + 1]);
+			if (ret)
+				break;
+		}
+	}
+
+out_unlock:
+	asma_unlock(asma);
+out_free:
+	kfree(pages);
+	kfree(pins);
+	return ret;
+}
+
 static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct ashmem_area *asma = file->private_data;
@@ -644,10 +844,12 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	case ASHMEM_SET_SIZE:
 		ret = -EINVAL;
+		asma_lock(asma);
 		if (!asma->file) {
 			ret = 0;
 			asma->size = (size_t) arg;
 		}
+		asma_unlock(asma);
 		break;
 	case ASHMEM_GET_SIZE:
 		ret = asma->size;
@@ -663,6 +865,10 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_pin_unpin(asma, cmd, (void __user *) arg);
 		break;
+	case ASHMEM_PIN_BATCH:
+	case ASHMEM_UNPIN_BATCH:
+		ret = ashmem_pin_unpin_batch(asma, cmd, (void __user *) arg);
+		break;
 	case ASHMEM_PURGE_ALL_CACHES:
 		ret = -EPERM;
 		if (capable(CAP_SYS_ADMIN)) {
@@ -746,6 +952,20 @@ static void __exit ashmem_exit(void)
 	printk(KERN_INFO "ashmem: unloaded\n");
 }
 
+static int ashmem_counter_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%ld", atomic_long_read(kp->arg));
+}
+
+static struct kernel_param_ops ashmem_counter_ops = {
+	.get = ashmem_counter_get,
+};
+
+module_param_cb(lock_contended, &ashmem_counter_ops, &ashmem_lock_contended,
+		S_IRUGO);
+module_param_cb(shrink_skipped, &ashmem_counter_ops, &ashmem_shrink_skipped,
+		S_IRUGO);
+
 module_init(ashmem_init);
 module_exit(ashmem_exit);
 
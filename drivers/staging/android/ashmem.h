@@ -33,6 +33,20 @@ struct ashmem_pin {
 	__u32 len;	/* length forward from offset, in bytes, page-aligned */
 };
 
+/*
+ * A batch of ranges for ASHMEM_PIN_BATCH and ASHMEM_UNPIN_BATCH: 'ranges'
+ * points to an array of 'count' struct ashmem_pin, at most
+ * ASHMEM_PIN_BATCH_MAX.  ASHMEM_PIN_BATCH returns ASHMEM_WAS_PURGED if
+ * any of the ranges was purged.
+ */
+struct ashmem_pin_batch {
+	__u64 ranges;	/* user pointer to struct ashmem_pin[count] */
+	__u32 count;	/* number of ranges */
+	__u32 pad;
+};
+
+#define ASHMEM_PIN_BATCH_MAX	1024
+
 #define __ASHMEMIOC		0x77
 
 #define ASHMEM_SET_NAME		_IOW(__ASHMEMIOC, 1, char[ASHMEM_NAME_LEN])
@@ -45,5 +59,7 @@ struct ashmem_pin {
 #define ASHMEM_UNPIN		_IOW(__ASHMEMIOC, 8, struct ashmem_pin)
 #define ASHMEM_GET_PIN_STATUS	_IO(__ASHMEMIOC, 9)
 #define ASHMEM_PURGE_ALL_CACHES	_IO(__ASHMEMIOC, 10)
+#define ASHMEM_PIN_BATCH	_IOW(__ASHMEMIOC, 11, struct ashmem_pin_batch)
+#define ASHMEM_UNPIN_BATCH	_IOW(__ASHMEMIOC, 12, struct ashmem_pin_batch)
 
 #endif	/* _LINUX_ASHMEM_H */
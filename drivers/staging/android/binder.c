@@ -20,12 +20,14 @@
 #include <linux/file.h>
 #include <linux/freezer.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/nsproxy.h>
+#include <linux/percpu.h>
 #include <linux/poll.h>
 #include <linux/debugfs.h>
 #include <linux/rbtree.h>
@@ -168,6 +170,61 @@ static inline void binder_stats_created(enum binder_stat_types type)
 	binder_stats.obj_created[type]++;
 }
 
+/*
+ * Transaction latency histograms.  Bucket 0 counts latencies below 1us,
+ * bucket n counts [2^(n-1), 2^n) us and the last bucket is open ended.
+ */
+#define BINDER_LATENCY_BUCKETS 24
+
+enum binder_latency_types {
+	BINDER_LATENCY_DISPATCH,	/* sent -> picked up by target thread */
+	BINDER_LATENCY_ROUND_TRIP,	/* call sent -> reply picked up */
+	BINDER_LATENCY_COUNT
+};
+
+struct binder_latency_stats {
+	u32 hist[BINDER_LATENCY_COUNT][BINDER_LATENCY_BUCKETS];
+};
+
+static struct binder_latency_stats binder_latency_stats;
+
+/*
+ * Lock hierarchy, outermost first:
+ *
+ *   binder_main_lock	object graph: nodes, refs, transaction stacks,
+ *			todo lists, proc lifetime (binder_procs, tmp_ref)
+ *   proc->alloc_lock	per-proc buffer allocator and page array
+ *   proc->thread_lock	per-proc thread rbtree
+ *   binder_lru_lock	(spinlock) global list of unused, still mapped pages
+ *
+ * binder_transaction() drops binder_main_lock while it allocates the
+ * target buffer and copies the payload in, so independent transactions
+ * only serialize on the allocator of the process they are sent to.
+ */
+enum binder_lock_types {
+	BINDER_LOCK_MAIN,
+	BINDER_LOCK_ALLOC,
+	BINDER_LOCK_THREAD,
+	BINDER_LOCK_COUNT
+};
+
+struct binder_lock_stats {
+	unsigned long acquired[BINDER_LOCK_COUNT];
+	unsigned long contended[BINDER_LOCK_COUNT];
+};
+
+static DEFINE_PER_CPU(struct binder_lock_stats, binder_lock_stats);
+
+static inline void binder_mutex_lock(struct mutex *lock,
+				     enum binder_lock_types type)
+{
+	if (!mutex_trylock(lock)) {
+		this_cpu_inc(binder_lock_stats.contended[type]);
+		mutex_lock(lock);
+	}
+	this_cpu_inc(binder_lock_stats.acquired[type]);
+}
+
 struct binder_transaction_log_entry {
 	int debug_id;
 	int call_type;
@@ -234,7 +291,8 @@ struct binder_node {
 	unsigned pending_weak_ref:1;
 	unsigned has_async_transaction:1;
 	unsigned accept_fds:1;
-	unsigned min_priority:8;
+	unsigned sched_policy:2;
+	unsigned min_priority:8;	/* kernel priority, see to_kernel_prio() */
 	struct list_head async_todo;
 };
 
@@ -267,7 +325,8 @@ struct binder_buffer {
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
-	unsigned debug_id:29;
+	unsigned cached:1;
+	unsigned debug_id:28;
 
 	struct binder_transaction *transaction;
 
@@ -277,6 +336,39 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+/*
+ * Pages of the buffer area that no buffer uses any more stay mapped, in
+ * the kernel and in userspace, on binder_lru until the shrinker reclaims
+ * them, so a process that keeps allocating and freeing buffers in the
+ * same range does not remap pages on every transaction.
+ */
+struct binder_lru_page {
+	struct list_head lru;
+	struct page *page_ptr;
+	struct binder_proc *proc;
+};
+
+static LIST_HEAD(binder_lru);
+static DEFINE_SPINLOCK(binder_lru_lock);
+static int binder_lru_count;
+
+/*
+ * Recently freed small buffers are kept off the free tree, with their
+ * pages, and handed straight back to the next allocation they fit.
+ */
+#define BINDER_BUFFER_CACHE_SLOTS	4
+#define BINDER_BUFFER_CACHE_MAX_SIZE	1024
+
+/*
+ * A scheduling policy and a kernel priority (task->normal_prio units:
+ * below MAX_RT_PRIO for real-time policies, NICE_TO_PRIO(nice) above),
+ * so priorities of different policies compare directly.
+ */
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -296,6 +388,10 @@ struct binder_proc {
 	struct files_struct *files;
 	struct hlist_node deferred_work_node;
 	int deferred_work;
+	int tmp_ref;
+	bool is_dead;
+	struct mutex thread_lock;
+	struct mutex alloc_lock;
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
@@ -303,19 +399,24 @@ struct binder_proc {
 	struct rb_root free_buffers;
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
+	struct binder_buffer *buffer_cache[BINDER_BUFFER_CACHE_SLOTS];
+	int buffer_cache_count;
+	unsigned long buffer_cache_hits;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
+	int pages_lru;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	struct binder_latency_stats latency;
 	struct list_head delivered_death;
 	int max_threads;
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
+	struct binder_priority default_priority;
 	struct dentry *debugfs_entry;
 };
 
@@ -357,14 +458,29 @@ struct binder_transaction {
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	start_time;	/* when the transaction was sent */
+	ktime_t	call_start;	/* for replies, when the call was sent */
 };
 
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
+static void binder_latency_record(struct binder_proc *proc,
+				  enum binder_latency_types type,
+				  ktime_t start)
+{
+	s64 usecs = ktime_us_delta(ktime_get(), start);
+	int bucket = usecs > 0 ? fls64(usecs) : 0;
+
+	if (bucket >= BINDER_LATENCY_BUCKETS)
+		bucket = BINDER_LATENCY_BUCKETS - 1;
+	binder_latency_stats.hist[type][bucket]++;
+	proc->latency.hist[type][bucket]++;
+}
+
 /*
  * copied from get_unused_fd_flags
  */
@@ -505,7 +621,7 @@ out_unlock:
 static inline void binder_lock(const char *tag)
 {
 	trace_binder_lock(tag);
-	mutex_lock(&binder_main_lock);
+	binder_mutex_lock(&binder_main_lock, BINDER_LOCK_MAIN);
 	trace_binder_locked(tag);
 }
 
@@ -515,21 +631,167 @@ static inline void binder_unlock(const char *tag)
 	mutex_unlock(&binder_main_lock);
 }
 
-static void binder_set_nice(long nice)
+static inline void binder_alloc_lock(struct binder_proc *proc)
+{
+	binder_mutex_lock(&proc->alloc_lock, BINDER_LOCK_ALLOC);
+}
+
+static inline void binder_alloc_unlock(struct binder_proc *proc)
+{
+	mutex_unlock(&proc->alloc_lock);
+}
+
+static inline void binder_thread_lock(struct binder_proc *proc)
+{
+	binder_mutex_lock(&proc->thread_lock, BINDER_LOCK_THREAD);
+}
+
+static inline void binder_thread_unlock(struct binder_proc *proc)
 {
-	long min_nice;
-	if (can_nice(current, nice)) {
-		set_user_nice(current, nice);
+	mutex_unlock(&proc->thread_lock);
+}
+
+static bool is_rt_policy(int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static bool is_fair_policy(int policy)
+{
+	return policy == SCHED_NORMAL || policy == SCHED_BATCH;
+}
+
+/* nice or rt_priority, depending on policy, to kernel priority */
+static int to_kernel_prio(int policy, int user_priority)
+{
+	if (is_fair_policy(policy))
+		return MAX_RT_PRIO + 20 + user_priority;
+	else
+		return MAX_USER_RT_PRIO - 1 - user_priority;
+}
+
+static int to_userspace_prio(int policy, int kernel_priority)
+{
+	if (is_fair_policy(policy))
+		return kernel_priority - MAX_RT_PRIO - 20;
+	else
+		return MAX_USER_RT_PRIO - 1 - kernel_priority;
+}
+
+static struct binder_priority binder_get_priority(struct task_struct *task)
+{
+	struct binder_priority p;
+
+	p.sched_policy = task->policy;
+	p.prio = task->normal_prio;
+	return p;
+}
+
+/*
+ * Moves task to the desired policy and priority.  With verify set the
+ * change is limited by RLIMIT_RTPRIO and RLIMIT_NICE unless the task
+ * has CAP_SYS_NICE: a real-time request the task may not hold falls back
+ * to the highest nice value it may use.  Restoring a priority the task
+ * had before is not verified.
+ */
+static void binder_do_set_priority(struct task_struct *task,
+				   struct binder_priority desired,
+				   bool verify)
+{
+	int priority; /* user-space priority value */
+	bool has_cap_nice;
+	unsigned int policy = desired.sched_policy;
+	int old_prio = task->normal_prio;
+
+	if (task->policy == policy && task->normal_prio == desired.prio)
 		return;
+
+	has_cap_nice = has_capability_noaudit(task, CAP_SYS_NICE);
+
+	priority = to_userspace_prio(policy, desired.prio);
+
+	if (verify && is_rt_policy(policy) && !has_cap_nice) {
+		long max_rtprio = task_rlimit(task, RLIMIT_RTPRIO);
+
+		if (max_rtprio == 0) {
+			policy = SCHED_NORMAL;
+			priority = -20;
+		} else if (priority > max_rtprio) {
+			priority = max_rtprio;
+		}
 	}
-	min_nice = 20 - current->signal->rlim[RLIMIT_NICE].rlim_cur;
-	binder_debug(BINDER_DEBUG_PRIORITY_CAP,
-		     "binder: %d: nice value %ld not allowed use "
-		     "%ld instead\n", current->pid, nice, min_nice);
-	set_user_nice(current, min_nice);
-	if (min_nice < 20)
-		return;
-	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
+
+	if (verify && is_fair_policy(policy) && !has_cap_nice) {
+		long min_nice = 20 - task_rlimit(task, RLIMIT_NICE);
+
+		if (min_nice > 19) {
+			binder_user_error("binder: %d RLIMIT_NICE not set\n",
+					  task->pid);
+			return;
+		} else if (priority < min_nice) {
+			priority = min_nice;
+		}
+	}
+
+	if (policy != desired.sched_policy ||
+	    to_kernel_prio(policy, priority) != desired.prio)
+		binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+			     "binder: %d: priority %d not allowed, "
+			     "using %d instead\n", task->pid, desired.prio,
+			     to_kernel_prio(policy, priority));
+
+	trace_binder_set_priority(task->tgid, task->pid, old_prio,
+				  desired.prio,
+				  to_kernel_prio(policy, priority));
+
+	/* Set the actual priority */
+	if (task->policy != policy || is_rt_policy(policy)) {
+		struct sched_param params;
+
+		params.sched_priority = is_rt_policy(policy) ? priority : 0;
+
+		sched_setscheduler_nocheck(task,
+					   policy | SCHED_RESET_ON_FORK,
+					   &params);
+	}
+	if (is_fair_policy(policy))
+		set_user_nice(task, priority);
+}
+
+static void binder_set_priority(struct task_struct *task,
+				struct binder_priority desired)
+{
+	binder_do_set_priority(task, desired, /* verify = */ true);
+}
+
+static void binder_restore_priority(struct task_struct *task,
+				    struct binder_priority desired)
+{
+	binder_do_set_priority(task, desired, /* verify = */ false);
+}
+
+/*
+ * Runs the handling thread at the higher of the caller's priority (for
+ * synchronous calls) and the node's minimum priority.  The thread's own
+ * priority is saved in the transaction and restored when it replies.
+ */
+static void binder_transaction_priority(struct task_struct *task,
+					struct binder_transaction *t,
+					struct binder_node *node)
+{
+	struct binder_priority desired = t->priority;
+	struct binder_priority node_prio;
+
+	t->saved_priority = binder_get_priority(task);
+	if (t->flags & TF_ONE_WAY)
+		desired = t->saved_priority;
+
+	node_prio.sched_policy = node->sched_policy;
+	node_prio.prio = node->min_priority;
+	if (node_prio.prio < desired.prio)
+		desired = node_prio;
+
+	binder_set_priority(task, desired);
 }
 
 static size_t binder_buffer_size(struct binder_proc *proc,
@@ -566,7 +828,9 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 
 		buffer_size = binder_buffer_size(proc, buffer);
 
-		if (new_buffer_size < buffer_size)
+		/* Order equal sizes by address to keep the area packed */
+		if (new_buffer_size < buffer_size ||
+		    (new_buffer_size == buffer_size && new_buffer < buffer))
 			p = &parent->rb_left;
 		else
 			p = &parent->rb_right;
@@ -600,8 +864,8 @@ static void binder_insert_allocated_buffer(struct binder_proc *proc,
 	rb_insert_color(&new_buffer->rb_node, &proc->allocated_buffers);
 }
 
-static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
-						  void __user *user_ptr)
+static struct binder_buffer *binder_buffer_lookup_locked(
+	struct binder_proc *proc, void __user *user_ptr)
 {
 	struct rb_node *n = proc->allocated_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -624,15 +888,198 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+static void binder_lru_add(struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	if (list_empty(&page->lru)) {
+		list_add_tail(&page->lru, &binder_lru);
+		binder_lru_count++;
+		page->proc->pages_lru++;
+	}
+	spin_unlock(&binder_lru_lock);
+}
+
+static bool binder_lru_del(struct binder_lru_page *page)
+{
+	bool on_lru;
+
+	spin_lock(&binder_lru_lock);
+	on_lru = !list_empty(&page->lru);
+	if (on_lru) {
+		list_del_init(&page->lru);
+		binder_lru_count--;
+		page->proc->pages_lru--;
+	}
+	spin_unlock(&binder_lru_lock);
+	return on_lru;
+}
+
+/* Unmaps and frees a page that is no longer used by any buffer */
+static void binder_free_page(struct binder_proc *proc,
+			     struct vm_area_struct *vma, void *page_addr)
+{
+	struct binder_lru_page *page;
+
+	page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+	if (vma)
+		zap_page_range(vma, (uintptr_t)page_addr +
+			proc->user_buffer_offset, PAGE_SIZE, NULL);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
+}
+
+/*
+ * binder_shrink - reclaims unused pages parked on binder_lru
+ *
+ * Pages whose process is busy in its allocator, or whose mm cannot be
+ * locked without waiting, are rotated to the tail and retried later.
+ */
+static int binder_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct binder_lru_page *page;
+	struct binder_proc *proc;
+	struct vm_area_struct *vma;
+	struct mm_struct *mm;
+	unsigned long scanned = 0;
+	void *page_addr;
+	int ret;
+
+	if (!sc->nr_to_scan)
+		return binder_lru_count;
+
+	spin_lock(&binder_lru_lock);
+	while (scanned++ < sc->nr_to_scan && !list_empty(&binder_lru)) {
+		page = list_first_entry(&binder_lru, struct binder_lru_page,
+					lru);
+		proc = page->proc;
+		/* The alloc_lock also keeps proc alive, see binder_free_proc */
+		if (!mutex_trylock(&proc->alloc_lock)) {
+			list_move_tail(&page->lru, &binder_lru);
+			continue;
+		}
+		list_del_init(&page->lru);
+		binder_lru_count--;
+		proc->pages_lru--;
+		spin_unlock(&binder_lru_lock);
+
+		page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
+		vma = NULL;
+		mm = get_task_mm(proc->tsk);
+		if (mm && !down_read_trylock(&mm->mmap_sem)) {
+			mmput(mm);
+			binder_lru_add(page);
+			mutex_unlock(&proc->alloc_lock);
+			spin_lock(&binder_lru_lock);
+			continue;
+		}
+		if (mm) {
+			vma = proc->vma;
+			if (vma && mm != proc->vma_vm_mm)
+				vma = NULL;
+		}
+		binder_free_page(proc, vma, page_addr);
+		if (mm) {
+			up_read(&mm->mmap_sem);
+			mmput(mm);
+		}
+		mutex_unlock(&proc->alloc_lock);
+		spin_lock(&binder_lru_lock);
+	}
+	ret = binder_lru_count;
+	spin_unlock(&binder_lru_lock);
+	return ret;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+#define BINDER_MAP_BATCH	16
+
+/*
+ * Allocates and maps up to BINDER_MAP_BATCH consecutive pages with a
+ * single kernel mapping call.  On failure nothing is left mapped.
+ */
+static int binder_map_pages(struct binder_proc *proc,
+			    struct vm_area_struct *vma, void *start,
+			    int nr_pages)
+{
+	struct page *pages[BINDER_MAP_BATCH];
+	struct page **page_array_ptr = pages;
+	struct binder_lru_page *page;
+	struct vm_struct tmp_area;
+	unsigned long user_page_addr;
+	int i, mapped, ret;
+
+	page = &proc->pages[(start - proc->buffer) / PAGE_SIZE];
+	for (i = 0; i < nr_pages; i++) {
+		BUG_ON(page[i].page_ptr);
+		pages[i] = alloc_page(GFP_KERNEL | __GFP_HIGHMEM | __GFP_ZERO);
+		if (pages[i] == NULL) {
+			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
+			       "for page at %p\n", proc->pid,
+			       start + i * PAGE_SIZE);
+			goto err_alloc_page_failed;
+		}
+	}
+
+	tmp_area.addr = start;
+	tmp_area.size = nr_pages * PAGE_SIZE + PAGE_SIZE /* guard page? */;
+	ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
+	if (ret) {
+		printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
+		       "to map pages at %p in kernel\n", proc->pid, start);
+		goto err_map_kernel_failed;
+	}
+
+	user_page_addr = (uintptr_t)start + proc->user_buffer_offset;
+	for (mapped = 0; mapped < nr_pages; mapped++) {
+		ret = vm_insert_page(vma, user_page_addr + mapped * PAGE_SIZE,
+				     pages[mapped]);
+		if (ret) {
+			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
+			       "to map page at %lx in userspace\n", proc->pid,
+			       user_page_addr + mapped * PAGE_SIZE);
+			goto err_vm_insert_page_failed;
+		}
+		/* vm_insert_page does not seem to increment the refcount */
+	}
+
+	for (i = 0; i < nr_pages; i++)
+		page[i].page_ptr = pages[i];
+	return 0;
+
+err_vm_insert_page_failed:
+	if (mapped)
+		zap_page_range(vma, user_page_addr, mapped * PAGE_SIZE, NULL);
+err_map_kernel_failed:
+	unmap_kernel_range((unsigned long)start, nr_pages * PAGE_SIZE);
+err_alloc_page_failed:
+	while (i--)
+		__free_page(pages[i]);
+	return -ENOMEM;
+}
+
+/*
+ * Makes [start, end) usable by a buffer (allocate != 0) or marks it
+ * unused.  Unused pages are not unmapped here but parked on binder_lru,
+ * where the next allocation covering them picks them up again without
+ * touching the page tables, and binder_shrink reclaims them under memory
+ * pressure.  Missing pages are mapped in batches of BINDER_MAP_BATCH.
+ * Called with proc->alloc_lock held or, from binder_mmap, before the
+ * buffer area is visible to anyone else.
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
 {
 	void *page_addr;
-	unsigned long user_page_addr;
-	struct vm_struct tmp_area;
-	struct page **page;
+	void *run_start;
+	struct binder_lru_page *page;
 	struct mm_struct *mm;
+	bool need_map = false;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -643,6 +1090,34 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 
 	trace_binder_update_page_range(proc, allocate, start, end);
 
+	if (allocate == 0) {
+		for (page_addr = start; page_addr < end;
+		     page_addr += PAGE_SIZE) {
+			page = &proc->pages[(page_addr - proc->buffer) /
+					    PAGE_SIZE];
+			BUG_ON(!page->page_ptr);
+			binder_lru_add(page);
+		}
+		return 0;
+	}
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (!page->page_ptr) {
+			need_map = true;
+			break;
+		}
+	}
+	if (!need_map) {
+		for (page_addr = start; page_addr < end;
+		     page_addr += PAGE_SIZE) {
+			page = &proc->pages[(page_addr - proc->buffer) /
+					    PAGE_SIZE];
+			binder_lru_del(page);
+		}
+		return 0;
+	}
+
 	if (vma)
 		mm = NULL;
 	else
@@ -658,47 +1133,31 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
 	if (vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
 		goto err_no_vma;
 	}
 
-	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
-		int ret;
-		struct page **page_array_ptr;
+	page_addr = start;
+	while (page_addr < end) {
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_HIGHMEM | __GFP_ZERO);
-		if (*page == NULL) {
-			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
-			       "for page at %p\n", proc->pid, page_addr);
-			goto err_alloc_page_failed;
-		}
-		tmp_area.addr = page_addr;
-		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
-		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
-		if (ret) {
-			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
-			       "to map page at %p in kernel\n",
-			       proc->pid, page_addr);
-			goto err_map_kernel_failed;
+		if (page->page_ptr) {
+			binder_lru_del(page);
+			page_addr += PAGE_SIZE;
+			continue;
 		}
-		user_page_addr =
-			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
-		if (ret) {
-			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
-			       "to map page at %lx in userspace\n",
-			       proc->pid, user_page_addr);
-			goto err_vm_insert_page_failed;
+		run_start = page_addr;
+		do {
+			page_addr += PAGE_SIZE;
+			page++;
+		} while (page_addr < end && !page->page_ptr &&
+			 page_addr - run_start < BINDER_MAP_BATCH * PAGE_SIZE);
+		if (binder_map_pages(proc, vma, run_start,
+				     (page_addr - run_start) / PAGE_SIZE)) {
+			page_addr = run_start;
+			goto err_map_failed;
 		}
-		/* vm_insert_page does not seem to increment the refcount */
 	}
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -706,21 +1165,12 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	}
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
-err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
-err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
-err_alloc_page_failed:
-		;
-	}
+err_map_failed:
+	/* Pages we already claimed go back to the lru */
+	for (run_start = start; run_start < page_addr;
+	     run_start += PAGE_SIZE)
+		binder_lru_add(&proc->pages[(run_start - proc->buffer) /
+					    PAGE_SIZE]);
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -729,14 +1179,94 @@ err_no_vma:
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
+						  void __user *user_ptr)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
+	struct binder_buffer *buffer;
+
+	binder_alloc_lock(proc);
+	buffer = binder_buffer_lookup_locked(proc, user_ptr);
+	binder_alloc_unlock(proc);
+	return buffer;
+}
+
+static void binder_release_buf_locked(struct binder_proc *proc,
+				      struct binder_buffer *buffer);
+
+/*
+ * Returns the smallest cached buffer that can hold size bytes, removed
+ * from the cache, or NULL.
+ */
+static struct binder_buffer *binder_buffer_cache_get(struct binder_proc *proc,
+						     size_t size)
+{
+	struct binder_buffer *buffer;
+	size_t buffer_size, best_size = 0;
+	int i, best = -1;
+
+	for (i = 0; i < proc->buffer_cache_count; i++) {
+		buffer_size = binder_buffer_size(proc, proc->buffer_cache[i]);
+		if (buffer_size >= size &&
+		    (best < 0 || buffer_size < best_size)) {
+			best = i;
+			best_size = buffer_size;
+		}
+	}
+	if (best < 0)
+		return NULL;
+
+	buffer = proc->buffer_cache[best];
+	proc->buffer_cache_count--;
+	memmove(&proc->buffer_cache[best], &proc->buffer_cache[best + 1],
+		(proc->buffer_cache_count - best) * sizeof(buffer));
+	buffer->cached = 0;
+	proc->buffer_cache_hits++;
+	return buffer;
+}
+
+/*
+ * Keeps a freed small buffer for reuse.  When the cache is full the
+ * oldest entry is released to the free tree.
+ */
+static void binder_buffer_cache_put(struct binder_proc *proc,
+				    struct binder_buffer *buffer)
+{
+	struct binder_buffer *oldest;
+
+	if (proc->buffer_cache_count == BINDER_BUFFER_CACHE_SLOTS) {
+		oldest = proc->buffer_cache[0];
+		proc->buffer_cache_count--;
+		memmove(&proc->buffer_cache[0], &proc->buffer_cache[1],
+			proc->buffer_cache_count * sizeof(oldest));
+		oldest->cached = 0;
+		binder_release_buf_locked(proc, oldest);
+	}
+	buffer->cached = 1;
+	proc->buffer_cache[proc->buffer_cache_count++] = buffer;
+}
+
+static int binder_buffer_cache_flush(struct binder_proc *proc)
+{
+	int count = proc->buffer_cache_count;
+	struct binder_buffer *buffer;
+
+	while (proc->buffer_cache_count) {
+		buffer = proc->buffer_cache[--proc->buffer_cache_count];
+		buffer->cached = 0;
+		binder_release_buf_locked(proc, buffer);
+	}
+	return count;
+}
+
+static struct binder_buffer *binder_alloc_buf_locked(struct binder_proc *proc,
+						     size_t data_size,
+						     size_t offsets_size,
+						     int is_async)
+{
+	struct rb_node *n;
 	struct binder_buffer *buffer;
 	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
+	struct rb_node *best_fit;
 	void *has_page_addr;
 	void *end_page_addr;
 	size_t size;
@@ -764,30 +1294,42 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
+	if (size <= BINDER_BUFFER_CACHE_MAX_SIZE) {
+		buffer = binder_buffer_cache_get(proc, size);
+		if (buffer) {
+			binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+				     "binder: %d: binder_alloc_buf size %zd "
+				     "got cached %p\n", proc->pid, size,
+				     buffer);
+			binder_insert_allocated_buffer(proc, buffer);
+			goto found;
+		}
+	}
+
+retry:
+	/* Smallest free buffer that fits, lowest address among equals */
+	n = proc->free_buffers.rb_node;
+	best_fit = NULL;
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(!buffer->free);
 		buffer_size = binder_buffer_size(proc, buffer);
 
-		if (size < buffer_size) {
+		if (size <= buffer_size) {
 			best_fit = n;
 			n = n->rb_left;
-		} else if (size > buffer_size)
+		} else
 			n = n->rb_right;
-		else {
-			best_fit = n;
-			break;
-		}
 	}
 	if (best_fit == NULL) {
+		if (binder_buffer_cache_flush(proc))
+			goto retry;
 		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
 		return NULL;
 	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
-		buffer_size = binder_buffer_size(proc, buffer);
-	}
+	buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
+	buffer_size = binder_buffer_size(proc, buffer);
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got buff"
@@ -795,12 +1337,10 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
-	if (n == NULL) {
-		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
-			buffer_size = size; /* no room for other buffers */
-		else
-			buffer_size = size + sizeof(struct binder_buffer);
-	}
+	if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
+		buffer_size = size; /* no room for other buffers */
+	else
+		buffer_size = size + sizeof(struct binder_buffer);
 	end_page_addr =
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
 	if (end_page_addr > has_page_addr)
@@ -816,11 +1356,13 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		struct binder_buffer *new_buffer = (void *)buffer->data + size;
 		list_add(&new_buffer->entry, &buffer->entry);
 		new_buffer->free = 1;
+		new_buffer->cached = 0;
 		binder_insert_free_buffer(proc, new_buffer);
 	}
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got "
 		     "%p\n", proc->pid, size, buffer);
+found:
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
 	buffer->async_transaction = is_async;
@@ -835,6 +1377,19 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+
+	binder_alloc_lock(proc);
+	buffer = binder_alloc_buf_locked(proc, data_size, offsets_size,
+					 is_async);
+	binder_alloc_unlock(proc);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -892,8 +1447,8 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void binder_free_buf_locked(struct binder_proc *proc,
+				   struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
@@ -907,6 +1462,7 @@ static void binder_free_buf(struct binder_proc *proc,
 		     "_size %zd\n", proc->pid, buffer, size, buffer_size);
 
 	BUG_ON(buffer->free);
+	BUG_ON(buffer->cached);
 	BUG_ON(size > buffer_size);
 	BUG_ON(buffer->transaction != NULL);
 	BUG_ON((void *)buffer < proc->buffer);
@@ -921,11 +1477,26 @@ static void binder_free_buf(struct binder_proc *proc,
 			     proc->free_async_space);
 	}
 
+	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
+	if (buffer_size <= BINDER_BUFFER_CACHE_MAX_SIZE)
+		binder_buffer_cache_put(proc, buffer);
+	else
+		binder_release_buf_locked(proc, buffer);
+}
+
+/*
+ * Returns a buffer that is neither allocated nor cached to the free
+ * tree, merging it with free neighbours.
+ */
+static void binder_release_buf_locked(struct binder_proc *proc,
+				      struct binder_buffer *buffer)
+{
+	size_t buffer_size = binder_buffer_size(proc, buffer);
+
 	binder_update_page_range(proc, 0,
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
 		NULL);
-	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
 	buffer->free = 1;
 	if (!list_is_last(&buffer->entry, &proc->buffers)) {
 		struct binder_buffer *next = list_entry(buffer->entry.next,
@@ -947,6 +1518,97 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_insert_free_buffer(proc, buffer);
 }
 
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	binder_alloc_lock(proc);
+	binder_free_buf_locked(proc, buffer);
+	binder_alloc_unlock(proc);
+}
+
+/*
+ * Frees the buffers, pages and the binder_proc itself once the proc has
+ * been released and no transaction still holds a temporary reference to
+ * it.  Called with binder_main_lock held.
+ */
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct rb_node *n;
+	int buffers, page_count;
+
+	BUG_ON(!proc->is_dead);
+	BUG_ON(proc->tmp_ref);
+
+	buffers = 0;
+	while ((n = rb_first(&proc->allocated_buffers))) {
+		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
+							rb_node);
+		t = buffer->transaction;
+		if (t) {
+			t->buffer = NULL;
+			buffer->transaction = NULL;
+			printk(KERN_ERR "binder: release proc %d, "
+			       "transaction %d, not freed\n",
+			       proc->pid, t->debug_id);
+			/*BUG();*/
+		}
+		binder_free_buf(proc, buffer);
+		buffers++;
+	}
+
+	binder_stats_deleted(BINDER_STAT_PROC);
+
+	page_count = 0;
+	if (proc->pages) {
+		int i;
+
+		/* Keeps binder_shrink away from pages we are about to free */
+		binder_alloc_lock(proc);
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+			if (proc->pages[i].page_ptr) {
+				void *page_addr = proc->buffer + i * PAGE_SIZE;
+				if (!binder_lru_del(&proc->pages[i]))
+					binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+						     "binder_release: %d: "
+						     "page %d at %p not freed\n",
+						     proc->pid, i, page_addr);
+				binder_free_page(proc, NULL, page_addr);
+				page_count++;
+			}
+		}
+		binder_alloc_unlock(proc);
+		kfree(proc->pages);
+		vfree(proc->buffer);
+	}
+
+	put_task_struct(proc->tsk);
+
+	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "binder_release: %d buffers %d, pages %d\n",
+		     proc->pid, buffers, page_count);
+
+	kfree(proc);
+}
+
+/*
+ * A temporary reference keeps the binder_proc and its buffer area alive
+ * while binder_main_lock is dropped.  Both helpers are called with
+ * binder_main_lock held.
+ */
+static void binder_proc_inc_tmpref(struct binder_proc *proc)
+{
+	proc->tmp_ref++;
+}
+
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	BUG_ON(proc->tmp_ref <= 0);
+	proc->tmp_ref--;
+	if (proc->is_dead && proc->tmp_ref == 0)
+		binder_free_proc(proc);
+}
+
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   void __user *ptr)
 {
@@ -1437,7 +2099,7 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		binder_restore_priority(current, in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1514,21 +2176,8 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
-			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
-				tmp = tmp->from_parent;
-			}
 		}
 	}
-	if (target_thread) {
-		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1572,41 +2221,101 @@ static void binder_transaction(struct binder_proc *proc,
 		t->from = NULL;
 	t->sender_euid = proc->tsk->cred->euid;
 	t->to_proc = target_proc;
-	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	t->priority = binder_get_priority(current);
+	t->start_time = ktime_get();
+	if (reply)
+		t->call_start = in_reply_to->start_time;
 
 	trace_binder_transaction(reply, t, target_node);
 
+	/*
+	 * The buffer keeps a strong reference on the target node; take it
+	 * now so the node stays around while binder_main_lock is dropped.
+	 */
+	if (target_node)
+		binder_inc_node(target_node, 1, 0, NULL);
+	binder_proc_inc_tmpref(target_proc);
+	binder_unlock(__func__);
+
+	return_error = BR_OK;
+	offp = NULL;
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
-	if (t->buffer == NULL) {
-		return_error = BR_FAILED_REPLY;
-		goto err_binder_alloc_buf_failed;
+	if (t->buffer) {
+		t->buffer->allow_user_free = 0;
+		t->buffer->debug_id = t->debug_id;
+		t->buffer->transaction = t;
+		t->buffer->target_node = target_node;
+		trace_binder_transaction_alloc_buf(t->buffer);
+
+		offp = (size_t *)(t->buffer->data +
+				  ALIGN(tr->data_size, sizeof(void *)));
+
+		if (copy_from_user(t->buffer->data, tr->data.ptr.buffer,
+				   tr->data_size)) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid data ptr\n", proc->pid, thread->pid);
+			return_error = BR_FAILED_REPLY;
+		} else if (copy_from_user(offp, tr->data.ptr.offsets,
+					  tr->offsets_size)) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid offsets ptr\n", proc->pid, thread->pid);
+			return_error = BR_FAILED_REPLY;
+		}
 	}
-	t->buffer->allow_user_free = 0;
-	t->buffer->debug_id = t->debug_id;
-	t->buffer->transaction = t;
-	t->buffer->target_node = target_node;
-	trace_binder_transaction_alloc_buf(t->buffer);
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
 
-	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
+	binder_lock(__func__);
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
+	if (target_proc->is_dead) {
+		return_error = BR_DEAD_REPLY;
+		goto err_target_proc_dead;
 	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
+	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
+		goto err_binder_alloc_buf_failed;
+	}
+	if (return_error != BR_OK)
 		goto err_copy_data_failed;
+
+	/* Revalidate what may have changed while the lock was dropped */
+	if (reply) {
+		if (in_reply_to->from != target_thread) {
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_target_thread;
+		}
+		if (target_thread->transaction_stack != in_reply_to) {
+			binder_user_error("binder: %d:%d got reply transaction "
+				"with bad target transaction stack %d, "
+				"expected %d\n",
+				proc->pid, thread->pid,
+				target_thread->transaction_stack ?
+				target_thread->transaction_stack->debug_id : 0,
+				in_reply_to->debug_id);
+			return_error = BR_FAILED_REPLY;
+			in_reply_to = NULL;
+			goto err_dead_target_thread;
+		}
+	} else if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
+		struct binder_transaction *tmp;
+		tmp = thread->transaction_stack;
+		while (tmp) {
+			if (tmp->from && tmp->from->proc == target_proc)
+				target_thread = tmp->from;
+			tmp = tmp->from_parent;
+		}
 	}
+	if (target_thread) {
+		e->to_thread = target_thread->pid;
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
+	}
+	t->to_thread = target_thread;
+
 	if (!IS_ALIGNED(tr->offsets_size, sizeof(size_t))) {
 		binder_user_error("binder: %d:%d got transaction with "
 			"invalid offsets size, %zd\n",
@@ -1632,13 +2341,26 @@ static void binder_transaction(struct binder_proc *proc,
 		case BINDER_TYPE_WEAK_BINDER: {
 			struct binder_ref *ref;
 			struct binder_node *node = binder_get_node(proc, fp->binder);
+			int priority;
 			if (node == NULL) {
 				node = binder_new_node(proc, fp->binder, fp->cookie);
 				if (node == NULL) {
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_new_node_failed;
 				}
-				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+				node->sched_policy = (fp->flags &
+					FLAT_BINDER_FLAG_SCHED_POLICY_MASK) >>
+					FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT;
+				/* A nice value is negative for a raised priority */
+				priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+				if (is_rt_policy(node->sched_policy))
+					priority = clamp_t(int, priority, 1,
+							   MAX_USER_RT_PRIO - 1);
+				else
+					priority = clamp_t(int, (s8)priority,
+							   -20, 19);
+				node->min_priority = to_kernel_prio(
+					node->sched_policy, priority);
 				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
 			}
 			if (fp->cookie != node->cookie) {
@@ -1799,6 +2521,7 @@ static void binder_transaction(struct binder_proc *proc,
 	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	binder_proc_dec_tmpref(target_proc);
 	return;
 
 err_get_unused_fd_failed:
@@ -1810,11 +2533,27 @@ err_binder_new_node_failed:
 err_bad_object_type:
 err_bad_offset:
 err_copy_data_failed:
+err_dead_target_thread:
 	trace_binder_transaction_failed_buffer_release(t->buffer);
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
+	goto err_put_target_proc;
 err_binder_alloc_buf_failed:
+	if (target_node)
+		binder_dec_node(target_node, 1, 0);
+	goto err_put_target_proc;
+err_target_proc_dead:
+	/*
+	 * binder_deferred_release() already tore down the target's nodes,
+	 * so the node reference is gone; only the buffer is left to free.
+	 */
+	if (t->buffer) {
+		t->buffer->transaction = NULL;
+		binder_free_buf(target_proc, t->buffer);
+	}
+err_put_target_proc:
+	binder_proc_dec_tmpref(target_proc);
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
@@ -1837,7 +2576,22 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
-	BUG_ON(thread->return_error != BR_OK);
+	if (thread->return_error != BR_OK) {
+		/*
+		 * A failed reply can be delivered to this thread while
+		 * binder_main_lock is dropped above; keep it queued ahead of
+		 * our own error the same way binder_send_failed_reply() does.
+		 */
+		if (thread->return_error2 != BR_OK) {
+			printk(KERN_ERR "binder: %d:%d transaction failed %d, "
+			       "thread has error codes %d %d already\n",
+			       proc->pid, thread->pid, return_error,
+			       thread->return_error2, thread->return_error);
+			return;
+		}
+		thread->return_error2 = thread->return_error;
+		thread->return_error = BR_OK;
+	}
 	if (in_reply_to) {
 		thread->return_error = BR_TRANSACTION_COMPLETE;
 		binder_send_failed_reply(in_reply_to, return_error);
@@ -2030,7 +2784,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			}
 			trace_binder_transaction_buffer_release(buffer);
 			binder_transaction_buffer_release(proc, buffer, NULL);
+			/*
+			 * Nothing else can reach the buffer once it is no
+			 * longer user-freeable, so unmapping its pages does
+			 * not need binder_main_lock.
+			 */
+			buffer->allow_user_free = 0;
+			binder_unlock(__func__);
 			binder_free_buf(proc, buffer);
+			binder_lock(__func__);
 			break;
 		}
 
@@ -2317,7 +3079,7 @@ retry:
 			wait_event_interruptible(binder_user_error_wait,
 						 binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		binder_restore_priority(current, proc->default_priority);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
@@ -2483,13 +3245,7 @@ retry:
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+			binder_transaction_priority(current, t, target_node);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2525,6 +3281,11 @@ retry:
 
 		trace_binder_transaction_received(t);
 		binder_stat_br(proc, thread, cmd);
+		binder_latency_record(proc, BINDER_LATENCY_DISPATCH,
+				      t->start_time);
+		if (cmd == BR_REPLY)
+			binder_latency_record(proc, BINDER_LATENCY_ROUND_TRIP,
+					      t->call_start);
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
 			     "size %zd-%zd ptr %p-%p\n",
@@ -2622,8 +3383,10 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 {
 	struct binder_thread *thread = NULL;
 	struct rb_node *parent = NULL;
-	struct rb_node **p = &proc->threads.rb_node;
+	struct rb_node **p;
 
+	binder_thread_lock(proc);
+	p = &proc->threads.rb_node;
 	while (*p) {
 		parent = *p;
 		thread = rb_entry(parent, struct binder_thread, rb_node);
@@ -2638,7 +3401,7 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 	if (*p == NULL) {
 		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
 		if (thread == NULL)
-			return NULL;
+			goto out;
 		binder_stats_created(BINDER_STAT_THREAD);
 		thread->proc = proc;
 		thread->pid = current->pid;
@@ -2650,6 +3413,8 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		thread->return_error = BR_OK;
 		thread->return_error2 = BR_OK;
 	}
+out:
+	binder_thread_unlock(proc);
 	return thread;
 }
 
@@ -2660,7 +3425,9 @@ static int binder_free_thread(struct binder_proc *proc,
 	struct binder_transaction *send_reply = NULL;
 	int active_transactions = 0;
 
+	binder_thread_lock(proc);
 	rb_erase(&thread->rb_node, &proc->threads);
+	binder_thread_unlock(proc);
 	t = thread->transaction_stack;
 	if (t && t->to_thread == thread)
 		send_reply = t;
@@ -2701,15 +3468,13 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	binder_lock(__func__);
-
 	thread = binder_get_thread(proc);
+	if (thread == NULL)
+		return POLLERR;
 
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
 
-	binder_unlock(__func__);
-
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
 			return POLLIN;
@@ -2895,7 +3660,7 @@ static struct vm_operations_struct binder_vm_ops = {
 
 static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	int ret;
+	int ret, i;
 	struct vm_struct *area;
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
@@ -2949,6 +3714,10 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -3003,7 +3772,14 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
+	mutex_init(&proc->thread_lock);
+	mutex_init(&proc->alloc_lock);
+	if (is_rt_policy(current->policy) || is_fair_policy(current->policy)) {
+		proc->default_priority = binder_get_priority(current);
+	} else {
+		proc->default_priority.sched_policy = SCHED_NORMAL;
+		proc->default_priority.prio = to_kernel_prio(SCHED_NORMAL, 0);
+	}
 
 	binder_lock(__func__);
 
@@ -3038,6 +3814,8 @@ static void binder_deferred_flush(struct binder_proc *proc)
 {
 	struct rb_node *n;
 	int wake_count = 0;
+
+	binder_thread_lock(proc);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -3046,6 +3824,7 @@ static void binder_deferred_flush(struct binder_proc *proc)
 			wake_count++;
 		}
 	}
+	binder_thread_unlock(proc);
 	wake_up_interruptible_all(&proc->wait);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
@@ -3065,9 +3844,8 @@ static int binder_release(struct inode *nodp, struct file *filp)
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
-	struct binder_transaction *t;
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
@@ -3135,57 +3913,16 @@ static void binder_deferred_release(struct binder_proc *proc)
 	}
 	binder_release_work(&proc->todo);
 	binder_release_work(&proc->delivered_death);
-	buffers = 0;
-
-	while ((n = rb_first(&proc->allocated_buffers))) {
-		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
-							rb_node);
-		t = buffer->transaction;
-		if (t) {
-			t->buffer = NULL;
-			buffer->transaction = NULL;
-			printk(KERN_ERR "binder: release proc %d, "
-			       "transaction %d, not freed\n",
-			       proc->pid, t->debug_id);
-			/*BUG();*/
-		}
-		binder_free_buf(proc, buffer);
-		buffers++;
-	}
-
-	binder_stats_deleted(BINDER_STAT_PROC);
-
-	page_count = 0;
-	if (proc->pages) {
-		int i;
-		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				void *page_addr = proc->buffer + i * PAGE_SIZE;
-				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-					     "binder_release: %d: "
-					     "page %d at %p not freed\n",
-					     proc->pid, i,
-					     page_addr);
-				unmap_kernel_range((unsigned long)page_addr,
-					PAGE_SIZE);
-				__free_page(proc->pages[i]);
-				page_count++;
-			}
-		}
-		kfree(proc->pages);
-		vfree(proc->buffer);
-	}
-
-	put_task_struct(proc->tsk);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
 		     "binder_release: %d threads %d, nodes %d (ref %d), "
-		     "refs %d, active transactions %d, buffers %d, "
-		     "pages %d\n",
+		     "refs %d, active transactions %d\n",
 		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
-		     active_transactions, buffers, page_count);
+		     active_transactions);
 
-	kfree(proc);
+	proc->is_dead = true;
+	if (proc->tmp_ref == 0)
+		binder_free_proc(proc);
 }
 
 static void binder_deferred_func(struct work_struct *work)
@@ -3246,13 +3983,14 @@ static void print_binder_transaction(struct seq_file *m, const char *prefix,
 				     struct binder_transaction *t)
 {
 	seq_printf(m,
-		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %d:%d r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
 		   t->to_proc ? t->to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
-		   t->code, t->flags, t->priority, t->need_reply);
+		   t->code, t->flags, t->priority.sched_policy,
+		   t->priority.prio, t->need_reply);
 	if (t->buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
@@ -3384,12 +4122,18 @@ static void print_binder_proc(struct seq_file *m,
 	size_t start_pos = m->count;
 	size_t header_pos;
 
+	int do_lock = !binder_debug_no_lock;
+
 	seq_printf(m, "proc %d\n", proc->pid);
 	header_pos = m->count;
 
+	if (do_lock)
+		binder_thread_lock(proc);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		print_binder_thread(m, rb_entry(n, struct binder_thread,
 						rb_node), print_all);
+	if (do_lock)
+		binder_thread_unlock(proc);
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
 		struct binder_node *node = rb_entry(n, struct binder_node,
 						    rb_node);
@@ -3403,9 +4147,13 @@ static void print_binder_proc(struct seq_file *m,
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
 	}
+	if (do_lock)
+		binder_alloc_lock(proc);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
 				    rb_entry(n, struct binder_buffer, rb_node));
+	if (do_lock)
+		binder_alloc_unlock(proc);
 	list_for_each_entry(w, &proc->todo, entry)
 		print_binder_work(m, "  ", "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
@@ -3501,17 +4249,87 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	}
 }
 
+static const char *binder_latency_strings[] = {
+	"dispatch",
+	"round trip"
+};
+
+static void print_binder_latency_stats(struct seq_file *m, const char *prefix,
+				       struct binder_latency_stats *ls)
+{
+	int type, i;
+
+	BUILD_BUG_ON(ARRAY_SIZE(binder_latency_strings) !=
+		     BINDER_LATENCY_COUNT);
+	for (type = 0; type < BINDER_LATENCY_COUNT; type++) {
+		u64 total = 0;
+
+		for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+			total += ls->hist[type][i];
+		if (!total)
+			continue;
+		seq_printf(m, "%s%s latency: %llu\n", prefix,
+			   binder_latency_strings[type], total);
+		for (i = 0; i < BINDER_LATENCY_BUCKETS; i++) {
+			if (!ls->hist[type][i])
+				continue;
+			if (i == 0)
+				seq_printf(m, "%s  < 1 us: %u\n", prefix,
+					   ls->hist[type][i]);
+			else if (i == BINDER_LATENCY_BUCKETS - 1)
+				seq_printf(m, "%s  >= %lu us: %u\n", prefix,
+					   1UL << (i - 1), ls->hist[type][i]);
+			else
+				seq_printf(m, "%s  %lu-%lu us: %u\n", prefix,
+					   1UL << (i - 1), (1UL << i) - 1,
+					   ls->hist[type][i]);
+		}
+	}
+}
+
+static const char *binder_lock_strings[] = {
+	"main",
+	"alloc",
+	"thread"
+};
+
+static void print_binder_lock_stats(struct seq_file *m)
+{
+	unsigned long acquired, contended;
+	int cpu, i;
+
+	BUILD_BUG_ON(ARRAY_SIZE(binder_lock_strings) != BINDER_LOCK_COUNT);
+	for (i = 0; i < BINDER_LOCK_COUNT; i++) {
+		acquired = 0;
+		contended = 0;
+		for_each_possible_cpu(cpu) {
+			struct binder_lock_stats *ls;
+
+			ls = &per_cpu(binder_lock_stats, cpu);
+			acquired += ls->acquired[i];
+			contended += ls->contended[i];
+		}
+		seq_printf(m, "lock %s: acquired %lu contended %lu\n",
+			   binder_lock_strings[i], acquired, contended);
+	}
+}
+
 static void print_binder_proc_stats(struct seq_file *m,
 				    struct binder_proc *proc)
 {
 	struct binder_work *w;
 	struct rb_node *n;
 	int count, strong, weak;
+	int do_lock = !binder_debug_no_lock;
 
 	seq_printf(m, "proc %d\n", proc->pid);
 	count = 0;
+	if (do_lock)
+		binder_thread_lock(proc);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		count++;
+	if (do_lock)
+		binder_thread_unlock(proc);
 	seq_printf(m, "  threads: %d\n", count);
 	seq_printf(m, "  requested threads: %d+%d/%d\n"
 			"  ready threads %d\n"
@@ -3535,9 +4353,24 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	if (do_lock)
+		binder_alloc_lock(proc);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
 	seq_printf(m, "  buffers: %d\n", count);
+	seq_printf(m, "  cached buffers: %d hits %lu\n",
+		   proc->buffer_cache_count, proc->buffer_cache_hits);
+	count = 0;
+	if (proc->pages) {
+		int i;
+
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++)
+			if (proc->pages[i].page_ptr)
+				count++;
+	}
+	seq_printf(m, "  pages: %d lru %d\n", count, proc->pages_lru);
+	if (do_lock)
+		binder_alloc_unlock(proc);
 
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
@@ -3552,6 +4385,7 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  pending transactions: %d\n", count);
 
 	print_binder_stats(m, "  ", &proc->stats);
+	print_binder_latency_stats(m, "  ", &proc->latency);
 }
 
 
@@ -3590,7 +4424,10 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 
 	seq_puts(m, "binder stats:\n");
 
+	print_binder_lock_stats(m);
 	print_binder_stats(m, "", &binder_stats);
+	print_binder_latency_stats(m, "", &binder_latency_stats);
+	seq_printf(m, "lru pages: %d\n", binder_lru_count);
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
@@ -3636,6 +4473,7 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	if (valid_proc) {
 		seq_puts(m, "binder proc state:\n");
 		print_binder_proc(m, proc, 1);
+		print_binder_latency_stats(m, "  ", &proc->latency);
 	}
 	if (do_lock)
 		binder_unlock(__func__);
@@ -3696,6 +4534,8 @@ static int __init binder_init(void)
 	if (!binder_deferred_workqueue)
 		return -ENOMEM;
 
+	register_shrinker(&binder_shrinker);
+
 	binder_debugfs_dir_entry_root = debugfs_create_dir("binder", NULL);
 	if (binder_debugfs_dir_entry_root)
 		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
@@ -37,6 +37,13 @@ enum {
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/*
+	 * Scheduling policy of the minimum priority a node is handled at.
+	 * With SCHED_NORMAL (0) or SCHED_BATCH the priority bits hold a
+	 * nice value, with SCHED_FIFO or SCHED_RR an rt_priority.
+	 */
+	FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT = 9,
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK = 3U << 9,
 };
 
 /*
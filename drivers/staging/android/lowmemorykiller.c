@@ -17,6 +17,17 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept indexed by oom_score_adj, so finding a victim only
+ * looks at the buckets from OOM_SCORE_ADJ_MAX down to the first one holding
+ * a process with memory, rather than at every process in the system.
+ * scan_count, scan_time_us and scan_time_max_us in the parameters directory
+ * report how often and how long victims were searched for, and kills the
+ * number of processes killed for each entry of adj.
+ *
+ * With CONFIG_ANDROID_LOW_MEMORY_KILLER_VMPRESSURE the kills are made by a
+ * kernel thread on vmpressure events instead of from the shrinker; see
+ * lowmem_thread_fn().
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -34,12 +45,22 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/debugfs.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
 #include <linux/mm.h>
 #include <linux/oom.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
 #include <linux/swap.h>
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
+#include <linux/vmpressure.h>
+#include <linux/workqueue.h>
+
+#include "lowmemorykiller_trace.h"
 
 static uint32_t lowmem_debug_level = 1;
 static int lowmem_adj[6] = {
@@ -59,115 +80,444 @@ static int lowmem_minfree_size = 4;
 
 static unsigned long lowmem_deathpending_timeout;
 
+static unsigned long lowmem_scan_count;
+static unsigned long lowmem_scan_time_us;
+static unsigned long lowmem_scan_time_max_us;
+static unsigned int lowmem_kills[6];
+static int lowmem_kills_size = 4;
+
+/* One kill: why it happened, whom it hit, and how long the memory took */
+struct lowmem_kill_info {
+	struct task_struct *task;	/* referenced while tracked */
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
+	int oom_score_adj;
+	int min_score_adj;
+	int minfree;
+	int other_free;
+	int other_file;
+	unsigned long rss;
+	unsigned long swap;
+	unsigned long scan_us;
+	long free_pages;		/* NR_FREE_PAGES when killed */
+	ktime_t kill_time;
+	long exit_us;			/* -1 until the victim exits */
+	long free_us;			/* -1 until its mm is released */
+	/*
+	 * System-wide NR_FREE_PAGES gained between the kill and the
+	 * victim's mm going away; other allocations and frees count too.
+	 */
+	long free_gained;
+};
+
+/*
+ * Thread group leaders, one bucket per oom_score_adj value.  The lock
+ * nests inside tasklist_lock, which is taken from interrupts, so it is
+ * always taken with interrupts disabled.  Neither task_lock() nor
+ * siglock may be held when taking it, as victim selection takes
+ * task_lock() inside it.
+ */
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static struct hlist_head lowmem_index[OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN + 1];
+
+static void __lowmem_index_add(struct task_struct *p)
+{
+	int adj = p->signal->oom_score_adj;
+
+	hlist_add_head(&p->lowmem_node, &lowmem_index[adj - OOM_SCORE_ADJ_MIN]);
+}
+
+/* A new thread group leader is visible, called with tasklist_lock held */
+void lowmem_index_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	__lowmem_index_add(p);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/* A thread group is gone, called with tasklist_lock held */
+void lowmem_index_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	hlist_del_init(&p->lowmem_node);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/* exec() in a thread made it the leader, called with tasklist_lock held */
+void lowmem_index_replace(struct task_struct *old, struct task_struct *new)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	hlist_del_init(&old->lowmem_node);
+	__lowmem_index_add(new);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/*
+ * oom_score_adj of p's thread group changed.  The value is read under
+ * the lock, so of several racing updates the last one files the leader
+ * under the final value.
+ */
+void lowmem_index_update(struct task_struct *p)
+{
+	struct task_struct *leader;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	leader = p->group_leader;
+	if (!hlist_unhashed(&leader->lowmem_node)) {
+		hlist_del(&leader->lowmem_node);
+		__lowmem_index_add(leader);
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
 			pr_info(x);			\
 	} while (0)
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+static int lowmem_array_size(void)
 {
-	struct task_struct *tsk;
-	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
-	int i;
-	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
-	int minfree = 0;
-	int selected_tasksize = 0;
-	int selected_oom_score_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
-	int other_file = global_page_state(NR_FILE_PAGES) -
-						global_page_state(NR_SHMEM);
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
+	return array_size;
+}
+
+/*
+ * Returns the lowest oom_score_adj to kill at, or OOM_SCORE_ADJ_MAX + 1
+ * if both free and file pages are above every minfree level.  *band is
+ * set to the index of the breached level.
+ */
+static int lowmem_min_score_adj(int other_free, int other_file, int *band)
+{
+	int array_size = lowmem_array_size();
+	int i;
+
 	for (i = 0; i < array_size; i++) {
-		minfree = lowmem_minfree[i];
-		if (other_free < minfree && other_file < minfree) {
-			min_score_adj = lowmem_adj[i];
-			break;
+		if (other_free < lowmem_minfree[i] &&
+		    other_file < lowmem_minfree[i]) {
+			*band = i;
+			return lowmem_adj[i];
 		}
 	}
-	if (sc->nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
-				sc->nr_to_scan, sc->gfp_mask, other_free,
-				other_file, min_score_adj);
-	rem = global_page_state(NR_ACTIVE_ANON) +
-		global_page_state(NR_ACTIVE_FILE) +
-		global_page_state(NR_INACTIVE_ANON) +
-		global_page_state(NR_INACTIVE_FILE);
-	if (sc->nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
-		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
-			     sc->nr_to_scan, sc->gfp_mask, rem);
-		return rem;
-	}
-	selected_oom_score_adj = min_score_adj;
+	return OOM_SCORE_ADJ_MAX + 1;
+}
+
+/*
+ * All threads of the victim have dropped their mm.  Only a reference
+ * is held on the victim, so its thread list is walked under RCU and
+ * only while it is still hashed.
+ */
+static bool lowmem_victim_gone(struct task_struct *victim)
+{
+	struct task_struct *p;
+	bool gone = true;
 
 	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_score_adj;
+	if (pid_alive(victim)) {
+		p = find_lock_task_mm(victim);
+		if (p) {
+			task_unlock(p);
+			gone = false;
+		}
+	}
+	rcu_read_unlock();
+	return gone;
+}
 
-		if (tsk->flags & PF_KTHREAD)
-			continue;
+/*
+ * Picks the process with the highest oom_score_adj of at least
+ * k->min_score_adj, the largest one if several share it, and returns it
+ * with a reference held.  Returns NULL if there is none, or
+ * ERR_PTR(-EBUSY) if an earlier victim is still exiting.
+ */
+static struct task_struct *lowmem_select(struct lowmem_kill_info *k,
+					 int band)
+{
+	struct task_struct *tsk;
+	struct hlist_node *node;
+	struct task_struct *selected = NULL;
+	unsigned long tasksize;
+	int adj;
+	unsigned long flags;
+	ktime_t start;
 
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
+	k->rss = 0;
+	k->oom_score_adj = k->min_score_adj;
+
+	start = ktime_get();
+	rcu_read_lock();
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	/*
+	 * Lower buckets can't beat a selection, but are still walked for a
+	 * victim that is yet to exit.
+	 */
+	for (adj = OOM_SCORE_ADJ_MAX; adj >= k->min_score_adj; adj--) {
+		hlist_for_each_entry(tsk, node,
+				     &lowmem_index[adj - OOM_SCORE_ADJ_MIN],
+				     lowmem_node) {
+			struct task_struct *p;
+
+			if (tsk->flags & PF_KTHREAD)
+				continue;
 
-		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
-		    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+			p = find_lock_task_mm(tsk);
+			if (!p)
+				continue;
+
+			if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
+			    time_before_eq(jiffies,
+					   lowmem_deathpending_timeout)) {
+				task_unlock(p);
+				selected = ERR_PTR(-EBUSY);
+				goto out;
+			}
+			if (selected && adj < k->oom_score_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(p->mm);
 			task_unlock(p);
-			rcu_read_unlock();
-			return 0;
+			if (tasksize <= k->rss)
+				continue;
+			selected = p;
+			k->rss = tasksize;
+			k->oom_score_adj = adj;
+			lowmem_print(2, "select '%s' (%d), adj %d, size %lu, to kill\n",
+				     p->comm, p->pid, adj, tasksize);
 		}
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
+	}
+	if (selected) {
+		get_task_struct(selected);
+		lowmem_deathpending_timeout = jiffies + HZ;
+		lowmem_kills[band]++;
+	}
+out:
+	k->scan_us = ktime_us_delta(ktime_get(), start);
+	lowmem_scan_count++;
+	lowmem_scan_time_us += k->scan_us;
+	if (k->scan_us > lowmem_scan_time_max_us)
+		lowmem_scan_time_max_us = k->scan_us;
+	lowmem_kills_size = lowmem_array_size();
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+	rcu_read_unlock();
+
+	if (!IS_ERR_OR_NULL(selected))
+		k->task = selected;
+	return selected;
+}
+
+/*
+ * Kill accounting.  Every kill is traced and, while fewer than
+ * LOWMEM_TRACK_MAX are outstanding, followed by lowmem_track_work until
+ * the victim exits and its memory is released.  Completed kills feed
+ * the time-to-free histogram and the log of recent kills shown in
+ * debugfs.
+ */
+#define LOWMEM_TRACK_MAX	8
+#define LOWMEM_TRACK_TIMEOUT_MS	10000
+#define LOWMEM_HIST_BUCKETS	12	/* < 1ms, < 2ms, ... < 1024ms, more */
+#define LOWMEM_RECENT_KILLS	16
+
+struct lowmem_kill_stats {
+	unsigned long kills;
+	unsigned long untracked;	/* too many kills outstanding */
+	unsigned long unfreed;		/* not freed within the timeout */
+	unsigned long freed;
+	u64 exit_us_total;
+	u64 free_us_total;
+	unsigned long free_us_max;
+	u64 free_gained_total;
+	unsigned long free_hist[LOWMEM_HIST_BUCKETS];
+};
+
+static DEFINE_SPINLOCK(lowmem_track_lock);
+static struct lowmem_kill_info lowmem_tracked[LOWMEM_TRACK_MAX];
+static struct lowmem_kill_info lowmem_recent[LOWMEM_RECENT_KILLS];
+static unsigned int lowmem_recent_next;
+static struct lowmem_kill_stats lowmem_stats;
+
+static void lowmem_track_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_track_work, lowmem_track_fn);
+
+static int lowmem_hist_bucket(unsigned long us)
+{
+	unsigned long ms = us / USEC_PER_MSEC;
+
+	if (!ms)
+		return 0;
+	return min_t(int, fls_long(ms), LOWMEM_HIST_BUCKETS - 1);
+}
+
+/* Called with lowmem_track_lock held */
+static void lowmem_track_done(struct lowmem_kill_info *k)
+{
+	if (k->free_us >= 0) {
+		lowmem_stats.freed++;
+		lowmem_stats.exit_us_total += k->exit_us;
+		lowmem_stats.free_us_total += k->free_us;
+		if (k->free_us > lowmem_stats.free_us_max)
+			lowmem_stats.free_us_max = k->free_us;
+		lowmem_stats.free_gained_total += k->free_gained;
+		lowmem_stats.free_hist[lowmem_hist_bucket(k->free_us)]++;
+	} else {
+		lowmem_stats.unfreed++;
+	}
+
+	put_task_struct(k->task);
+	k->task = NULL;
+	lowmem_recent[lowmem_recent_next] = *k;
+	lowmem_recent_next = (lowmem_recent_next + 1) % LOWMEM_RECENT_KILLS;
+}
+
+static void lowmem_track_fn(struct work_struct *work)
+{
+	struct lowmem_kill_info *k;
+	bool pending = false;
+	long free_pages;
+	long us;
+	int i;
+
+	spin_lock(&lowmem_track_lock);
+	for (i = 0; i < LOWMEM_TRACK_MAX; i++) {
+		k = &lowmem_tracked[i];
+		if (!k->task)
 			continue;
+
+		us = ktime_us_delta(ktime_get(), k->kill_time);
+		if (k->exit_us < 0 && (k->task->flags & PF_EXITING)) {
+			k->exit_us = us;
+			trace_lowmemory_exit(k);
 		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
-				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
+		if (lowmem_victim_gone(k->task)) {
+			if (k->exit_us < 0)
+				k->exit_us = us;
+			k->free_us = us;
+			free_pages = global_page_state(NR_FREE_PAGES);
+			k->free_gained = max(free_pages - k->free_pages, 0L);
+			trace_lowmemory_free(k);
+			lowmem_track_done(k);
+		} else if (us >= LOWMEM_TRACK_TIMEOUT_MS * USEC_PER_MSEC) {
+			lowmem_track_done(k);
+		} else {
+			pending = true;
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(2, "select '%s' (%d), adj %d, size %d, to kill\n",
-			     p->comm, p->pid, oom_score_adj, tasksize);
 	}
+	spin_unlock(&lowmem_track_lock);
+
+	if (pending)
+		schedule_delayed_work(&lowmem_track_work, 1);
+}
+
+static void lowmem_track(struct lowmem_kill_info *k)
+{
+	int i;
+
+	spin_lock(&lowmem_track_lock);
+	lowmem_stats.kills++;
+	for (i = 0; i < LOWMEM_TRACK_MAX; i++) {
+		if (!lowmem_tracked[i].task)
+			break;
+	}
+	if (i == LOWMEM_TRACK_MAX) {
+		lowmem_stats.untracked++;
+		spin_unlock(&lowmem_track_lock);
+		return;
+	}
+	get_task_struct(k->task);
+	lowmem_tracked[i] = *k;
+	spin_unlock(&lowmem_track_lock);
+
+	schedule_delayed_work(&lowmem_track_work, 1);
+}
+
+static void lowmem_kill(struct lowmem_kill_info *k)
+{
+	struct task_struct *selected = k->task;
+	struct task_struct *p;
+
+	k->pid = selected->pid;
+	get_task_comm(k->comm, selected);
+	k->swap = 0;
+	p = find_lock_task_mm(selected);
+	if (p) {
+		k->swap = get_mm_counter(p->mm, MM_SWAPENTS);
+		task_unlock(p);
+	}
+	k->free_pages = global_page_state(NR_FREE_PAGES);
+	k->exit_us = -1;
+	k->free_us = -1;
+	k->free_gained = 0;
+
+	lowmem_print(1, "Killing '%s' (%d), adj %d,\n" \
+			"   to free %ldkB on behalf of '%s' (%d) because\n" \
+			"   cache %ldkB is below limit %ldkB for oom_score_adj %d\n" \
+			"   Free memory is %ldkB above reserved\n",
+		     selected->comm, selected->pid,
+		     k->oom_score_adj,
+		     k->rss * (long)(PAGE_SIZE / 1024),
+		     current->comm, current->pid,
+		     k->other_file * (long)(PAGE_SIZE / 1024),
+		     k->minfree * (long)(PAGE_SIZE / 1024),
+		     k->min_score_adj,
+		     k->other_free * (long)(PAGE_SIZE / 1024));
+	k->kill_time = ktime_get();
+	send_sig(SIGKILL, selected, 0);
+	set_tsk_thread_flag(selected, TIF_MEMDIE);
+
+	trace_lowmemory_kill(k);
+	lowmem_track(k);
+}
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct lowmem_kill_info k;
+	struct task_struct *selected;
+	int rem = 0;
+	int band = 0;
+
+	k.other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
+	k.other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+
+	k.min_score_adj = lowmem_min_score_adj(k.other_free, k.other_file,
+					       &band);
+	if (sc->nr_to_scan > 0)
+		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
+				sc->nr_to_scan, sc->gfp_mask, k.other_free,
+				k.other_file, k.min_score_adj);
+	rem = global_page_state(NR_ACTIVE_ANON) +
+		global_page_state(NR_ACTIVE_FILE) +
+		global_page_state(NR_INACTIVE_ANON) +
+		global_page_state(NR_INACTIVE_FILE);
+	if (sc->nr_to_scan <= 0 || k.min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
+		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
+			     sc->nr_to_scan, sc->gfp_mask, rem);
+		return rem;
+	}
+
+	selected = lowmem_select(&k, band);
+	if (IS_ERR(selected))
+		return 0;
 	if (selected) {
-		lowmem_print(1, "Killing '%s' (%d), adj %d,\n" \
-				"   to free %ldkB on behalf of '%s' (%d) because\n" \
-				"   cache %ldkB is below limit %ldkB for oom_score_adj %d\n" \
-				"   Free memory is %ldkB above reserved\n",
-			     selected->comm, selected->pid,
-			     selected_oom_score_adj,
-			     selected_tasksize * (long)(PAGE_SIZE / 1024),
-			     current->comm, current->pid,
-			     other_file * (long)(PAGE_SIZE / 1024),
-			     minfree * (long)(PAGE_SIZE / 1024),
-			     min_score_adj,
-			     other_free * (long)(PAGE_SIZE / 1024));
-		lowmem_deathpending_timeout = jiffies + HZ;
-		send_sig(SIGKILL, selected, 0);
-		set_tsk_thread_flag(selected, TIF_MEMDIE);
-		rem -= selected_tasksize;
+		k.minfree = lowmem_minfree[band];
+		lowmem_kill(&k);
+		put_task_struct(selected);
+		rem -= k.rss;
 	}
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	rcu_read_unlock();
 	return rem;
 }
 
@@ -176,16 +526,250 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
-static int __init lowmem_init(void)
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_VMPRESSURE
+/*
+ * Instead of the shrinker, a kernel thread kills when the root memory
+ * cgroup reports medium or critical pressure.  After a kill it waits
+ * for the victim's memory to be released, up to victim_timeout_ms, and
+ * drops the pressure reported meanwhile: it was measured before that
+ * memory came back.
+ */
+static struct task_struct *lowmem_thread;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_wait);
+/* highest level reported since the thread last looked, -1 for none */
+static atomic_t lowmem_pressure = ATOMIC_INIT(-1);
+static unsigned int lowmem_victim_timeout_ms = 1000;
+
+static int lowmem_vmpressure_notify(struct notifier_block *nb,
+				    unsigned long level, void *data)
+{
+	int old;
+
+	if (level < VMPRESSURE_MEDIUM)
+		return NOTIFY_OK;
+
+	do {
+		old = atomic_read(&lowmem_pressure);
+		if ((int)level <= old)
+			return NOTIFY_OK;
+	} while (atomic_cmpxchg(&lowmem_pressure, old, level) != old);
+
+	wake_up(&lowmem_wait);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call = lowmem_vmpressure_notify,
+};
+
+/*
+ * Critical pressure means reclaim mostly fails, so the page cache the
+ * minfree levels count as free is being thrashed: kill at the highest
+ * adj level even if no level is breached.
+ */
+static struct task_struct *lowmem_vmpressure_kill(int level)
+{
+	struct lowmem_kill_info k;
+	struct task_struct *selected;
+	int band = 0;
+
+	k.other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
+	k.other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+
+	k.min_score_adj = lowmem_min_score_adj(k.other_free, k.other_file,
+					       &band);
+	lowmem_print(3, "vmpressure level %d, ofree %d %d, ma %d\n",
+		     level, k.other_free, k.other_file, k.min_score_adj);
+	if (k.min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
+		if (level < VMPRESSURE_CRITICAL || lowmem_array_size() <= 0)
+			return NULL;
+		band = lowmem_array_size() - 1;
+		k.min_score_adj = lowmem_adj[band];
+	}
+
+	selected = lowmem_select(&k, band);
+	if (IS_ERR_OR_NULL(selected))
+		return NULL;
+
+	k.minfree = lowmem_minfree[band];
+	lowmem_kill(&k);
+	return selected;
+}
+
+static void lowmem_wait_for_victim(struct task_struct *victim)
+{
+	unsigned long timeout = jiffies +
+			msecs_to_jiffies(lowmem_victim_timeout_ms);
+
+	while (!lowmem_victim_gone(victim) && time_before(jiffies, timeout) &&
+	       !kthread_should_stop())
+		schedule_timeout_interruptible(msecs_to_jiffies(10));
+}
+
+static int lowmem_thread_fn(void *data)
+{
+	struct task_struct *victim;
+	int level;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(lowmem_wait,
+					 atomic_read(&lowmem_pressure) >= 0 ||
+					 kthread_should_stop());
+
+		level = atomic_xchg(&lowmem_pressure, -1);
+		if (level < 0)
+			continue;
+
+		victim = lowmem_vmpressure_kill(level);
+		if (!victim)
+			continue;
+
+		lowmem_wait_for_victim(victim);
+		put_task_struct(victim);
+		atomic_set(&lowmem_pressure, -1);
+	}
+	return 0;
+}
+
+static int __init lowmem_start(void)
+{
+	lowmem_thread = kthread_run(lowmem_thread_fn, NULL, "lowmemorykiller");
+	if (IS_ERR(lowmem_thread))
+		return PTR_ERR(lowmem_thread);
+	vmpressure_notifier_register(&lowmem_vmpressure_nb);
+	return 0;
+}
+
+static void __exit lowmem_stop(void)
+{
+	vmpressure_notifier_unregister(&lowmem_vmpressure_nb);
+	kthread_stop(lowmem_thread);
+}
+#else
+static int __init lowmem_start(void)
 {
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
 
-static void __exit lowmem_exit(void)
+static void __exit lowmem_stop(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
 }
+#endif
+
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *lowmem_debugfs_dir;
+
+static int lowmem_summary_show(struct seq_file *m, void *unused)
+{
+	struct lowmem_kill_stats stats;
+	struct lowmem_kill_info *k;
+	unsigned int next;
+	int i;
+
+	spin_lock(&lowmem_track_lock);
+	stats = lowmem_stats;
+	next = lowmem_recent_next;
+	spin_unlock(&lowmem_track_lock);
+
+	seq_printf(m, "kills: %lu\n", stats.kills);
+	seq_printf(m, "untracked: %lu\n", stats.untracked);
+	seq_printf(m, "unfreed: %lu\n", stats.unfreed);
+	seq_printf(m, "freed: %lu\n", stats.freed);
+	if (stats.freed) {
+		seq_printf(m, "avg time to exit: %llu us\n",
+			   div_u64(stats.exit_us_total, stats.freed));
+		seq_printf(m, "avg time to free: %llu us\n",
+			   div_u64(stats.free_us_total, stats.freed));
+		seq_printf(m, "avg free pages gained: %llu\n",
+			   div_u64(stats.free_gained_total, stats.freed));
+	}
+	seq_printf(m, "max time to free: %lu us\n", stats.free_us_max);
+
+	seq_puts(m, "\ntime to free:\n");
+	for (i = 0; i < LOWMEM_HIST_BUCKETS - 1; i++)
+		seq_printf(m, "  < %4lu ms: %lu\n", 1UL << i,
+			   stats.free_hist[i]);
+	seq_printf(m, "  >= %3lu ms: %lu\n", 1UL << (LOWMEM_HIST_BUCKETS - 2),
+		   stats.free_hist[LOWMEM_HIST_BUCKETS - 1]);
+
+	seq_puts(m, "\nrecent kills:\n");
+	seq_puts(m, "  pid comm adj min_adj minfree free file rss swap scan_us exit_us free_us free_gained\n");
+	spin_lock(&lowmem_track_lock);
+	for (i = 0; i < LOWMEM_RECENT_KILLS; i++) {
+		k = &lowmem_recent[(next + i) % LOWMEM_RECENT_KILLS];
+		if (!k->pid)
+			continue;
+		seq_printf(m, "  %d %s %d %d %d %d %d %lu %lu %lu %ld %ld %ld\n",
+			   k->pid, k->comm, k->oom_score_adj,
+			   k->min_score_adj, k->minfree, k->other_free,
+			   k->other_file, k->rss, k->swap, k->scan_us,
+			   k->exit_us, k->free_us, k->free_gained);
+	}
+	spin_unlock(&lowmem_track_lock);
+	return 0;
+}
+
+static int lowmem_summary_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lowmem_summary_show, inode->i_private);
+}
+
+static const struct file_operations lowmem_summary_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_summary_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void __init lowmem_debugfs_init(void)
+{
+	lowmem_debugfs_dir = debugfs_create_dir("lowmemorykiller", NULL);
+	if (lowmem_debugfs_dir)
+		debugfs_create_file("summary", S_IRUGO, lowmem_debugfs_dir,
+				    NULL, &lowmem_summary_fops);
+}
+
+static void __exit lowmem_debugfs_exit(void)
+{
+	debugfs_remove_recursive(lowmem_debugfs_dir);
+}
+#else
+static inline void lowmem_debugfs_init(void)
+{
+}
+
+static inline void lowmem_debugfs_exit(void)
+{
+}
+#endif
+
+static int __init lowmem_init(void)
+{
+	int ret;
+
+	ret = lowmem_start();
+	if (ret)
+		return ret;
+	lowmem_debugfs_init();
+	return 0;
+}
+
+static void __exit lowmem_exit(void)
+{
+	int i;
+
+	lowmem_debugfs_exit();
+	lowmem_stop();
+	cancel_delayed_work_sync(&lowmem_track_work);
+	for (i = 0; i < LOWMEM_TRACK_MAX; i++) {
+		if (lowmem_tracked[i].task)
+			put_task_struct(lowmem_tracked[i].task);
+	}
+}
 
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_AUTODETECT_OOM_ADJ_VALUES
 static int lowmem_oom_adj_to_oom_score_adj(int oom_adj)
@@ -278,9 +862,21 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(scan_count, lowmem_scan_count, ulong, S_IRUGO);
+module_param_named(scan_time_us, lowmem_scan_time_us, ulong, S_IRUGO);
+module_param_named(scan_time_max_us, lowmem_scan_time_max_us, ulong, S_IRUGO);
+module_param_array_named(kills, lowmem_kills, uint, &lowmem_kills_size,
+			 S_IRUGO);
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_VMPRESSURE
+module_param_named(victim_timeout_ms, lowmem_victim_timeout_ms, uint,
+		   S_IRUGO | S_IWUSR);
+#endif
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
 
+#define CREATE_TRACE_POINTS
+#include "lowmemorykiller_trace.h"
+
 MODULE_LICENSE("GPL");
 
@@ -0,0 +1,88 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_LOWMEMORYKILLER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOWMEMORYKILLER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+struct lowmem_kill_info;
+
+TRACE_EVENT(lowmemory_kill,
+	TP_PROTO(struct lowmem_kill_info *k),
+	TP_ARGS(k),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__array(char, comm, TASK_COMM_LEN)
+		__field(int, oom_score_adj)
+		__field(int, min_score_adj)
+		__field(int, minfree)
+		__field(int, other_free)
+		__field(int, other_file)
+		__field(unsigned long, rss)
+		__field(unsigned long, swap)
+		__field(unsigned long, scan_us)
+	),
+	TP_fast_assign(
+		__entry->pid = k->pid;
+		memcpy(__entry->comm, k->comm, TASK_COMM_LEN);
+		__entry->oom_score_adj = k->oom_score_adj;
+		__entry->min_score_adj = k->min_score_adj;
+		__entry->minfree = k->minfree;
+		__entry->other_free = k->other_free;
+		__entry->other_file = k->other_file;
+		__entry->rss = k->rss;
+		__entry->swap = k->swap;
+		__entry->scan_us = k->scan_us;
+	),
+	TP_printk("pid=%d comm=%s adj=%d min_adj=%d minfree=%d free=%d file=%d rss=%lu swap=%lu scan_us=%lu",
+		  __entry->pid, __entry->comm, __entry->oom_score_adj,
+		  __entry->min_score_adj, __entry->minfree,
+		  __entry->other_free, __entry->other_file,
+		  __entry->rss, __entry->swap, __entry->scan_us)
+);
+
+TRACE_EVENT(lowmemory_exit,
+	TP_PROTO(struct lowmem_kill_info *k),
+	TP_ARGS(k),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(long, exit_us)
+	),
+	TP_fast_assign(
+		__entry->pid = k->pid;
+		__entry->exit_us = k->exit_us;
+	),
+	TP_printk("pid=%d exit_us=%ld", __entry->pid, __entry->exit_us)
+);
+
+TRACE_EVENT(lowmemory_free,
+	TP_PROTO(struct lowmem_kill_info *k),
+	TP_ARGS(k),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(long, exit_us)
+		__field(long, free_us)
+		__field(long, free_gained)
+	),
+	TP_fast_assign(
+		__entry->pid = k->pid;
+		__entry->exit_us = k->exit_us;
+		__entry->free_us = k->free_us;
+		__entry->free_gained = k->free_gained;
+	),
+	TP_printk("pid=%d exit_us=%ld free_us=%ld free_gained=%ld",
+		  __entry->pid, __entry->exit_us, __entry->free_us,
+		  __entry->free_gained)
+);
+
+#endif /* _LOWMEMORYKILLER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE lowmemorykiller_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,295 @@
+/*
+ * zram compression streams
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/gfp.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zcomp.h"
+
+static struct zcomp_backend *backends[] = {
+	&zcomp_lzo,
+#ifdef CONFIG_ZRAM_LZ4_COMPRESS
+	&zcomp_lz4,
+#endif
+	NULL
+};
+
+static struct zcomp_backend *find_backend(const char *compress)
+{
+	int i;
+
+	for (i = 0; backends[i]; i++)
+		if (!strcmp(compress, backends[i]->name))
+			return backends[i];
+#ifdef CONFIG_ZRAM_CRYPTO_COMPRESS
+	/* Anything else the crypto API can compress with */
+	if (crypto_has_comp(compress, 0, 0))
+		return &zcomp_crypto;
+#endif
+	return NULL;
+}
+
+bool zcomp_available_algorithm(const char *comp)
+{
+	return find_backend(comp) != NULL;
+}
+
+/*
+ * Lists the built-in algorithms with the selected one in brackets.  A
+ * crypto API algorithm is only listed when it is selected.
+ */
+ssize_t zcomp_available_show(const char *comp, char *buf)
+{
+	bool listed = false;
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (!strcmp(comp, backends[i]->name)) {
+			listed = true;
+			sz += scnprintf(buf + sz, PAGE_SIZE - sz - 2,
+					"[%s] ", backends[i]->name);
+		} else {
+			sz += scnprintf(buf + sz, PAGE_SIZE - sz - 2,
+					"%s ", backends[i]->name);
+		}
+	}
+	if (!listed)
+		sz += scnprintf(buf + sz, PAGE_SIZE - sz - 2, "[%s] ", comp);
+	sz += scnprintf(buf + sz, PAGE_SIZE - sz, "\n");
+	return sz;
+}
+
+static void zcomp_strm_free(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	if (zstrm->private)
+		comp->backend->destroy(zstrm->private);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+/*
+ * Called from the I/O path, so it must not recurse into the block
+ * layer: allocate with GFP_NOIO.
+ */
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm = kmalloc(sizeof(*zstrm), GFP_NOIO);
+
+	if (!zstrm)
+		return NULL;
+
+	zstrm->private = comp->backend->create(comp->name);
+	zstrm->buffer = (void *)__get_free_pages(GFP_NOIO | __GFP_ZERO, 1);
+	if (!zstrm->private || !zstrm->buffer) {
+		zcomp_strm_free(comp, zstrm);
+		return NULL;
+	}
+	return zstrm;
+}
+
+/*
+ * Gets an idle stream, allocating a new one if fewer than max_strm
+ * exist, or sleeps until another writer releases one.  If allocation
+ * fails we wait for an existing stream; at least one stream always
+ * exists, see zcomp_create().
+ */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_entry(comp->idle_strm.next,
+					   struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+		/* All streams are busy, wait for one unless we may add one */
+		if (comp->avail_strm >= comp->max_strm ||
+		    comp->backend->prealloc_strm) {
+			spin_unlock(&comp->strm_lock);
+			wait_event(comp->strm_wait,
+				   !list_empty(&comp->idle_strm));
+			continue;
+		}
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+
+		zstrm = zcomp_strm_alloc(comp);
+		if (zstrm)
+			return zstrm;
+
+		spin_lock(&comp->strm_lock);
+		comp->avail_strm--;
+		spin_unlock(&comp->strm_lock);
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	if (comp->avail_strm <= comp->max_strm) {
+		list_add(&zstrm->list, &comp->idle_strm);
+		spin_unlock(&comp->strm_lock);
+		wake_up(&comp->strm_wait);
+		return;
+	}
+
+	/* max_strm was lowered while this stream was busy */
+	comp->avail_strm--;
+	spin_unlock(&comp->strm_lock);
+	zcomp_strm_free(comp, zstrm);
+}
+
+/*
+ * Fills the pool up to max_strm for backends that can't add streams
+ * from the write path.  On failure writers share the streams there are.
+ */
+static void zcomp_strm_prealloc(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	spin_lock(&comp->strm_lock);
+	while (comp->avail_strm < comp->max_strm) {
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+
+		zstrm = zcomp_strm_alloc(comp);
+		if (!zstrm) {
+			spin_lock(&comp->strm_lock);
+			comp->avail_strm--;
+			break;
+		}
+		zcomp_strm_release(comp, zstrm);
+		spin_lock(&comp->strm_lock);
+	}
+	spin_unlock(&comp->strm_lock);
+}
+
+/*
+ * Changes the stream limit.  Surplus idle streams are freed now, busy
+ * ones when they are released.
+ */
+void zcomp_set_max_streams(struct zcomp *comp, int num_strm)
+{
+	struct zcomp_strm *zstrm;
+
+	spin_lock(&comp->strm_lock);
+	comp->max_strm = num_strm;
+	while (comp->avail_strm > num_strm && !list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				   struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		comp->avail_strm--;
+		spin_unlock(&comp->strm_lock);
+		zcomp_strm_free(comp, zstrm);
+		spin_lock(&comp->strm_lock);
+	}
+	spin_unlock(&comp->strm_lock);
+	if (comp->backend->prealloc_strm)
+		zcomp_strm_prealloc(comp);
+	/* Raising the limit lets waiters allocate a stream */
+	wake_up_all(&comp->strm_wait);
+}
+
+/*
+ * Readers only need a stream, and may have to wait for one, if the
+ * backend keeps decompression state in it.  Otherwise these return and
+ * take NULL.
+ */
+struct zcomp_strm *zcomp_decompress_begin(struct zcomp *comp)
+{
+	if (!comp->backend->decompress_needs_strm)
+		return NULL;
+	return zcomp_strm_find(comp);
+}
+
+void zcomp_decompress_end(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	if (zstrm)
+		zcomp_strm_release(comp, zstrm);
+}
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		   const unsigned char *src, size_t *dst_len)
+{
+	return comp->backend->compress(src, zstrm->buffer, dst_len,
+				       zstrm->private);
+}
+
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		     const unsigned char *src, size_t src_len,
+		     unsigned char *dst)
+{
+	return comp->backend->decompress(src, src_len, dst,
+					 zstrm ? zstrm->private : NULL);
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				   struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(comp, zstrm);
+	}
+	kfree(comp);
+}
+
+/*
+ * Creates a pool of up to max_strm streams for the named algorithm.
+ * One stream is allocated up front so writers always make progress,
+ * all of them for prealloc_strm backends.
+ */
+struct zcomp *zcomp_create(const char *compress, int max_strm)
+{
+	struct zcomp *comp;
+	struct zcomp_strm *zstrm;
+	struct zcomp_backend *backend;
+
+	backend = find_backend(compress);
+	if (!backend)
+		return NULL;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	comp->backend = backend;
+	strlcpy(comp->name, compress, sizeof(comp->name));
+
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	comp->max_strm = max_strm;
+
+	zstrm = zcomp_strm_alloc(comp);
+	if (!zstrm) {
+		kfree(comp);
+		return NULL;
+	}
+	list_add(&zstrm->list, &comp->idle_strm);
+	comp->avail_strm = 1;
+	if (backend->prealloc_strm)
+		zcomp_strm_prealloc(comp);
+	return comp;
+}
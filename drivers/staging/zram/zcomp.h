@@ -0,0 +1,100 @@
+/*
+ * zram compression streams
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/crypto.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+/*
+ * A compression algorithm.  private is per-stream state from create(),
+ * e.g. working memory.  Both directions work on exactly one page of
+ * uncompressed data; compress() may write up to two pages.
+ */
+struct zcomp_backend {
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			  unsigned char *dst, void *private);
+	void *(*create)(const char *name);
+	void (*destroy)(void *private);
+	const char *name;
+	/* decompress() uses private, so readers need a stream too */
+	bool decompress_needs_strm;
+	/*
+	 * create() allocates with GFP_KERNEL, so it must not be called from
+	 * the write path: all streams are allocated up front instead.
+	 */
+	bool prealloc_strm;
+};
+
+extern struct zcomp_backend zcomp_lzo;
+#ifdef CONFIG_ZRAM_LZ4_COMPRESS
+extern struct zcomp_backend zcomp_lz4;
+#endif
+#ifdef CONFIG_ZRAM_CRYPTO_COMPRESS
+extern struct zcomp_backend zcomp_crypto;
+#endif
+
+/*
+ * A compression stream: the compressor's working memory plus an output
+ * buffer.  A stream is owned by one writer from zcomp_strm_find() until
+ * zcomp_strm_release(), so several pages can be compressed in parallel.
+ */
+struct zcomp_strm {
+	/* compression output buffer, two pages in case data expands */
+	void *buffer;
+	/* backend state, e.g. compressor working memory */
+	void *private;
+	/* entry in zcomp->idle_strm */
+	struct list_head list;
+};
+
+/*
+ * Pool of compression streams.  Streams are allocated on demand up to
+ * max_strm, or up front for prealloc_strm backends; once that many are
+ * busy writers wait for one to be released.
+ */
+struct zcomp {
+	/* protects idle_strm and avail_strm */
+	spinlock_t strm_lock;
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	/* number of allocated streams, idle or busy */
+	int avail_strm;
+	int max_strm;
+	struct zcomp_backend *backend;
+	/* algorithm name, passed to backend->create() */
+	char name[CRYPTO_MAX_ALG_NAME];
+};
+
+ssize_t zcomp_available_show(const char *comp, char *buf);
+bool zcomp_available_algorithm(const char *comp);
+
+struct zcomp *zcomp_create(const char *compress, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+void zcomp_set_max_streams(struct zcomp *comp, int num_strm);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+struct zcomp_strm *zcomp_decompress_begin(struct zcomp *comp);
+void zcomp_decompress_end(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		   const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		     const unsigned char *src, size_t src_len,
+		     unsigned char *dst);
+
+#endif /* _ZCOMP_H_ */
@@ -0,0 +1,67 @@
+/*
+ * zram crypto API compression backend
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/crypto.h>
+#include <linux/err.h>
+
+#include "zcomp.h"
+
+/*
+ * Any crypto_comp algorithm, e.g. "deflate".  A transform carries
+ * state for both directions, so each stream owns one and readers take
+ * a stream as well.  The crypto API allocates transforms with
+ * GFP_KERNEL, so they are all allocated when the device is set up.
+ */
+static void *zcomp_crypto_create(const char *name)
+{
+	struct crypto_comp *tfm = crypto_alloc_comp(name, 0, 0);
+
+	return IS_ERR(tfm) ? NULL : tfm;
+}
+
+static void zcomp_crypto_destroy(void *private)
+{
+	crypto_free_comp(private);
+}
+
+static int zcomp_crypto_compress(const unsigned char *src, unsigned char *dst,
+		size_t *dst_len, void *private)
+{
+	/* The stream buffer is two pages */
+	unsigned int len = 2 * PAGE_SIZE;
+	int ret;
+
+	ret = crypto_comp_compress(private, src, PAGE_SIZE, dst, &len);
+	*dst_len = len;
+	return ret;
+}
+
+static int zcomp_crypto_decompress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, void *private)
+{
+	unsigned int len = PAGE_SIZE;
+	int ret;
+
+	ret = crypto_comp_decompress(private, src, src_len, dst, &len);
+	if (!ret && len != PAGE_SIZE)
+		ret = -EINVAL;
+	return ret;
+}
+
+struct zcomp_backend zcomp_crypto = {
+	.compress = zcomp_crypto_compress,
+	.decompress = zcomp_crypto_decompress,
+	.create = zcomp_crypto_create,
+	.destroy = zcomp_crypto_destroy,
+	.name = "crypto",
+	.decompress_needs_strm = true,
+	.prealloc_strm = true,
+};
@@ -26,10 +26,12 @@
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/cpumask.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
@@ -89,21 +91,180 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Checks if the page is a single machine word repeated, e.g. all zeros,
+ * and returns that word in *element.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	val = page[0];
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != val)
 			return 0;
 	}
 
+	*element = val;
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, unsigned int len, unsigned long value)
+{
+	unsigned int pos;
+	unsigned long *page;
+
+	if (likely(!value)) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	page = (unsigned long *)ptr;
+	for (pos = 0; pos != len / sizeof(*page); pos++)
+		page[pos] = value;
+}
+
+/*
+ * Content-hash deduplication.  Compressed objects are shared through a
+ * refcounted zram_dedup_entry, found by the checksum of the uncompressed
+ * page.  A checksum match is confirmed by decompressing the candidate,
+ * so collisions only cost time.
+ */
+static u32 zram_dedup_checksum(unsigned char *mem)
+{
+	return jhash2((u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static void zram_dedup_insert(struct zram *zram,
+			      struct zram_dedup_entry *new)
+{
+	struct rb_node **rb_node = &zram->dedup_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct zram_dedup_entry *entry;
+
+	while (*rb_node) {
+		parent = *rb_node;
+		entry = rb_entry(parent, struct zram_dedup_entry, rb_node);
+		if (new->checksum < entry->checksum)
+			rb_node = &parent->rb_left;
+		else
+			rb_node = &parent->rb_right;
+	}
+
+	rb_link_node(&new->rb_node, parent, rb_node);
+	rb_insert_color(&new->rb_node, &zram->dedup_tree);
+}
+
+static struct zram_dedup_entry *zram_dedup_lookup(struct zram *zram,
+						  u32 checksum)
+{
+	struct rb_node *rb_node = zram->dedup_tree.rb_node;
+	struct zram_dedup_entry *entry;
+
+	while (rb_node) {
+		entry = rb_entry(rb_node, struct zram_dedup_entry, rb_node);
+		if (checksum == entry->checksum)
+			return entry;
+		if (checksum < entry->checksum)
+			rb_node = rb_node->rb_left;
+		else
+			rb_node = rb_node->rb_right;
+	}
+
+	return NULL;
+}
+
+/* Drops a reference, freeing the object with the last one */
+static void zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry)
+{
+	spin_lock(&zram->dedup_lock);
+	if (--entry->refcount) {
+		zram->stats.pages_dup--;
+		zram->stats.dup_data_size -= entry->len;
+		spin_unlock(&zram->dedup_lock);
+		return;
+	}
+	rb_erase(&entry->rb_node, &zram->dedup_tree);
+	spin_unlock(&zram->dedup_lock);
+
+	zs_free(zram->mem_pool, entry->handle);
+	zram_stat64_sub(zram, &zram->stats.compr_size, entry->len);
+	kfree(entry);
+}
+
+/*
+ * Returns a referenced entry holding the same data as mem, or NULL.
+ * zstrm->buffer is used to decompress the candidate.
+ */
+static struct zram_dedup_entry *zram_dedup_find(struct zram *zram,
+		struct zcomp_strm *zstrm, unsigned char *mem, u32 checksum)
+{
+	struct zram_dedup_entry *entry;
+	unsigned char *cmem;
+	int ret;
+
+	spin_lock(&zram->dedup_lock);
+	entry = zram_dedup_lookup(zram, checksum);
+	if (!entry) {
+		spin_unlock(&zram->dedup_lock);
+		return NULL;
+	}
+	entry->refcount++;
+	zram->stats.pages_dup++;
+	zram->stats.dup_data_size += entry->len;
+	spin_unlock(&zram->dedup_lock);
+
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	ret = zcomp_decompress(zram->comp, zstrm,
+			       cmem + sizeof(struct zobj_header),
+			       entry->len, zstrm->buffer);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	if (!ret && !memcmp(mem, zstrm->buffer, PAGE_SIZE))
+		return entry;
+
+	zram_dedup_put(zram, entry);
+	return NULL;
+}
+
+static struct zram_dedup_entry *zram_dedup_new(struct zram *zram,
+		void *handle, u16 len, u32 checksum)
+{
+	struct zram_dedup_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->checksum = checksum;
+	entry->refcount = 1;
+	entry->handle = handle;
+	entry->len = len;
+
+	spin_lock(&zram->dedup_lock);
+	zram_dedup_insert(zram, entry);
+	spin_unlock(&zram->dedup_lock);
+	zram_stat64_add(zram, &zram->stats.compr_size, len);
+
+	return entry;
+}
+
+/* zsmalloc handle of a compressed page */
+static void *zram_get_handle(struct zram *zram, u32 index)
+{
+	struct zram_dedup_entry *entry;
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		entry = zram->table[index].handle;
+		return entry->handle;
+	}
+	return zram->table[index].handle;
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,22 +294,162 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Backing device blocks are page sized.  Block 0 is reserved, so a
+ * written back page's element is never 0.
+ */
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long blk_idx = 1;
+
+retry:
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_pages, blk_idx);
+	if (blk_idx >= zram->nr_pages)
+		return 0;
+
+	if (test_and_set_bit(blk_idx, zram->bitmap))
+		goto retry;
+
+	return blk_idx;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long blk_idx)
+{
+	clear_bit(blk_idx, zram->bitmap);
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Synchronous single page I/O on the backing device.  Must not be
+ * called from zram's own make_request, where the bio would only be
+ * submitted after we return; see zram_read_from_bdev().
+ */
+static int zram_bdev_rw_page(struct zram *zram, struct page *page,
+			     unsigned long blk_idx, int rw)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret = 0;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = blk_idx << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+	bio->bi_private = &done;
+	bio->bi_end_io = zram_bdev_end_io;
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		ret = -EIO;
+	bio_put(bio);
+
+	if (!ret)
+		zram_stat64_inc(zram, rw & WRITE ? &zram->stats.bd_writes :
+						   &zram->stats.bd_reads);
+	return ret;
+}
+
+struct zram_bdev_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk_idx;
+	int ret;
+};
+
+static void zram_bdev_read_work(struct work_struct *work)
+{
+	struct zram_bdev_work *zw = container_of(work,
+					struct zram_bdev_work, work);
+
+	zw->ret = zram_bdev_rw_page(zw->zram, zw->page, zw->blk_idx, READ);
+}
+
+/*
+ * Reads a written back page from the I/O path.  generic_make_request()
+ * defers bios submitted from a make_request function until it returns,
+ * so the read is issued and waited for from a worker instead.
+ */
+static int zram_read_from_bdev(struct zram *zram, struct page *page,
+			       unsigned long blk_idx)
+{
+	struct zram_bdev_work zw;
+
+	zw.zram = zram;
+	zw.page = page;
+	zw.blk_idx = blk_idx;
+
+	INIT_WORK_ONSTACK(&zw.work, zram_bdev_read_work);
+	queue_work(system_unbound_wq, &zw.work);
+	flush_work(&zw.work);
+	destroy_work_on_stack(&zw.work);
+
+	return zw.ret;
+}
+
+static void zram_mark_access(struct zram *zram, u32 index)
+{
+	zram_set_flag(zram, index, ZRAM_ACCESS);
+}
+#else
+static void zram_free_block(struct zram *zram, unsigned long blk_idx) {}
+
+static int zram_read_from_bdev(struct zram *zram, struct page *page,
+			       unsigned long blk_idx)
+{
+	return -EIO;
+}
+
+static void zram_mark_access(struct zram *zram, u32 index) {}
+#endif
+
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	void *handle = zram->table[index].handle;
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	/* Tells a writeback in progress that the page has changed */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_clear_flag(zram, index, ZRAM_ACCESS);
+	zram->table[index].age = 0;
+
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (!zram->table[index].element)
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].element = 0;
+		return;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_free_block(zram, zram->table[index].element);
+		zram_stat_dec(&zram->stats.pages_wb);
+		zram_stat_dec(&zram->stats.pages_stored);
+		zram->table[index].element = 0;
 		return;
 	}
 
+	if (unlikely(!handle))
+		return;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		__free_page(handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
@@ -156,27 +457,35 @@ static void zram_free_page(struct zram *zram, size_t index)
 		goto out;
 	}
 
-	zs_free(zram->mem_pool, handle);
-
 	if (zram->table[index].size <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
+	/* The entry accounts compr_size for all of its users */
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		zram_dedup_put(zram, handle);
+		goto out_shared;
+	}
+
+	zs_free(zram->mem_pool, handle);
+
 out:
 	zram_stat64_sub(zram, &zram->stats.compr_size,
 			zram->table[index].size);
+out_shared:
 	zram_stat_dec(&zram->stats.pages_stored);
 
 	zram->table[index].handle = NULL;
 	zram->table[index].size = 0;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem);
 
 	flush_dcache_page(page);
@@ -203,55 +512,122 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
+static int zram_bvec_read_bdev(struct zram *zram, struct bio_vec *bvec,
+			       unsigned long blk_idx, int offset)
+{
+	struct page *page;
+	unsigned char *user_mem, *mem;
+	int ret;
+
+	if (!is_partial_io(bvec)) {
+		ret = zram_read_from_bdev(zram, bvec->bv_page, blk_idx);
+		goto out;
+	}
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_read_from_bdev(zram, page, blk_idx);
+	if (!ret) {
+		user_mem = kmap_atomic(bvec->bv_page);
+		mem = kmap_atomic(page);
+		memcpy(user_mem + bvec->bv_offset, mem + offset,
+		       bvec->bv_len);
+		kunmap_atomic(mem);
+		kunmap_atomic(user_mem);
+	}
+	__free_page(page);
+
+out:
+	if (unlikely(ret)) {
+		pr_err("Backing device read failed! err=%d\n", ret);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return ret;
+	}
+
+	flush_dcache_page(bvec->bv_page);
+	return 0;
+}
+
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
 	int ret;
-	size_t clen;
 	struct page *page;
+	void *handle;
 	struct zobj_header *zheader;
+	struct zcomp_strm *zstrm;
 	unsigned char *user_mem, *cmem, *uncmem = NULL;
 
 	page = bvec->bv_page;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
+	if (is_partial_io(bvec)) {
+		/* Use  a temporary buffer to decompress the page */
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+		if (!uncmem) {
+			pr_info("Error allocating temp memory!\n");
+			return -ENOMEM;
+		}
+	}
+
+	/* May sleep, so the stream is taken before tb_lock */
+	zstrm = zcomp_decompress_begin(zram->comp);
+	read_lock(&zram->tb_lock);
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		unsigned long element = zram->table[index].element;
+
+		read_unlock(&zram->tb_lock);
+		zcomp_decompress_end(zram->comp, zstrm);
+		handle_same_page(bvec, element);
+		kfree(uncmem);
 		return 0;
 	}
 
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		unsigned long blk_idx = zram->table[index].element;
+
+		read_unlock(&zram->tb_lock);
+		zcomp_decompress_end(zram->comp, zstrm);
+		kfree(uncmem);
+		return zram_bvec_read_bdev(zram, bvec, blk_idx, offset);
+	}
+
 	/* Requested page is not present in compressed area */
 	if (unlikely(!zram->table[index].handle)) {
+		read_unlock(&zram->tb_lock);
+		zcomp_decompress_end(zram->comp, zstrm);
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
+		handle_same_page(bvec, 0);
+		kfree(uncmem);
 		return 0;
 	}
 
+	zram_mark_access(zram, index);
+
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		handle_uncompressed_page(zram, bvec, index, offset);
+		read_unlock(&zram->tb_lock);
+		zcomp_decompress_end(zram->comp, zstrm);
+		kfree(uncmem);
 		return 0;
 	}
 
-	if (is_partial_io(bvec)) {
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
-		if (!uncmem) {
-			pr_info("Error allocating temp memory!\n");
-			return -ENOMEM;
-		}
-	}
-
 	user_mem = kmap_atomic(page);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
+	handle = zram_get_handle(zram, index);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+
+	ret = zcomp_decompress(zram->comp, zstrm, cmem + sizeof(*zheader),
+			       zram->table[index].size, uncmem);
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    uncmem, &clen);
+	zs_unmap_object(zram->mem_pool, handle);
+	read_unlock(&zram->tb_lock);
+	zcomp_decompress_end(zram->comp, zstrm);
 
 	if (is_partial_io(bvec)) {
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
@@ -259,11 +635,10 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		kfree(uncmem);
 	}
 
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
 	kunmap_atomic(user_mem);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
@@ -277,32 +652,63 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 {
 	int ret;
-	size_t clen = PAGE_SIZE;
+	void *handle;
 	struct zobj_header *zheader;
+	struct zcomp_strm *zstrm;
 	unsigned char *cmem;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
+	zstrm = zcomp_decompress_begin(zram->comp);
+	read_lock(&zram->tb_lock);
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		unsigned long blk_idx = zram->table[index].element;
+		struct page *page;
+
+		read_unlock(&zram->tb_lock);
+		zcomp_decompress_end(zram->comp, zstrm);
+
+		page = alloc_page(GFP_NOIO);
+		if (!page)
+			return -ENOMEM;
+		ret = zram_read_from_bdev(zram, page, blk_idx);
+		if (!ret) {
+			cmem = kmap_atomic(page);
+			memcpy(mem, cmem, PAGE_SIZE);
+			kunmap_atomic(cmem);
+		}
+		__free_page(page);
+		return ret;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SAME) ||
 	    !zram->table[index].handle) {
-		memset(mem, 0, PAGE_SIZE);
+		unsigned long element = zram->table[index].element;
+
+		read_unlock(&zram->tb_lock);
+		zcomp_decompress_end(zram->comp, zstrm);
+		zram_fill_page(mem, PAGE_SIZE, element);
 		return 0;
 	}
 
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
-
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic(zram->table[index].handle);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem);
+		read_unlock(&zram->tb_lock);
+		zcomp_decompress_end(zram->comp, zstrm);
 		return 0;
 	}
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    mem, &clen);
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
+	handle = zram_get_handle(zram, index);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	ret = zcomp_decompress(zram->comp, zstrm, cmem + sizeof(*zheader),
+			       zram->table[index].size, mem);
+	zs_unmap_object(zram->mem_pool, handle);
+	read_unlock(&zram->tb_lock);
+	zcomp_decompress_end(zram->comp, zstrm);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
@@ -311,19 +717,320 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 	return 0;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Number of idle scans after which a page counts as idle */
+static u8 zram_idle_scans(struct zram *zram)
+{
+	unsigned int scans = DIV_ROUND_UP(zram->idle_age, ZRAM_IDLE_SCAN_SECS);
+
+	return clamp(scans, 1U, 255U);
+}
+
+/* Pages resident in memory that can be aged and written back */
+static bool zram_slot_in_memory(struct zram *zram, u32 index)
+{
+	return zram->table[index].handle &&
+		!zram_test_flag(zram, index, ZRAM_SAME) &&
+		!zram_test_flag(zram, index, ZRAM_WB);
+}
+
+/*
+ * Shared (dedup) objects stay in memory: writing one back would need
+ * every page referencing it to be rewritten at once.
+ */
+static bool zram_wb_candidate(struct zram *zram, u32 index, bool idle,
+			      u8 idle_scans)
+{
+	if (!zram_slot_in_memory(zram, index) ||
+	    zram_test_flag(zram, index, ZRAM_DEDUP) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return false;
+
+	if (idle)
+		return zram->table[index].age >= idle_scans;
+	return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+}
+
+/*
+ * Copies the page out and writes it to a free block.  The page is
+ * only replaced by the block if it was not rewritten or freed in the
+ * meantime, which clears ZRAM_UNDER_WB.
+ */
+static int zram_writeback_slot(struct zram *zram, u32 index,
+			       struct page *page)
+{
+	unsigned long blk_idx;
+	int ret;
+
+	blk_idx = zram_alloc_block(zram);
+	if (!blk_idx) {
+		write_lock(&zram->tb_lock);
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		write_unlock(&zram->tb_lock);
+		return -ENOSPC;
+	}
+
+	ret = zram_read_before_write(zram, page_address(page), index);
+	if (!ret)
+		ret = zram_bdev_rw_page(zram, page, blk_idx, WRITE);
+
+	write_lock(&zram->tb_lock);
+	if (!ret && zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+		zram_free_page(zram, index);
+		zram->table[index].element = blk_idx;
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_stat_inc(&zram->stats.pages_wb);
+		zram_stat_inc(&zram->stats.pages_stored);
+		blk_idx = 0;
+	} else {
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	}
+	write_unlock(&zram->tb_lock);
+
+	if (blk_idx)
+		zram_free_block(zram, blk_idx);
+	return ret;
+}
+
+/*
+ * Writes back incompressible pages, or idle ones if idle is set.
+ * Called with init_lock held for read on an initialized device with a
+ * backing device.
+ */
+static int __zram_writeback(struct zram *zram, bool idle)
+{
+	struct page *page;
+	size_t index, num_pages = zram->disksize >> PAGE_SHIFT;
+	u8 idle_scans = zram_idle_scans(zram);
+	bool candidate;
+	int ret = 0;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	for (index = 0; index < num_pages; index++) {
+		read_lock(&zram->tb_lock);
+		candidate = zram_wb_candidate(zram, index, idle, idle_scans);
+		read_unlock(&zram->tb_lock);
+		if (!candidate)
+			continue;
+
+		write_lock(&zram->tb_lock);
+		candidate = zram_wb_candidate(zram, index, idle, idle_scans);
+		if (candidate)
+			zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		write_unlock(&zram->tb_lock);
+		if (!candidate)
+			continue;
+
+		ret = zram_writeback_slot(zram, index, page);
+		/* Out of backing device blocks */
+		if (ret == -ENOSPC)
+			break;
+		cond_resched();
+	}
+
+	__free_page(page);
+	return ret;
+}
+
+int zram_writeback(struct zram *zram, bool idle)
+{
+	int ret = -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (zram->init_done && zram->bdev)
+		ret = __zram_writeback(zram, idle);
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+
+/*
+ * Gives up if init_lock is contended: the device is being reset, which
+ * cancels this work, or reconfigured, and the next run catches up.
+ */
+static void zram_wb_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, wb_work);
+
+	if (!down_read_trylock(&zram->init_lock))
+		return;
+	if (zram->init_done && zram->bdev) {
+		atomic_set(&zram->wb_pending, 0);
+		__zram_writeback(zram, false);
+	}
+	up_read(&zram->init_lock);
+}
+
+/*
+ * Ages every page in memory: pages accessed since the last scan are
+ * reset to age 0, others get one scan older.
+ */
+static void zram_age_pages(struct zram *zram)
+{
+	size_t index, num_pages = zram->disksize >> PAGE_SHIFT;
+	u8 idle_scans = zram_idle_scans(zram);
+	u32 pages_idle = 0;
+
+	write_lock(&zram->tb_lock);
+	for (index = 0; index < num_pages; index++) {
+		/* Let I/O in every now and then */
+		if (index && !(index % 1024)) {
+			write_unlock(&zram->tb_lock);
+			cond_resched();
+			write_lock(&zram->tb_lock);
+		}
+
+		if (!zram_slot_in_memory(zram, index))
+			continue;
+
+		if (zram_test_flag(zram, index, ZRAM_ACCESS)) {
+			zram_clear_flag(zram, index, ZRAM_ACCESS);
+			zram->table[index].age = 0;
+		} else if (zram->table[index].age < 255) {
+			zram->table[index].age++;
+		}
+		if (zram->table[index].age >= idle_scans)
+			pages_idle++;
+	}
+	zram->stats.pages_idle = pages_idle;
+	write_unlock(&zram->tb_lock);
+}
+
+static void zram_idle_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(to_delayed_work(work), struct zram,
+					 idle_work);
+
+	if (down_read_trylock(&zram->init_lock)) {
+		if (zram->init_done) {
+			zram_age_pages(zram);
+			/* Catch the pages short of a batch */
+			if (zram->bdev && atomic_xchg(&zram->wb_pending, 0))
+				__zram_writeback(zram, false);
+			if (zram->bdev && zram->idle_age)
+				__zram_writeback(zram, true);
+		}
+		up_read(&zram->init_lock);
+	}
+
+	queue_delayed_work(system_long_wq, &zram->idle_work,
+			   ZRAM_IDLE_SCAN_SECS * HZ);
+}
+
+/*
+ * Each pass scans the whole table, so only start one once a batch of
+ * incompressible pages has built up; the idle scan takes the rest.
+ */
+static void zram_wb_kick(struct zram *zram)
+{
+	if (zram->bdev &&
+	    atomic_inc_return(&zram->wb_pending) == ZRAM_WB_BATCH)
+		queue_work(system_long_wq, &zram->wb_work);
+}
+
+static void zram_reset_bdev(struct zram *zram)
+{
+	if (!zram->backing_dev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	vfree(zram->bitmap);
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+}
+
+/*
+ * Attaches a block device, e.g. a partition or a loop device backed by
+ * a file, to an uninitialized device.  Called with init_lock held for
+ * write.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *name)
+{
+	struct file *backing_dev;
+	struct block_device *bdev;
+	struct inode *inode;
+	unsigned long nr_pages, *bitmap;
+	int ret;
+
+	backing_dev = filp_open(name, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev))
+		return PTR_ERR(backing_dev);
+
+	inode = backing_dev->f_mapping->host;
+	if (!S_ISBLK(inode->i_mode)) {
+		ret = -ENOTBLK;
+		goto out_close;
+	}
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		ret = -EINVAL;
+		goto out_close;
+	}
+
+	bdev = bdgrab(I_BDEV(inode));
+	ret = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (ret < 0)
+		goto out_close;
+
+	ret = set_blocksize(bdev, PAGE_SIZE);
+	if (ret)
+		goto out_put;
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto out_put;
+	}
+	set_bit(0, bitmap);
+
+	zram_reset_bdev(zram);
+	zram->backing_dev = backing_dev;
+	zram->bdev = bdev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+	pr_info("setup backing device %s\n", name);
+	return 0;
+
+out_put:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+out_close:
+	filp_close(backing_dev, NULL);
+	return ret;
+}
+#else
+static void zram_wb_kick(struct zram *zram) {}
+static void zram_reset_bdev(struct zram *zram) {}
+#endif
+
+/*
+ * Compression runs on a stream of its own and without tb_lock, so
+ * writers on different CPUs only serialize on the short table update at
+ * the end.
+ */
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret;
-	u32 store_offset;
 	size_t clen;
 	void *handle;
+	u32 checksum = 0;
+	unsigned long element;
+	bool uncompressed = false;
+	bool use_dedup = ACCESS_ONCE(zram->use_dedup);
+	struct zram_dedup_entry *entry = NULL;
 	struct zobj_header *zheader;
+	struct zcomp_strm *zstrm = NULL;
 	struct page *page, *page_store;
-	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
+	unsigned char *user_mem = NULL, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -337,49 +1044,63 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
+		if (ret)
 			goto out;
-		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].handle ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
+	zstrm = zcomp_strm_find(zram->comp);
 	user_mem = kmap_atomic(page);
 
-	if (is_partial_io(bvec))
+	if (is_partial_io(bvec)) {
 		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
 		       bvec->bv_len);
-	else
+		kunmap_atomic(user_mem);
+		user_mem = NULL;
+	} else {
 		uncmem = user_mem;
+	}
 
-	if (page_zero_filled(uncmem)) {
-		kunmap_atomic(user_mem);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
+	if (page_same_filled(uncmem, &element)) {
+		if (user_mem)
+			kunmap_atomic(user_mem);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		write_lock(&zram->tb_lock);
+		zram_free_page(zram, index);
+		zram->table[index].element = element;
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram_stat_inc(&zram->stats.pages_same);
+		if (!element)
+			zram_stat_inc(&zram->stats.pages_zero);
+		write_unlock(&zram->tb_lock);
 		ret = 0;
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
+	if (use_dedup) {
+		checksum = zram_dedup_checksum(uncmem);
+		entry = zram_dedup_find(zram, zstrm, uncmem, checksum);
+		if (entry) {
+			if (user_mem)
+				kunmap_atomic(user_mem);
+			handle = entry;
+			clen = entry->len;
+			goto found_dup;
+		}
+	}
 
-	kunmap_atomic(user_mem);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
+	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (user_mem)
+		kunmap_atomic(user_mem);
+
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
+	src = zstrm->buffer;
 
 	/*
 	 * Page is incompressible. Store it as-is (uncompressed)
@@ -396,55 +1117,74 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
+		uncompressed = true;
 		handle = page_store;
-		src = kmap_atomic(page);
 		cmem = kmap_atomic(page_store);
-		goto memstore;
-	}
-
-	handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader));
-	if (!handle) {
-		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
-		ret = -ENOMEM;
-		goto out;
-	}
-	cmem = zs_map_object(zram->mem_pool, handle);
-
-memstore:
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
-#endif
-
-	memcpy(cmem, src, clen);
-
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		src = is_partial_io(bvec) ? uncmem : kmap_atomic(page);
+		memcpy(cmem, src, clen);
+		if (!is_partial_io(bvec))
+			kunmap_atomic(src);
 		kunmap_atomic(cmem);
-		kunmap_atomic(src);
 	} else {
+		handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader));
+		if (!handle) {
+			pr_info("Error allocating memory for compressed "
+				"page: %u, size=%zu\n", index, clen);
+			ret = -ENOMEM;
+			goto out;
+		}
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+		memcpy(cmem, src, clen);
 		zs_unmap_object(zram->mem_pool, handle);
+
+		if (use_dedup) {
+			entry = zram_dedup_new(zram, handle, clen, checksum);
+			if (!entry) {
+				zs_free(zram->mem_pool, handle);
+				ret = -ENOMEM;
+				goto out;
+			}
+			handle = entry;
+		}
 	}
 
+found_dup:
+	zcomp_strm_release(zram->comp, zstrm);
+	zstrm = NULL;
+
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	write_lock(&zram->tb_lock);
+	zram_free_page(zram, index);
+
 	zram->table[index].handle = handle;
 	zram->table[index].size = clen;
+	if (uncompressed) {
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_stat_inc(&zram->stats.pages_expand);
+	}
+	if (entry)
+		zram_set_flag(zram, index, ZRAM_DEDUP);
 
-	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
+	/* Update stats, shared objects are accounted by their entry */
+	if (!entry)
+		zram_stat64_add(zram, &zram->stats.compr_size, clen);
 	zram_stat_inc(&zram->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
+	write_unlock(&zram->tb_lock);
 
-	return 0;
+	/* Incompressible pages are better off on the backing device */
+	if (uncompressed)
+		zram_wb_kick(zram);
 
 out:
+	if (zstrm)
+		zcomp_strm_release(zram->comp, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
 	return ret;
@@ -455,15 +1195,10 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 {
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
+	if (rw == READ)
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
+	else
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
-	}
 
 	return ret;
 }
@@ -590,24 +1325,21 @@ void __zram_reset_device(struct zram *zram)
 
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	cancel_delayed_work_sync(&zram->idle_work);
+	cancel_work_sync(&zram->wb_work);
+#endif
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free various per-device buffers */
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
 	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		void *handle = zram->table[index].handle;
-		if (!handle)
-			continue;
-
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(handle);
-		else
-			zs_free(zram->mem_pool, handle);
-	}
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+		zram_free_page(zram, index);
+	zram->dedup_tree = RB_ROOT;
+	zram_reset_bdev(zram);
 
 	vfree(zram->table);
 	zram->table = NULL;
@@ -642,17 +1374,9 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	if (!zram->comp) {
+		pr_err("Error allocating compression streams\n");
 		ret = -ENOMEM;
 		goto fail_no_table;
 	}
@@ -678,6 +1402,10 @@ int zram_init_device(struct zram *zram)
 	}
 
 	zram->init_done = 1;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	queue_delayed_work(system_long_wq, &zram->idle_work,
+			   ZRAM_IDLE_SCAN_SECS * HZ);
+#endif
 	up_write(&zram->init_lock);
 
 	pr_debug("Initialization done!\n");
@@ -699,7 +1427,9 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	write_lock(&zram->tb_lock);
 	zram_free_page(zram, index);
+	write_unlock(&zram->tb_lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -712,9 +1442,18 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = -ENOMEM;
 
-	init_rwsem(&zram->lock);
+	rwlock_init(&zram->tb_lock);
 	init_rwsem(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->dedup_lock);
+	zram->dedup_tree = RB_ROOT;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	INIT_WORK(&zram->wb_work, zram_wb_work);
+	atomic_set(&zram->wb_pending, 0);
+	INIT_DELAYED_WORK(&zram->idle_work, zram_idle_work);
+#endif
+	zram->max_comp_streams = num_online_cpus();
+	strlcpy(zram->compressor, "lzo", sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -855,6 +1594,8 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		/* A backing device may be attached to an unused zram */
+		zram_reset_bdev(zram);
 		put_disk(zram->disk);
 	}
 
@@ -17,8 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/workqueue.h>
 
 #include "../zsmalloc/zsmalloc.h"
+#include "zcomp.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -51,10 +54,16 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE - sizeof(struct zobj_header)
  * otherwise, xv_malloc() would always return failure.
  */
 
+/* Seconds between idle scans, see zram->idle_age */
+#define ZRAM_IDLE_SCAN_SECS	60
+
+/* Incompressible pages stored before a writeback pass is kicked */
+#define ZRAM_WB_BATCH		256
+
 /*-- End of configurable params */
 
 #define SECTOR_SHIFT		9
@@ -71,8 +80,24 @@ enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is one repeated word, kept in table[page_no].element */
+	ZRAM_SAME,
+
+	/* handle points to a shared struct zram_dedup_entry */
+	ZRAM_DEDUP,
+
+	/* Page is on the backing device, element is the block index */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
+	/*
+	 * Page was read or written since the last idle scan.  Readers set
+	 * it under the read lock; all other flag updates take the write
+	 * lock, so concurrent readers only ever store the same value.
+	 */
+	ZRAM_ACCESS,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -81,12 +106,28 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	void *handle;
+	union {
+		void *handle;
+		unsigned long element;	/* ZRAM_SAME pages */
+	};
 	u16 size;	/* object size (excluding header) */
-	u8 count;	/* object ref count (not yet used) */
+	u8 age;		/* idle scans since last access */
 	u8 flags;
 } __attribute__((aligned(4)));
 
+/*
+ * A compressed object shared by all pages with the same content.
+ * Entries are kept in zram->dedup_tree, ordered by checksum of the
+ * uncompressed page.
+ */
+struct zram_dedup_entry {
+	struct rb_node rb_node;
+	u32 checksum;
+	u32 refcount;	/* table entries and lookups holding the object */
+	void *handle;	/* zsmalloc object */
+	u16 len;	/* object size (excluding header) */
+};
+
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
@@ -95,7 +136,14 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	u64 dup_data_size;	/* compressed bytes saved by dedup */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of same filled pages, incl. zero */
+	u32 pages_dup;		/* no. of extra references to dedup entries */
+	u32 pages_wb;		/* no. of pages on the backing device */
+	u32 pages_idle;		/* no. of idle pages found by the last scan */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
@@ -103,12 +151,10 @@ struct zram_stats {
 
 struct zram {
 	struct zs_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zcomp *comp;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+	rwlock_t tb_lock;	/* protect table entries and 32-bit stats */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -119,6 +165,29 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	int max_comp_streams;
+	/* compression algorithm, used by the next device init */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+	/* share identical compressed pages, may change at any time */
+	bool use_dedup;
+	/* protects dedup_tree, entry refcounts and the dup stats */
+	spinlock_t dedup_lock;
+	struct rb_root dedup_tree;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct file *backing_dev;
+	struct block_device *bdev;
+	/* allocated blocks on bdev; block 0 is never used */
+	unsigned long *bitmap;
+	unsigned long nr_pages;
+	/* write back pages not accessed for this many seconds, 0: never */
+	unsigned int idle_age;
+	/* writes back incompressible pages, kicked every ZRAM_WB_BATCH */
+	struct work_struct wb_work;
+	/* incompressible pages stored since the last pass */
+	atomic_t wb_pending;
+	/* ages pages and writes back idle ones */
+	struct delayed_work idle_work;
+#endif
 
 	struct zram_stats stats;
 };
@@ -131,5 +200,9 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void __zram_reset_device(struct zram *zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *name);
+extern int zram_writeback(struct zram *zram, bool idle);
+#endif
 
 #endif
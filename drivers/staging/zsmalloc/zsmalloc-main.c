@@ -17,13 +17,15 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
 #include <linux/string.h>
 #include <linux/slab.h>
-#include <asm/tlbflush.h>
-#include <asm/pgtable.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
 #include <linux/cpumask.h>
 #include <linux/cpu.h>
 #include <linux/vmalloc.h>
@@ -43,6 +45,9 @@
 /* per-cpu VM mapping areas for zspage accesses that cross page boundaries */
 static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
 
+/* Handle words of all pools */
+static struct kmem_cache *zs_handle_cache;
+
 static int is_first_page(struct page *page)
 {
 	return test_bit(PG_private, &page->flags);
@@ -230,30 +235,67 @@ static struct page *get_next_page(struct page *page)
 	return next;
 }
 
-/* Encode <page, obj_idx> as a single handle value */
-static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
+/* Encode <page, obj_idx> as a single object location value */
+static unsigned long location_to_obj(struct page *page, unsigned long obj_idx)
 {
-	unsigned long handle;
+	unsigned long obj;
 
 	if (!page) {
 		BUG_ON(obj_idx);
-		return NULL;
+		return 0;
 	}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= (obj_idx & OBJ_INDEX_MASK);
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= (obj_idx & OBJ_INDEX_MASK);
+	obj <<= OBJ_TAG_BITS;
 
-	return (void *)handle;
+	return obj;
 }
 
-/* Decode <page, obj_idx> pair from the given object handle */
-static void obj_handle_to_location(void *handle, struct page **page,
+/* Decode <page, obj_idx> pair from the given object location */
+static void obj_to_location(unsigned long obj, struct page **page,
 				unsigned long *obj_idx)
 {
-	unsigned long hval = (unsigned long)handle;
+	obj >>= OBJ_TAG_BITS;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = obj & OBJ_INDEX_MASK;
+}
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle & ~BIT(HANDLE_PIN_BIT);
+}
+
+/* Callers moving a pinned object pass obj with HANDLE_PIN_BIT set */
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	ACCESS_ONCE(*(unsigned long *)handle) = obj;
+}
+
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
 
-	*page = pfn_to_page(hval >> OBJ_INDEX_BITS);
-	*obj_idx = hval & OBJ_INDEX_MASK;
+static unsigned long alloc_handle(struct zs_pool *pool)
+{
+	return (unsigned long)kmem_cache_alloc(zs_handle_cache,
+			pool->flags & ~(__GFP_HIGHMEM | __GFP_MOVABLE));
+}
+
+static void free_handle(unsigned long handle)
+{
+	kmem_cache_free(zs_handle_cache, (void *)handle);
 }
 
 static unsigned long obj_idx_to_offset(struct page *page,
@@ -330,7 +372,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		for (i = 1; i <= objs_on_page; i++) {
 			off += class->size;
 			if (off < PAGE_SIZE) {
-				link->next = obj_location_to_handle(page, i);
+				link->next = location_to_obj(page, i);
 				link += class->size / sizeof(*link);
 			}
 		}
@@ -341,7 +383,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		 * page (if present)
 		 */
 		next_page = get_next_page(page);
-		link->next = obj_location_to_handle(next_page, 0);
+		link->next = location_to_obj(next_page, 0);
 		kunmap_atomic(link);
 		page = next_page;
 		off = (off + class->size) % PAGE_SIZE;
@@ -396,7 +438,7 @@ static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
 
 	init_zspage(first_page, class);
 
-	first_page->freelist = obj_location_to_handle(first_page, 0);
+	first_page->freelist = (void *)location_to_obj(first_page, 0);
 	/* Maximum number of objects we can store in this zspage */
 	first_page->objects = class->zspage_order * PAGE_SIZE / class->size;
 
@@ -425,28 +467,533 @@ static struct page *find_get_zspage(struct size_class *class)
 	return page;
 }
 
+/* Takes the first free object of a zspage and stores handle in it */
+static unsigned long obj_malloc(struct page *first_page,
+				struct size_class *class, unsigned long handle)
+{
+	struct link_free *link;
+	struct page *m_page;
+	unsigned long obj, m_objidx, m_offset;
+
+	obj = (unsigned long)first_page->freelist;
+	obj_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	link = (struct link_free *)kmap_atomic(m_page) +
+					m_offset / sizeof(*link);
+	first_page->freelist = (void *)link->next;
+	link->handle = handle | OBJ_ALLOCATED_TAG;
+	kunmap_atomic(link);
+
+	first_page->inuse++;
+
+	return obj;
+}
+
+/* Returns an object to its zspage's freelist */
+static void obj_free(struct size_class *class, unsigned long obj)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
+							+ f_offset);
+	link->next = (unsigned long)first_page->freelist;
+	kunmap_atomic(link);
+	first_page->freelist = (void *)obj;
+
+	first_page->inuse--;
+}
+
+/* Finds the next allocated object starting on page at or after *index */
+static unsigned long find_alloced_obj(struct page *page, int *index,
+				      struct size_class *class)
+{
+	unsigned long head, handle = 0;
+	unsigned long offset = 0;
+	void *addr;
+
+	if (!is_first_page(page))
+		offset = page->index;
+	offset += class->size * *index;
+
+	addr = kmap_atomic(page);
+	while (offset < PAGE_SIZE) {
+		head = *(unsigned long *)(addr + offset);
+		if (head & OBJ_ALLOCATED_TAG) {
+			handle = head & ~OBJ_ALLOCATED_TAG;
+			/* Mapped or being freed, leave it alone */
+			if (trypin_tag(handle))
+				break;
+			handle = 0;
+		}
+		offset += class->size;
+		(*index)++;
+	}
+	kunmap_atomic(addr);
+
+	return handle;
+}
+
+/* Copies an object, either of which may span two pages */
+static void zs_object_copy(unsigned long src, unsigned long dst,
+			   struct size_class *class)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_objidx, d_objidx;
+	unsigned long s_off, d_off;
+	void *s_addr, *d_addr;
+	int s_size, d_size, size;
+	int written = 0;
+
+	s_size = d_size = class->size;
+
+	obj_to_location(src, &s_page, &s_objidx);
+	obj_to_location(dst, &d_page, &d_objidx);
+
+	s_off = obj_idx_to_offset(s_page, s_objidx, class->size);
+	d_off = obj_idx_to_offset(d_page, d_objidx, class->size);
+
+	if (s_off + class->size > PAGE_SIZE)
+		s_size = PAGE_SIZE - s_off;
+
+	if (d_off + class->size > PAGE_SIZE)
+		d_size = PAGE_SIZE - d_off;
+
+	s_addr = kmap_atomic(s_page);
+	d_addr = kmap_atomic(d_page);
+
+	while (1) {
+		size = min(s_size, d_size);
+		memcpy(d_addr + d_off, s_addr + s_off, size);
+		written += size;
+
+		if (written == class->size)
+			break;
+
+		s_off += size;
+		s_size -= size;
+		d_off += size;
+		d_size -= size;
+
+		/* kmap_atomic() mappings must be released in reverse order */
+		if (s_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			kunmap_atomic(s_addr);
+			s_page = get_next_page(s_page);
+			BUG_ON(!s_page);
+			s_addr = kmap_atomic(s_page);
+			d_addr = kmap_atomic(d_page);
+			s_size = class->size - written;
+			s_off = 0;
+		}
+
+		if (d_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			d_page = get_next_page(d_page);
+			BUG_ON(!d_page);
+			d_addr = kmap_atomic(d_page);
+			d_size = class->size - written;
+			d_off = 0;
+		}
+	}
+
+	kunmap_atomic(d_addr);
+	kunmap_atomic(s_addr);
+}
+
+struct zs_compact_control {
+	/* Source sub-page and index of the next object to move */
+	struct page *s_page;
+	int index;
+	/* Destination zspage (first page) */
+	struct page *d_page;
+};
+
+/*
+ * Moves objects from the source to the destination zspage.  Returns 0
+ * once the source is scanned to the end, -ENOMEM if the destination
+ * filled up first.  Pinned objects are skipped.
+ */
+static int migrate_zspage(struct zs_pool *pool, struct size_class *class,
+			  struct zs_compact_control *cc)
+{
+	unsigned long used_obj, free_obj, handle;
+	struct page *s_page = cc->s_page;
+	struct page *d_page = cc->d_page;
+	int index = cc->index;
+	int ret = 0;
+
+	while (1) {
+		if (d_page->inuse == d_page->objects) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		handle = find_alloced_obj(s_page, &index, class);
+		if (!handle) {
+			s_page = get_next_page(s_page);
+			if (!s_page)
+				break;
+			index = 0;
+			continue;
+		}
+
+		used_obj = handle_to_obj(handle);
+		free_obj = obj_malloc(d_page, class, handle);
+		zs_object_copy(used_obj, free_obj, class);
+		index++;
+		/* Keep the handle pinned until it points at the copy */
+		record_obj(handle, free_obj | BIT(HANDLE_PIN_BIT));
+		unpin_tag(handle);
+		obj_free(class, used_obj);
+	}
+
+	cc->s_page = s_page;
+	cc->index = index;
+
+	return ret;
+}
+
+/*
+ * The zspages below are taken off their fullness lists while objects
+ * are moved and put back after, all under class->lock.
+ */
+static struct page *isolate_source_page(struct size_class *class)
+{
+	struct page *page = class->fullness_list[ZS_ALMOST_EMPTY];
+
+	if (page)
+		remove_zspage(page, class, ZS_ALMOST_EMPTY);
+
+	return page;
+}
+
+/* Prefers the fullest zspages as destination */
+static struct page *isolate_target_page(struct size_class *class)
+{
+	int i;
+	struct page *page;
+
+	for (i = 0; i < _ZS_NR_FULLNESS_GROUPS; i++) {
+		page = class->fullness_list[i];
+		if (page) {
+			remove_zspage(page, class, i);
+			return page;
+		}
+	}
+
+	return NULL;
+}
+
+static enum fullness_group putback_zspage(struct size_class *class,
+					  struct page *first_page)
+{
+	enum fullness_group fullness;
+
+	fullness = get_fullness_group(first_page);
+	insert_zspage(first_page, class, fullness);
+	set_zspage_mapping(first_page, class->index, fullness);
+
+	return fullness;
+}
+
+/* Number of zspages compaction could free in this class */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long objs_per_zspage, obj_wasted;
+
+	objs_per_zspage = class->zspage_order * PAGE_SIZE / class->size;
+	obj_wasted = (unsigned long)class->pages_allocated /
+			class->zspage_order * objs_per_zspage -
+			class->objs_inuse;
+
+	return obj_wasted / objs_per_zspage;
+}
+
+/* Compacts class until nr_to_free pages are freed or nothing is left */
+static unsigned long __zs_compact(struct zs_pool *pool,
+				  struct size_class *class,
+				  unsigned long nr_to_free)
+{
+	struct zs_compact_control cc;
+	struct page *src_page, *dst_page;
+	unsigned long pages_freed = 0;
+
+	spin_lock(&class->lock);
+	while (pages_freed < nr_to_free && zs_can_compact(class)) {
+		src_page = isolate_source_page(class);
+		if (!src_page)
+			break;
+
+		cc.s_page = src_page;
+		cc.index = 0;
+
+		while ((dst_page = isolate_target_page(class))) {
+			cc.d_page = dst_page;
+			if (!migrate_zspage(pool, class, &cc))
+				break;
+			putback_zspage(class, dst_page);
+		}
+
+		if (dst_page)
+			putback_zspage(class, dst_page);
+
+		if (putback_zspage(class, src_page) != ZS_EMPTY) {
+			/*
+			 * Out of destinations, or an object was pinned;
+			 * the next pass would pick the same source.
+			 */
+			break;
+		}
+
+		class->pages_allocated -= class->zspage_order;
+		spin_unlock(&class->lock);
+		free_zspage(src_page);
+		pages_freed += class->zspage_order;
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return pages_freed;
+}
+
+static unsigned long zs_compact_pages(struct zs_pool *pool,
+				      unsigned long nr_to_free)
+{
+	int i;
+	unsigned long pages_freed = 0;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0 && pages_freed < nr_to_free; i--)
+		pages_freed += __zs_compact(pool, &pool->size_class[i],
+					    nr_to_free - pages_freed);
+
+	atomic_long_add(pages_freed, &pool->pages_compacted);
+
+	return pages_freed;
+}
+
+/**
+ * zs_compact - move objects out of sparsely used zspages
+ * @pool: pool to compact
+ *
+ * Objects of ZS_ALMOST_EMPTY zspages are moved into the fullest
+ * zspages of their class, and the emptied zspages freed.  Handles
+ * stay valid; objects mapped at the time are skipped.
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	return zs_compact_pages(pool, ULONG_MAX);
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+unsigned long zs_get_pages_compacted(struct zs_pool *pool)
+{
+	return atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_get_pages_compacted);
+
+static unsigned long zs_compactable_pages(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages = 0;
+	struct size_class *class;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		class = &pool->size_class[i];
+		spin_lock(&class->lock);
+		pages += zs_can_compact(class) * class->zspage_order;
+		spin_unlock(&class->lock);
+	}
+
+	return pages;
+}
+
+/*
+ * zs_shrink - compacts the pool under memory pressure
+ *
+ * Reports the pages compaction could free; when asked to scan it
+ * compacts, largest classes first, until nr_to_scan pages are freed.
+ */
+static int zs_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(s, struct zs_pool, shrinker);
+
+	if (sc->nr_to_scan)
+		zs_compact_pages(pool, sc->nr_to_scan);
+
+	return min_t(unsigned long, zs_compactable_pages(pool), INT_MAX);
+}
+
+#ifdef USE_PGTABLE_MAPPING
+
+static inline int __zs_cpu_up(struct mapping_area *area)
+{
+	/*
+	 * Make sure we don't leak memory if a cpu UP notification
+	 * and zs_init() race and both call zs_cpu_up() on the same cpu
+	 */
+	if (area->vm)
+		return 0;
+	area->vm = get_vm_area(PAGE_SIZE * 2, 0);
+	if (!area->vm)
+		return -ENOMEM;
+	return 0;
+}
+
+static inline void __zs_cpu_down(struct mapping_area *area)
+{
+	if (area->vm)
+		free_vm_area(area->vm);
+	area->vm = NULL;
+}
+
+static inline void *__zs_map_object(struct mapping_area *area,
+				struct page *pages[2], int off, int size)
+{
+	struct page **pagep = pages;
+
+	/* We pre-allocated VM area so mapping can never fail */
+	BUG_ON(map_vm_area(area->vm, PAGE_KERNEL, &pagep));
+	area->vm_addr = area->vm->addr;
+	return area->vm_addr + off + ZS_HANDLE_SIZE;
+}
+
+static inline void __zs_unmap_object(struct mapping_area *area,
+				struct page *pages[2], int off, int size)
+{
+	unsigned long addr = (unsigned long)area->vm_addr;
+
+	unmap_kernel_range(addr, PAGE_SIZE * 2);
+}
+
+#else /* USE_PGTABLE_MAPPING */
+
+static inline int __zs_cpu_up(struct mapping_area *area)
+{
+	/*
+	 * Make sure we don't leak memory if a cpu UP notification
+	 * and zs_init() race and both call zs_cpu_up() on the same cpu
+	 */
+	if (area->vm_buf)
+		return 0;
+	area->vm_buf = (char *)__get_free_page(GFP_KERNEL);
+	if (!area->vm_buf)
+		return -ENOMEM;
+	return 0;
+}
+
+static inline void __zs_cpu_down(struct mapping_area *area)
+{
+	if (area->vm_buf)
+		free_page((unsigned long)area->vm_buf);
+	area->vm_buf = NULL;
+}
+
+/*
+ * Copies the object into the per-cpu buffer.  The handle header at the
+ * start of the object is never looked at through the mapping, so it is
+ * not copied.
+ */
+static void *__zs_map_object(struct mapping_area *area,
+			struct page *pages[2], int off, int size)
+{
+	int sizes[2];
+	void *addr;
+	char *buf = area->vm_buf;
+
+	/* disable page faults to match kmap_atomic() return conditions */
+	pagefault_disable();
+
+	/* no read fastpath */
+	if (area->vm_mm == ZS_MM_WO)
+		goto out;
+
+	off += ZS_HANDLE_SIZE;
+	size -= ZS_HANDLE_SIZE;
+	sizes[0] = PAGE_SIZE - off;
+	sizes[1] = size - sizes[0];
+
+	/* copy object to per-cpu buffer */
+	if (sizes[0] > 0) {
+		addr = kmap_atomic(pages[0]);
+		memcpy(buf, addr + off, sizes[0]);
+		kunmap_atomic(addr);
+		addr = kmap_atomic(pages[1]);
+		memcpy(buf + sizes[0], addr, sizes[1]);
+		kunmap_atomic(addr);
+	} else {
+		/* the header straddles the boundary, the data does not */
+		addr = kmap_atomic(pages[1]);
+		memcpy(buf, addr - sizes[0], size);
+		kunmap_atomic(addr);
+	}
+out:
+	return area->vm_buf;
+}
+
+static void __zs_unmap_object(struct mapping_area *area,
+			struct page *pages[2], int off, int size)
+{
+	int sizes[2];
+	void *addr;
+	char *buf = area->vm_buf;
+
+	/* no write fastpath */
+	if (area->vm_mm == ZS_MM_RO)
+		goto out;
+
+	off += ZS_HANDLE_SIZE;
+	size -= ZS_HANDLE_SIZE;
+	sizes[0] = PAGE_SIZE - off;
+	sizes[1] = size - sizes[0];
+
+	/* copy per-cpu buffer to object */
+	if (sizes[0] > 0) {
+		addr = kmap_atomic(pages[0]);
+		memcpy(addr + off, buf, sizes[0]);
+		kunmap_atomic(addr);
+		addr = kmap_atomic(pages[1]);
+		memcpy(addr, buf + sizes[0], sizes[1]);
+		kunmap_atomic(addr);
+	} else {
+		addr = kmap_atomic(pages[1]);
+		memcpy(addr - sizes[0], buf, size);
+		kunmap_atomic(addr);
+	}
+
+out:
+	/* enable page faults to match kunmap_atomic() return conditions */
+	pagefault_enable();
+}
+
+#endif /* USE_PGTABLE_MAPPING */
 
 static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 				void *pcpu)
 {
-	int cpu = (long)pcpu;
+	int ret, cpu = (long)pcpu;
 	struct mapping_area *area;
 
 	switch (action) {
 	case CPU_UP_PREPARE:
 		area = &per_cpu(zs_map_area, cpu);
-		if (area->vm)
-			break;
-		area->vm = alloc_vm_area(2 * PAGE_SIZE, area->vm_ptes);
-		if (!area->vm)
-			return notifier_from_errno(-ENOMEM);
+		ret = __zs_cpu_up(area);
+		if (ret)
+			return notifier_from_errno(ret);
 		break;
 	case CPU_DEAD:
 	case CPU_UP_CANCELED:
 		area = &per_cpu(zs_map_area, cpu);
-		if (area->vm)
-			free_vm_area(area->vm);
-		area->vm = NULL;
+		__zs_cpu_down(area);
 		break;
 	}
 
@@ -464,12 +1011,20 @@ static void zs_exit(void)
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
+
+	if (zs_handle_cache)
+		kmem_cache_destroy(zs_handle_cache);
 }
 
 static int zs_init(void)
 {
 	int cpu, ret;
 
+	zs_handle_cache = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					    0, 0, NULL);
+	if (!zs_handle_cache)
+		return -ENOMEM;
+
 	register_cpu_notifier(&zs_cpu_nb);
 	for_each_online_cpu(cpu) {
 		ret = zs_cpu_notifier(NULL, CPU_UP_PREPARE, (void *)(long)cpu);
@@ -514,6 +1069,16 @@ struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 	pool->flags = flags;
 	pool->name = name;
 
+	pool->map_stats = alloc_percpu(struct zs_map_stats);
+	if (!pool->map_stats) {
+		kfree(pool);
+		return NULL;
+	}
+
+	pool->shrinker.shrink = zs_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
 	return pool;
 }
 EXPORT_SYMBOL_GPL(zs_create_pool);
@@ -522,6 +1087,8 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	unregister_shrinker(&pool->shrinker);
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
 		struct size_class *class = &pool->size_class[i];
@@ -534,6 +1101,7 @@ void zs_destroy_pool(struct zs_pool *pool)
 			}
 		}
 	}
+	free_percpu(pool->map_stats);
 	kfree(pool);
 }
 EXPORT_SYMBOL_GPL(zs_destroy_pool);
@@ -542,28 +1110,30 @@ EXPORT_SYMBOL_GPL(zs_destroy_pool);
  * zs_malloc - Allocate block of given size from pool.
  * @pool: pool to allocate from
  * @size: size of block to allocate
- * @page: page no. that holds the object
- * @offset: location of object within page
  *
- * On success, <page, offset> identifies block allocated
- * and 0 is returned. On failure, <page, offset> is set to
- * 0 and -ENOMEM is returned.
+ * On success, handle to the allocated object is returned,
+ * otherwise NULL.  The handle stays valid when compaction moves the
+ * object.
  *
- * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * will fail.
  */
 void *zs_malloc(struct zs_pool *pool, size_t size)
 {
-	void *obj;
-	struct link_free *link;
+	unsigned long handle, obj;
 	int class_idx;
 	struct size_class *class;
+	struct page *first_page;
 
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return NULL;
 
-	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+	handle = alloc_handle(pool);
+	if (!handle)
 		return NULL;
 
+	/* extra space in chunk to keep the handle */
+	size += ZS_HANDLE_SIZE;
 	class_idx = get_size_class_index(size);
 	class = &pool->size_class[class_idx];
 	BUG_ON(class_idx != class->index);
@@ -574,128 +1144,150 @@ void *zs_malloc(struct zs_pool *pool, size_t size)
 	if (!first_page) {
 		spin_unlock(&class->lock);
 		first_page = alloc_zspage(class, pool->flags);
-		if (unlikely(!first_page))
+		if (unlikely(!first_page)) {
+			free_handle(handle);
 			return NULL;
+		}
 
 		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
 		spin_lock(&class->lock);
 		class->pages_allocated += class->zspage_order;
 	}
 
-	obj = first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
-
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
-
-	first_page->inuse++;
+	obj = obj_malloc(first_page, class, handle);
+	class->objs_inuse++;
 	/* Now move the zspage to another fullness group, if required */
 	fix_fullness_group(pool, first_page);
+	record_obj(handle, obj);
 	spin_unlock(&class->lock);
 
-	return obj;
+	return (void *)handle;
 }
 EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, void *obj)
+void zs_free(struct zs_pool *pool, void *obj_handle)
 {
-	struct link_free *link;
+	unsigned long handle = (unsigned long)obj_handle;
+	unsigned long obj, f_objidx;
 	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
 
 	int class_idx;
 	struct size_class *class;
 	enum fullness_group fullness;
 
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
-	obj_handle_to_location(obj, &f_page, &f_objidx);
+	/* Keeps compaction from moving the object under us */
+	pin_tag(handle);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &f_page, &f_objidx);
 	first_page = get_first_page(f_page);
 
 	get_zspage_mapping(first_page, &class_idx, &fullness);
 	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
 
 	spin_lock(&class->lock);
-
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = obj;
-
-	first_page->inuse--;
+	obj_free(class, obj);
+	class->objs_inuse--;
 	fullness = fix_fullness_group(pool, first_page);
 
 	if (fullness == ZS_EMPTY)
 		class->pages_allocated -= class->zspage_order;
 
 	spin_unlock(&class->lock);
+	unpin_tag(handle);
+	free_handle(handle);
 
 	if (fullness == ZS_EMPTY)
 		free_zspage(first_page);
 }
 EXPORT_SYMBOL_GPL(zs_free);
 
-void *zs_map_object(struct zs_pool *pool, void *handle)
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @obj_handle: handle returned from zs_malloc
+ * @mm: what the caller is going to do with the mapping
+ *
+ * Before using an object allocated from zs_malloc, it must be mapped
+ * using this function.  When done with the object, it must be unmapped
+ * using zs_unmap_object.
+ *
+ * Only one object can be mapped per cpu at a time.  There is no
+ * protection against nested mappings.
+ *
+ * This function returns with preemption and page faults disabled.
+ * With the copying scheme, only the part of the object the caller
+ * declared interest in through @mm is copied: nothing on map for
+ * ZS_MM_WO, nothing on unmap for ZS_MM_RO.
+ */
+void *zs_map_object(struct zs_pool *pool, void *obj_handle,
+			enum zs_mapmode mm)
 {
+	unsigned long handle = (unsigned long)obj_handle;
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
 	struct size_class *class;
 	struct mapping_area *area;
+	struct page *pages[2];
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	/*
+	 * Because we use per-cpu mapping areas shared among the
+	 * pools/users, we can't allow mapping in interrupt context
+	 * because it can corrupt another users mappings.
+	 */
+	BUG_ON(in_interrupt());
+
+	/* The object stays put until zs_unmap_object() */
+	pin_tag(handle);
+
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
 
 	area = &get_cpu_var(zs_map_area);
+	area->vm_mm = mm;
 	if (off + class->size <= PAGE_SIZE) {
 		/* this object is contained entirely within a page */
+		__this_cpu_inc(pool->map_stats->maps_single);
 		area->vm_addr = kmap_atomic(page);
-	} else {
-		/* this object spans two pages */
-		struct page *nextp;
-
-		nextp = get_next_page(page);
-		BUG_ON(!nextp);
-
-
-		set_pte(area->vm_ptes[0], mk_pte(page, PAGE_KERNEL));
-		set_pte(area->vm_ptes[1], mk_pte(nextp, PAGE_KERNEL));
-
-		/* We pre-allocated VM area so mapping can never fail */
-		area->vm_addr = area->vm->addr;
+		return area->vm_addr + off + ZS_HANDLE_SIZE;
 	}
 
-	return area->vm_addr + off;
+	/* this object spans two pages */
+	__this_cpu_inc(pool->map_stats->maps_spanning);
+	pages[0] = page;
+	pages[1] = get_next_page(page);
+	BUG_ON(!pages[1]);
+
+	return __zs_map_object(area, pages, off, class->size);
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
-void zs_unmap_object(struct zs_pool *pool, void *handle)
+void zs_unmap_object(struct zs_pool *pool, void *obj_handle)
 {
+	unsigned long handle = (unsigned long)obj_handle;
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
 	struct size_class *class;
 	struct mapping_area *area;
+	struct page *pages[2];
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -704,12 +1296,14 @@ void zs_unmap_object(struct zs_pool *pool, void *handle)
 	if (off + class->size <= PAGE_SIZE) {
 		kunmap_atomic(area->vm_addr);
 	} else {
-		set_pte(area->vm_ptes[0], __pte(0));
-		set_pte(area->vm_ptes[1], __pte(0));
-		__flush_tlb_one((unsigned long)area->vm_addr);
-		__flush_tlb_one((unsigned long)area->vm_addr + PAGE_SIZE);
+		pages[0] = page;
+		pages[1] = get_next_page(page);
+		BUG_ON(!pages[1]);
+
+		__zs_unmap_object(area, pages, off, class->size);
 	}
 	put_cpu_var(zs_map_area);
+	unpin_tag(handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
@@ -725,6 +1319,26 @@ u64 zs_get_total_size_bytes(struct zs_pool *pool)
 }
 EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
 
+/*
+ * Sums the per-cpu counts of objects mapped within a single page and
+ * of objects spanning two pages.
+ */
+void zs_get_map_stats(struct zs_pool *pool, u64 *maps_single,
+		      u64 *maps_spanning)
+{
+	int cpu;
+	struct zs_map_stats *stats;
+
+	*maps_single = 0;
+	*maps_spanning = 0;
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(pool->map_stats, cpu);
+		*maps_single += stats->maps_single;
+		*maps_spanning += stats->maps_spanning;
+	}
+}
+EXPORT_SYMBOL_GPL(zs_get_map_stats);
+
 module_init(zs_init);
 module_exit(zs_exit);
 
@@ -15,6 +15,17 @@
 
 #include <linux/types.h>
 
+/*
+ * zs_map_object() mapping modes.  Objects spanning two pages may be
+ * copied to a buffer on map and back on unmap; the mode tells which of
+ * the copies can be skipped.
+ */
+enum zs_mapmode {
+	ZS_MM_RW, /* normal read-write mapping */
+	ZS_MM_RO, /* read-only (no copy-out at unmap time) */
+	ZS_MM_WO /* write-only (no copy-in at map time) */
+};
+
 struct zs_pool;
 
 struct zs_pool *zs_create_pool(const char *name, gfp_t flags);
@@ -23,9 +34,14 @@ void zs_destroy_pool(struct zs_pool *pool);
 void *zs_malloc(struct zs_pool *pool, size_t size);
 void zs_free(struct zs_pool *pool, void *obj);
 
-void *zs_map_object(struct zs_pool *pool, void *handle);
+void *zs_map_object(struct zs_pool *pool, void *handle, enum zs_mapmode mm);
 void zs_unmap_object(struct zs_pool *pool, void *handle);
 
 u64 zs_get_total_size_bytes(struct zs_pool *pool);
 
+unsigned long zs_compact(struct zs_pool *pool);
+unsigned long zs_get_pages_compacted(struct zs_pool *pool);
+void zs_get_map_stats(struct zs_pool *pool, u64 *maps_single,
+		      u64 *maps_spanning);
+
 #endif
@@ -13,7 +13,9 @@
 #ifndef _ZS_MALLOC_INT_H_
 #define _ZS_MALLOC_INT_H_
 
+#include <linux/atomic.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
 
@@ -34,13 +36,18 @@
 
 /*
  * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (void *) handle value.
+ * as single unsigned long value, shifted left by OBJ_TAG_BITS.
  *
  * Note that object index <obj_idx> is relative to system
  * page <PFN> it is stored in, so for each sub-page belonging
  * to a zspage, obj_idx starts with 0.
  *
  * This is made more complicated by various memory models and PAE.
+ *
+ * Objects move when their zspage is compacted, so the handle given to
+ * users points to a word holding the current location instead of
+ * being the location itself.  Bit 0 of that word is a lock that pins
+ * the object in place while it is mapped or freed.
  */
 
 #ifndef MAX_PHYSMEM_BITS
@@ -55,9 +62,22 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_TAG_BITS	1
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
+/* Lock bit in the handle word */
+#define HANDLE_PIN_BIT	0
+
+/*
+ * The first word of an allocated object holds its handle, tagged with
+ * OBJ_ALLOCATED_TAG.  Free objects start with a link_free instead,
+ * whose location value never has the tag bit set.  This lets
+ * compaction find the live objects of a zspage and their handles.
+ */
+#define OBJ_ALLOCATED_TAG	1
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 /* ZS_MIN_ALLOC_SIZE must be multiple of ZS_ALIGN */
 #define ZS_MIN_ALLOC_SIZE \
@@ -109,10 +129,31 @@ enum fullness_group {
  */
 static const int fullness_threshold_frac = 4;
 
+/*
+ * Objects spanning two pages are either mapped through page table
+ * entries of a reserved VM area, or copied to and from a per-cpu
+ * buffer.  Which one is faster depends on the cost of TLB flushes:
+ * the page table mapping wins on ARM, copying on x86.  Changing page
+ * tables needs unmap_kernel_range(), which is not available to modules.
+ */
+#if defined(CONFIG_ZSMALLOC_PGTABLE_MAPPING) && !defined(MODULE)
+#define USE_PGTABLE_MAPPING
+#endif
+
 struct mapping_area {
-	struct vm_struct *vm;
-	pte_t *vm_ptes[2];
-	char *vm_addr;
+#ifdef USE_PGTABLE_MAPPING
+	struct vm_struct *vm;	/* vm area for objects spanning two pages */
+#else
+	char *vm_buf;		/* copy buffer for objects spanning two pages */
+#endif
+	char *vm_addr;		/* address of the kmap_atomic()'ed page */
+	enum zs_mapmode vm_mm;	/* mapping mode */
+};
+
+/* Per-cpu counts of zs_map_object() calls by object placement */
+struct zs_map_stats {
+	u64 maps_single;	/* object within one page, kmap_atomic() */
+	u64 maps_spanning;	/* object spans two pages */
 };
 
 struct size_class {
@@ -130,6 +171,8 @@ struct size_class {
 
 	/* stats */
 	u64 pages_allocated;
+	/* objects in use, for estimating what compaction would free */
+	unsigned long objs_inuse;
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
@@ -141,8 +184,12 @@ struct size_class {
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* Location of next free chunk (encodes <PFN, obj_idx>) */
+		unsigned long next;
+		/* Handle of an allocated object, see OBJ_ALLOCATED_TAG */
+		unsigned long handle;
+	};
 };
 
 struct zs_pool {
@@ -150,6 +197,13 @@ struct zs_pool {
 
 	gfp_t flags;	/* allocation flags used when growing pool */
 	const char *name;
+
+	/* Compacts the pool under memory pressure */
+	struct shrinker shrinker;
+	/* Pages freed by compaction so far */
+	atomic_long_t pages_compacted;
+
+	struct zs_map_stats __percpu *map_stats;
 };
 
 #endif
@@ -964,6 +964,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		lowmem_index_update(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -1061,6 +1063,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		lowmem_index_update(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
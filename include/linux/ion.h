@@ -369,4 +369,13 @@ struct ion_custom_data {
  */
 #define ION_IOC_CUSTOM		_IOWR(ION_IOC_MAGIC, 6, struct ion_custom_data)
 
+/**
+ * DOC: ION_IOC_DRAIN - release deferred frees now
+ *
+ * Heaps that defer freeing buffers to a background thread hold on to the
+ * memory of freed buffers for a while.  This frees all of it in the
+ * caller's context before returning.
+ */
+#define ION_IOC_DRAIN		_IO(ION_IOC_MAGIC, 8)
+
 #endif /* _LINUX_ION_H */
@@ -43,6 +43,34 @@ enum oom_constraint {
 extern void compare_swap_oom_score_adj(int old_val, int new_val);
 extern int test_set_oom_score_adj(int new_val);
 
+/*
+ * The Android low memory killer keeps thread group leaders indexed by
+ * oom_score_adj.  Callers must report every leader coming and going
+ * with tasklist_lock held for writing, and every oom_score_adj change
+ * once no task or sighand lock is held anymore.
+ */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_index_add(struct task_struct *p);
+extern void lowmem_index_del(struct task_struct *p);
+extern void lowmem_index_replace(struct task_struct *old,
+				 struct task_struct *new);
+extern void lowmem_index_update(struct task_struct *p);
+#else
+static inline void lowmem_index_add(struct task_struct *p)
+{
+}
+static inline void lowmem_index_del(struct task_struct *p)
+{
+}
+static inline void lowmem_index_replace(struct task_struct *old,
+					struct task_struct *new)
+{
+}
+static inline void lowmem_index_update(struct task_struct *p)
+{
+}
+#endif
+
 extern unsigned int oom_badness(struct task_struct *p, struct mem_cgroup *memcg,
 			const nodemask_t *nodemask, unsigned long totalpages);
 
@@ -990,6 +990,8 @@ struct sched_domain {
 	unsigned int smt_gain;
 	int flags;			/* See SD_* */
 	int level;
+	/* ns to refill a waking task's cache after moving across the domain */
+	unsigned int migration_cost;
 
 	/* Runtime fields. */
 	unsigned long last_balance;	/* init to jiffies. units in jiffies */
@@ -1211,6 +1213,21 @@ struct sched_statistics {
 };
 #endif
 
+#ifdef CONFIG_SMP
+/*
+ * Geometrically decayed history of the time an entity was runnable, in
+ * units of 1024ns: each 1024us period counts y times as much as the one
+ * after it, with y^32 = 1/2.  runnable_avg_period is the same sum for all
+ * of the time, so their ratio is the fraction the entity was runnable.
+ */
+struct sched_avg {
+	u32 runnable_avg_sum, runnable_avg_period;
+	u64 last_runnable_update;
+	/* runnable fraction times the entity's weight */
+	unsigned long load_avg_contrib;
+};
+#endif
+
 struct sched_entity {
 	struct load_weight	load;		/* for load-balancing */
 	struct rb_node		run_node;
@@ -1221,9 +1238,17 @@ struct sched_entity {
 	u64			sum_exec_runtime;
 	u64			vruntime;
 	u64			prev_sum_exec_runtime;
+	/* sum_exec_runtime at the last wakeup */
+	u64			wakeup_sum_exec_runtime;
+	/* cpu time used between the last wakeup and the sleep after it */
+	u64			last_wakeup_runtime;
 
 	u64			nr_migrations;
 
+#ifdef CONFIG_SMP
+	struct sched_avg	avg;
+#endif
+
 #ifdef CONFIG_SCHEDSTATS
 	struct sched_statistics statistics;
 #endif
@@ -1329,6 +1354,9 @@ struct task_struct {
 #endif
 
 	struct list_head tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct hlist_node lowmem_node;	/* lowmemorykiller oom_score_adj index */
+#endif
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
 #endif
@@ -2082,6 +2110,15 @@ extern unsigned int sysctl_sched_min_granularity;
 extern unsigned int sysctl_sched_wakeup_granularity;
 extern unsigned int sysctl_sched_child_runs_first;
 
+/* How select_idle_sibling() picks among the idle cpus sharing a cache */
+enum sched_wake_placement {
+	/* the first group whose cpus are all idle */
+	SCHED_WAKE_PLACEMENT_IDLE_GROUP,
+	/* for light tasks, the idle cpu cheapest to warm up, see fair.c */
+	SCHED_WAKE_PLACEMENT_WARM_IDLE,
+};
+extern unsigned int sysctl_sched_wake_placement;
+
 enum sched_tunable_scaling {
 	SCHED_TUNABLESCALING_NONE,
 	SCHED_TUNABLESCALING_LOG,
@@ -2090,12 +2127,33 @@ enum sched_tunable_scaling {
 };
 extern enum sched_tunable_scaling sysctl_sched_tunable_scaling;
 
+/*
+ * Load the fair class sees arriving on a cpu before a cpufreq governor's
+ * next sample would: a heavy task waking up there, or being pulled there
+ * by the load balancer. Listeners are called with the rq lock held and
+ * interrupts off, so they must not wake tasks or take the rq lock.
+ */
+enum sched_util_event {
+	SCHED_UTIL_WAKEUP = 1,
+	SCHED_UTIL_MIGRATE,
+};
+
+struct sched_util_hint {
+	int cpu;
+	/* where a migrated task came from, else same as cpu */
+	int src_cpu;
+};
+
+extern int sched_util_notifier_register(struct notifier_block *nb);
+extern int sched_util_notifier_unregister(struct notifier_block *nb);
+
 #ifdef CONFIG_SCHED_DEBUG
 extern unsigned int sysctl_sched_migration_cost;
 extern unsigned int sysctl_sched_nr_migrate;
 extern unsigned int sysctl_sched_time_avg;
 extern unsigned int sysctl_timer_migration;
 extern unsigned int sysctl_sched_shares_window;
+extern unsigned int sysctl_sched_heavy_task;
 
 int sched_proc_update_handler(struct ctl_table *table, int write,
 		void __user *buffer, size_t *length,
@@ -23,6 +23,7 @@
 #include <linux/spinlock.h>
 #include <linux/wait.h>
 
+struct kmem_cache;
 struct sync_timeline;
 struct sync_pt;
 struct sync_fence;
@@ -126,6 +127,7 @@ struct sync_timeline {
  * @status:		1: signaled, 0:active, <0: error
  * @timestamp:		time which sync_pt status transitioned from active to
  *			  singaled or error.
+ * @cache:		slab cache the sync_pt was allocated from, if any
  */
 struct sync_pt {
 	struct sync_timeline		*parent;
@@ -141,6 +143,8 @@ struct sync_pt {
 	int			status;
 
 	ktime_t			timestamp;
+
+	struct kmem_cache	*cache;
 };
 
 /**
@@ -153,6 +157,8 @@ struct sync_pt {
  * @waiter_list_head:	list of asynchronous waiters on this fence
  * @waiter_list_lock:	lock protecting @waiter_list_head and @status
  * @status:		1: signaled, 0:active, <0: error
+ * @pending:		number of sync_pts that have not signaled yet
+ * @signal_time:	time at which @status became non-zero
  *
  * @wq:			wait queue for fence signaling
  * @sync_fence_list:	membership in global fence list
@@ -168,6 +174,8 @@ struct sync_fence {
 	struct list_head	waiter_list_head;
 	spinlock_t		waiter_list_lock; /* also protects status */
 	int			status;
+	atomic_t		pending;
+	ktime_t			signal_time;
 
 	wait_queue_head_t	wq;
 
@@ -196,6 +204,54 @@ static inline void sync_fence_waiter_init(struct sync_fence_waiter *waiter,
 	waiter->callback = callback;
 }
 
+struct sync_fence_multi;
+typedef void (*sync_multi_callback_t)(struct sync_fence_multi *multi);
+
+/**
+ * struct sync_fence_multi_entry - one fence of a multi-fence wait
+ * @waiter:		async waiter registered on @fence
+ * @fence:		the fence, NULL if no wait was registered on it
+ * @multi:		back pointer to the multi-fence wait
+ * @index:		position of @fence in the array passed at creation
+ */
+struct sync_fence_multi_entry {
+	struct sync_fence_waiter	waiter;
+	struct sync_fence		*fence;
+	struct sync_fence_multi		*multi;
+	int				index;
+};
+
+/**
+ * struct sync_fence_multi - asynchronous wait on several fences
+ * @kref:		one reference for the creator and one per registered
+ *			  waiter still able to run
+ * @flags:		SYNC_WAIT_ALL to wait for all fences, else any of them
+ * @pending:		fences still to signal before a wait-all completes
+ * @fired:		set once by whoever completes the wait
+ * @done:		non-zero once @status and @index are valid
+ * @status:		1: signaled, <0: error of the fence that completed it
+ * @index:		index of the fence that completed the wait
+ * @callback:		optional function called when the wait completes
+ * @data:		for use by @callback
+ * @wq:			woken when the wait completes
+ * @count:		number of entries
+ * @entries:		one per fence
+ */
+struct sync_fence_multi {
+	struct kref			kref;
+	unsigned int			flags;
+	atomic_t			pending;
+	atomic_t			fired;
+	int				done;
+	int				status;
+	int				index;
+	sync_multi_callback_t		callback;
+	void				*data;
+	wait_queue_head_t		wq;
+	int				count;
+	struct sync_fence_multi_entry	entries[0];
+};
+
 /*
  * API for sync_timeline implementers
  */
@@ -342,6 +398,51 @@ int sync_fence_cancel_async(struct sync_fence *fence,
  */
 int sync_fence_wait(struct sync_fence *fence, long timeout);
 
+/**
+ * sync_fence_multi_wait_async() - registers an async wait on several fences
+ * @fences:		array of fences to wait on
+ * @count:		number of fences
+ * @flags:		SYNC_WAIT_ALL to wait for every fence, 0 for any one
+ * @callback:		called once when the wait completes, may be NULL
+ * @data:		stored in the returned struct for @callback
+ *
+ * Returns the wait or an ERR_PTR.  A wait-any completes when the first
+ * fence signals or errors, a wait-all when every fence has signaled or
+ * any has an error.  @callback runs in the context that signaled the
+ * completing fence, which may be this call itself if a fence has already
+ * signaled, and must not sleep.  The caller keeps its references to
+ * @fences and must call sync_fence_multi_release() when done, whether or
+ * not the wait completed.
+ */
+struct sync_fence_multi *sync_fence_multi_wait_async(struct sync_fence **fences,
+						     int count,
+						     unsigned int flags,
+						     sync_multi_callback_t callback,
+						     void *data);
+
+/**
+ * sync_fence_multi_release() - cancels and releases a multi-fence wait
+ * @multi:		wait returned by sync_fence_multi_wait_async()
+ *
+ * Cancels the waits still registered on the fences.  @callback will not
+ * be called after this returns unless it has already started.
+ */
+void sync_fence_multi_release(struct sync_fence_multi *multi);
+
+/**
+ * sync_fence_wait_multiple() - wait on several fences
+ * @fences:		array of fences to wait on
+ * @count:		number of fences
+ * @flags:		SYNC_WAIT_ALL to wait for every fence, 0 for any one
+ * @timeout:		timeout in ms, waits indefinitely if < 0
+ * @index:		if not NULL, returns the fence that completed the wait
+ *
+ * Returns 0 when the wait completed, the fence's error if it completed
+ * with one, -ETIME on timeout.
+ */
+int sync_fence_wait_multiple(struct sync_fence **fences, int count,
+			     unsigned int flags, long timeout, int *index);
+
 #endif /* __KERNEL__ */
 
 /**
@@ -392,6 +493,25 @@ struct sync_fence_info_data {
 	__u8	pt_info[0];
 };
 
+/**
+ * struct sync_wait_multi_data - data passed to the multi-fence wait ioctl
+ * @fds:	pointer to an array of __s32 fence file descriptors
+ * @count:	number of fds, at most SYNC_WAIT_MULTI_MAX
+ * @flags:	SYNC_WAIT_ALL to wait for all fences, 0 for any of them
+ * @timeout:	timeout in milliseconds, waits indefinitely if < 0
+ * @index:	returns the index in @fds of the fence that completed the wait
+ */
+struct sync_wait_multi_data {
+	__u64	fds;
+	__u32	count;
+	__u32	flags;
+	__s32	timeout;
+	__s32	index;
+};
+
+#define SYNC_WAIT_ALL		(1 << 0)
+#define SYNC_WAIT_MULTI_MAX	64
+
 #define SYNC_IOC_MAGIC		'>'
 
 /**
@@ -424,4 +544,16 @@ struct sync_fence_info_data {
 #define SYNC_IOC_FENCE_INFO	_IOWR(SYNC_IOC_MAGIC, 2,\
 	struct sync_fence_info_data)
 
+/**
+ * DOC: SYNC_IOC_WAIT_MULTI - wait for any or all of several fences
+ *
+ * Takes a struct sync_wait_multi_data and may be issued on any fence fd;
+ * only the fences listed in fds are waited on.  Returns 0 once any (or,
+ * with SYNC_WAIT_ALL, every) fence has signaled, the error of a fence that
+ * failed, or -ETIME on timeout.  index reports which fence completed the
+ * wait.  Unlike SYNC_IOC_MERGE this allocates no new fence.
+ */
+#define SYNC_IOC_WAIT_MULTI	_IOWR(SYNC_IOC_MAGIC, 3,\
+	struct sync_wait_multi_data)
+
 #endif /* _LINUX_SYNC_H */
@@ -76,6 +76,30 @@ DEFINE_EVENT(loadeval, cpufreq_interactive_notyet,
 	    TP_ARGS(cpu_id, load, curfreq, targfreq)
 );
 
+TRACE_EVENT(cpufreq_interactive_hint,
+	    TP_PROTO(unsigned long cpu_id, const char *reason,
+		     unsigned long load, unsigned long hintload),
+	    TP_ARGS(cpu_id, reason, load, hintload),
+
+	    TP_STRUCT__entry(
+		    __field(unsigned long, cpu_id    )
+		    __string(reason, reason)
+		    __field(unsigned long, load      )
+		    __field(unsigned long, hintload  )
+	    ),
+
+	    TP_fast_assign(
+		    __entry->cpu_id = cpu_id;
+		    __assign_str(reason, reason);
+		    __entry->load = load;
+		    __entry->hintload = hintload;
+	    ),
+
+	    TP_printk("cpu=%lu reason=%s load=%lu hintload=%lu",
+		      __entry->cpu_id, __get_str(reason), __entry->load,
+		      __entry->hintload)
+);
+
 TRACE_EVENT(cpufreq_interactive_boost,
 	    TP_PROTO(const char *s),
 	    TP_ARGS(s),
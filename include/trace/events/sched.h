@@ -426,6 +426,70 @@ TRACE_EVENT(sched_pi_setprio,
 			__entry->oldprio, __entry->newprio)
 );
 
+#ifdef CONFIG_SMP
+/*
+ * Tracepoint for a task's decayed load average, updated each time a
+ * period boundary passes while it is runnable:
+ */
+TRACE_EVENT(sched_load_avg_task,
+
+	TP_PROTO(struct task_struct *tsk, struct sched_avg *avg),
+
+	TP_ARGS(tsk, avg),
+
+	TP_STRUCT__entry(
+		__array( char,	comm,	TASK_COMM_LEN		)
+		__field( pid_t,	pid				)
+		__field( int,	cpu				)
+		__field( u32,	runnable_avg_sum		)
+		__field( u32,	runnable_avg_period		)
+		__field( unsigned long,	load_avg_contrib	)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->comm, tsk->comm, TASK_COMM_LEN);
+		__entry->pid			= tsk->pid;
+		__entry->cpu			= task_cpu(tsk);
+		__entry->runnable_avg_sum	= avg->runnable_avg_sum;
+		__entry->runnable_avg_period	= avg->runnable_avg_period;
+		__entry->load_avg_contrib	= avg->load_avg_contrib;
+	),
+
+	TP_printk("comm=%s pid=%d cpu=%d runnable_avg_sum=%u "
+		  "runnable_avg_period=%u load_avg_contrib=%lu",
+			__entry->comm, __entry->pid, __entry->cpu,
+			__entry->runnable_avg_sum,
+			__entry->runnable_avg_period,
+			__entry->load_avg_contrib)
+);
+
+/*
+ * Tracepoint for the decayed load of a cpu, next to its instantaneous
+ * weight, once per tick:
+ */
+TRACE_EVENT(sched_load_avg_cpu,
+
+	TP_PROTO(int cpu, unsigned long load_avg, unsigned long load),
+
+	TP_ARGS(cpu, load_avg, load),
+
+	TP_STRUCT__entry(
+		__field( int,		cpu		)
+		__field( unsigned long,	load_avg	)
+		__field( unsigned long,	load		)
+	),
+
+	TP_fast_assign(
+		__entry->cpu		= cpu;
+		__entry->load_avg	= load_avg;
+		__entry->load		= load;
+	),
+
+	TP_printk("cpu=%d load_avg=%lu load=%lu",
+			__entry->cpu, __entry->load_avg, __entry->load)
+);
+#endif /* CONFIG_SMP */
+
 #endif /* _TRACE_SCHED_H */
 
 /* This part must be outside protection */
@@ -52,6 +52,27 @@ TRACE_EVENT(sync_wait,
 		      __get_str(name), __entry->status)
 );
 
+TRACE_EVENT(sync_wake,
+	    TP_PROTO(struct sync_fence *fence, s64 latency_ns),
+
+	    TP_ARGS(fence, latency_ns),
+
+	    TP_STRUCT__entry(
+		    __string(name, fence->name)
+		    __field(s32, status)
+		    __field(s64, latency_ns)
+		    ),
+
+	    TP_fast_assign(
+		    __assign_str(name, fence->name);
+		    __entry->status = fence->status;
+		    __entry->latency_ns = latency_ns;
+		    ),
+
+	    TP_printk("name=%s state=%d latency=%lldns", __get_str(name),
+		      __entry->status, __entry->latency_ns)
+);
+
 TRACE_EVENT(sync_pt,
 	    TP_PROTO(struct sync_pt *pt),
 
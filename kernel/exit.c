@@ -182,6 +182,9 @@ repeat:
 	write_lock_irq(&tasklist_lock);
 	ptrace_release_task(p);
 	__exit_signal(p);
+	/* after __exit_signal(), so outside siglock */
+	if (thread_group_leader(p))
+		lowmem_index_del(p);
 
 	/*
 	 * If we are the last non-leader member of the thread
@@ -325,6 +325,10 @@ static struct task_struct *dup_task_struct(struct task_struct *orig)
 	tsk->btrace_seq = 0;
 #endif
 	tsk->splice_pipe = NULL;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* Not in the lowmem index until copy_process() adds it */
+	INIT_HLIST_NODE(&tsk->lowmem_node);
+#endif
 
 	account_kernel_stack(ti, 1);
 
@@ -1514,6 +1518,9 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 
 	total_forks++;
 	spin_unlock(&current->sighand->siglock);
+	/* lowmem_index_lock must not nest inside siglock */
+	if (likely(p->pid) && thread_group_leader(p))
+		lowmem_index_add(p);
 	syscall_tracepoint_update(p);
 	write_unlock_irq(&tasklist_lock);
 
@@ -72,6 +72,7 @@
 #include <linux/slab.h>
 #include <linux/init_task.h>
 #include <linux/binfmts.h>
+#include <linux/uid_cputime.h>
 
 #include <asm/switch_to.h>
 #include <asm/tlb.h>
@@ -1712,10 +1713,23 @@ static void __sched_fork(struct task_struct *p)
 	p->se.exec_start		= 0;
 	p->se.sum_exec_runtime		= 0;
 	p->se.prev_sum_exec_runtime	= 0;
+	p->se.wakeup_sum_exec_runtime	= 0;
+	p->se.last_wakeup_runtime	= 0;
 	p->se.nr_migrations		= 0;
 	p->se.vruntime			= 0;
 	INIT_LIST_HEAD(&p->se.group_node);
 
+#ifdef CONFIG_SMP
+	/*
+	 * Count a new task as runnable for the one period it starts with, so
+	 * it is not weightless to the load balancer until it has run a while.
+	 */
+	p->se.avg.runnable_avg_sum	= 1024;
+	p->se.avg.runnable_avg_period	= 1024;
+	p->se.avg.last_runnable_update	= 0;
+	p->se.avg.load_avg_contrib	= 0;
+#endif
+
 #ifdef CONFIG_SCHEDSTATS
 	memset(&p->se.statistics, 0, sizeof(p->se.statistics));
 #endif
@@ -2640,6 +2654,19 @@ decay_load_missed(unsigned long load, unsigned long missed_updates, int idx)
 	return load;
 }
 
+/* The load rq->cpu_load[] follows: decayed where it is tracked */
+#ifdef CONFIG_SMP
+static inline unsigned long get_rq_runnable_load(struct rq *rq)
+{
+	return rq->cfs.runnable_load_avg;
+}
+#else
+static inline unsigned long get_rq_runnable_load(struct rq *rq)
+{
+	return rq->load.weight;
+}
+#endif
+
 /*
  * Update rq->cpu_load[] statistics. This function is usually called every
  * scheduler tick (TICK_NSEC). With tickless idle this will not be called
@@ -2697,7 +2724,7 @@ static void __update_cpu_load(struct rq *this_rq, unsigned long this_load,
 void update_idle_cpu_load(struct rq *this_rq)
 {
 	unsigned long curr_jiffies = ACCESS_ONCE(jiffies);
-	unsigned long load = this_rq->load.weight;
+	unsigned long load = get_rq_runnable_load(this_rq);
 	unsigned long pending_updates;
 
 	/*
@@ -2746,8 +2773,14 @@ static void update_cpu_load_active(struct rq *this_rq)
 	/*
 	 * See the mess around update_idle_cpu_load() / update_cpu_load_nohz().
 	 */
+	unsigned long load = get_rq_runnable_load(this_rq);
+
 	this_rq->last_load_update_tick = jiffies;
-	__update_cpu_load(this_rq, this_rq->load.weight, 1);
+	__update_cpu_load(this_rq, load, 1);
+#ifdef CONFIG_SMP
+	trace_sched_load_avg_cpu(cpu_of(this_rq), load,
+				 this_rq->load.weight);
+#endif
 
 	calc_load_account_active(this_rq);
 }
@@ -2890,6 +2923,7 @@ void account_user_time(struct task_struct *p, cputime_t cputime,
 	p->utime += cputime;
 	p->utimescaled += cputime_scaled;
 	account_group_user_time(p, cputime);
+	uid_cputime_account(p, cputime, true);
 
 	index = (TASK_NICE(p) > 0) ? CPUTIME_NICE : CPUTIME_USER;
 
@@ -2915,6 +2949,7 @@ static void account_guest_time(struct task_struct *p, cputime_t cputime,
 	p->utime += cputime;
 	p->utimescaled += cputime_scaled;
 	account_group_user_time(p, cputime);
+	uid_cputime_account(p, cputime, true);
 	p->gtime += cputime;
 
 	/* Add guest time to cpustat. */
@@ -2942,6 +2977,7 @@ void __account_system_time(struct task_struct *p, cputime_t cputime,
 	p->stime += cputime;
 	p->stimescaled += cputime_scaled;
 	account_group_system_time(p, cputime);
+	uid_cputime_account(p, cputime, false);
 
 	/* Add system time to cpustat. */
 	task_group_account_field(p, index, (__force u64) cputime);
@@ -5471,6 +5507,11 @@ static void sd_free_ctl_entry(struct ctl_table **tablep)
 
 static int min_load_idx = 0;
 static int max_load_idx = CPU_LOAD_IDX_MAX-1;
+static int min_migration_cost = 0;
+
+static int proc_sd_migration_cost(struct ctl_table *table, int write,
+				  void __user *buffer, size_t *lenp,
+				  loff_t *ppos);
 
 static void
 set_table_entry(struct ctl_table *entry,
@@ -5493,7 +5534,7 @@ set_table_entry(struct ctl_table *entry,
 static struct ctl_table *
 sd_alloc_ctl_domain_table(struct sched_domain *sd)
 {
-	struct ctl_table *table = sd_alloc_ctl_entry(13);
+	struct ctl_table *table = sd_alloc_ctl_entry(14);
 
 	if (table == NULL)
 		return NULL;
@@ -5523,7 +5564,10 @@ sd_alloc_ctl_domain_table(struct sched_domain *sd)
 		sizeof(int), 0644, proc_dointvec_minmax, false);
 	set_table_entry(&table[11], "name", sd->name,
 		CORENAME_MAX_SIZE, 0444, proc_dostring, false);
-	/* &table[12] is terminator */
+	set_table_entry(&table[12], "migration_cost", &sd->migration_cost,
+		sizeof(int), 0644, proc_sd_migration_cost, false);
+	table[12].extra1 = &min_migration_cost;
+	/* &table[13] is terminator */
 
 	return table;
 }
@@ -6261,6 +6305,12 @@ struct sched_domain_topology_level {
 	sched_domain_mask_f mask;
 	int		    flags;
 	struct sd_data      data;
+	/* see sd_migration_cost() */
+	unsigned int	    migration_cost;
+	bool		    migration_cost_valid;
+	/* written through sysctl, overrides the measured cost */
+	unsigned int	    migration_cost_user;
+	bool		    migration_cost_set;
 };
 
 static int
@@ -6667,6 +6717,144 @@ static void __sdt_free(const struct cpumask *cpu_map)
 	}
 }
 
+/*
+ * What a task that moves across a domain pays in cache misses is measured
+ * rather than guessed from the topology: the time one cpu takes to read a
+ * working set last written by a cpu on the other side of the domain, less
+ * the time it takes to read it again once it is local.
+ */
+#define SD_MIGRATION_FOOTPRINT	(64 * 1024)
+#define SD_MIGRATION_TRIES	3
+
+struct sd_migration_probe {
+	unsigned long *buf;
+	unsigned long sum;
+	u64 ns;
+};
+
+static void sd_migration_probe_write(void *info)
+{
+	struct sd_migration_probe *probe = info;
+
+	memset(probe->buf, 0x5a, SD_MIGRATION_FOOTPRINT);
+}
+
+static void sd_migration_probe_read(void *info)
+{
+	struct sd_migration_probe *probe = info;
+	unsigned long *p = probe->buf;
+	unsigned long *end = p + SD_MIGRATION_FOOTPRINT / sizeof(*p);
+	unsigned long sum = 0;
+	u64 start;
+
+	start = sched_clock();
+	for (; p < end; p += L1_CACHE_BYTES / sizeof(*p))
+		sum += *p;
+	probe->ns = sched_clock() - start;
+	/* keep the loads */
+	probe->sum += sum;
+}
+
+static int measure_migration_cost(int src, int dst, unsigned int *cost)
+{
+	struct sd_migration_probe probe = { };
+	u64 cold, best = ULLONG_MAX;
+	int i;
+
+	probe.buf = kmalloc(SD_MIGRATION_FOOTPRINT, GFP_KERNEL);
+	if (!probe.buf)
+		return -ENOMEM;
+
+	/* The least disturbed of a few tries */
+	for (i = 0; i < SD_MIGRATION_TRIES; i++) {
+		smp_call_function_single(src, sd_migration_probe_write,
+					 &probe, 1);
+		smp_call_function_single(dst, sd_migration_probe_read,
+					 &probe, 1);
+		cold = probe.ns;
+		smp_call_function_single(dst, sd_migration_probe_read,
+					 &probe, 1);
+		best = min(best, cold > probe.ns ? cold - probe.ns : 0);
+	}
+
+	kfree(probe.buf);
+	*cost = min_t(u64, best, UINT_MAX);
+	return 0;
+}
+
+/*
+ * Each topology level is measured once, between cpu and a cpu that sd
+ * spans but its child doesn't, the first time there is such a pair: at
+ * boot, or when a cpu that completes the level comes up.  Tune it in
+ * /proc/sys/kernel/sched_domain/cpu<N>/domain<M>/migration_cost; the
+ * value written applies to the whole level and outlives rebuilds of the
+ * domains, e.g. on cpu hotplug.
+ */
+static unsigned int sd_migration_cost(struct sched_domain_topology_level *tl,
+				      struct sched_domain *sd,
+				      struct sched_domain *child, int cpu)
+{
+	struct cpumask *other = sched_domains_tmpmask;
+	int dst;
+
+	if (tl->migration_cost_set)
+		return tl->migration_cost_user;
+	if (tl->migration_cost_valid)
+		return tl->migration_cost;
+
+	cpumask_andnot(other, sched_domain_span(sd),
+		       child ? sched_domain_span(child) : cpumask_of(cpu));
+	dst = cpumask_any(other);
+	if (dst >= nr_cpu_ids)
+		return 0;
+
+	if (measure_migration_cost(cpu, dst, &tl->migration_cost))
+		return 0;
+	tl->migration_cost_valid = true;
+	printk(KERN_INFO "sched: domain level %d migration cost %u ns "
+	       "(cpu%d -> cpu%d)\n", sd->level, tl->migration_cost, cpu, dst);
+
+	return tl->migration_cost;
+}
+
+#if defined(CONFIG_SCHED_DEBUG) && defined(CONFIG_SYSCTL)
+/*
+ * The domains are rebuilt with the level's cost, so keep what was
+ * written there and apply it to the level's other domains right away.
+ */
+static int proc_sd_migration_cost(struct ctl_table *table, int write,
+				  void __user *buffer, size_t *lenp,
+				  loff_t *ppos)
+{
+	struct sched_domain *sd = container_of(table->data,
+					       struct sched_domain,
+					       migration_cost);
+	struct sched_domain_topology_level *tl;
+	struct sched_domain *sibling;
+	int ret, cpu;
+
+	ret = proc_dointvec_minmax(table, write, buffer, lenp, ppos);
+	if (ret || !write)
+		return ret;
+
+	tl = container_of(sd->private, struct sched_domain_topology_level,
+			  data);
+	tl->migration_cost_user = sd->migration_cost;
+	tl->migration_cost_set = true;
+
+	rcu_read_lock();
+	for_each_online_cpu(cpu) {
+		for_each_domain(cpu, sibling) {
+			if (sibling->private == sd->private)
+				sibling->migration_cost = sd->migration_cost;
+		}
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+#endif
+
 struct sched_domain *build_sched_domain(struct sched_domain_topology_level *tl,
 		struct s_data *d, const struct cpumask *cpu_map,
 		struct sched_domain_attr *attr, struct sched_domain *child,
@@ -6684,6 +6872,7 @@ struct sched_domain *build_sched_domain(struct sched_domain_topology_level *tl,
 	}
 	sd->child = child;
 	set_domain_attribute(sd, attr);
+	sd->migration_cost = sd_migration_cost(tl, sd, child, cpu);
 
 	return sd;
 }
@@ -26,6 +26,7 @@
 #include <linux/slab.h>
 #include <linux/profile.h>
 #include <linux/interrupt.h>
+#include <linux/export.h>
 
 #include <trace/events/sched.h>
 
@@ -76,6 +77,14 @@ static unsigned int sched_nr_latency = 8;
  */
 unsigned int sysctl_sched_child_runs_first __read_mostly;
 
+/*
+ * How a wakeup picks among the idle cpus sharing a cache with its target,
+ * see select_idle_sibling().
+ * (default: SCHED_WAKE_PLACEMENT_IDLE_GROUP)
+ */
+unsigned int __read_mostly sysctl_sched_wake_placement =
+	SCHED_WAKE_PLACEMENT_IDLE_GROUP;
+
 /*
  * SCHED_OTHER wake-up granularity.
  * (default: 1 msec * (1 + ilog(ncpus)), units: nanoseconds)
@@ -96,6 +105,39 @@ const_debug unsigned int sysctl_sched_migration_cost = 500000UL;
  */
 unsigned int __read_mostly sysctl_sched_shares_window = 10000000UL;
 
+/*
+ * A task that ran at least this long between waking up and sleeping again
+ * is heavy: its wakeups and migrations are announced to the sched_util
+ * listeners, so cpufreq can ramp before it next samples the load.
+ * (default: 10 msec, units: nanoseconds)
+ */
+unsigned int __read_mostly sysctl_sched_heavy_task = 10000000UL;
+
+static ATOMIC_NOTIFIER_HEAD(sched_util_notifier_head);
+
+int sched_util_notifier_register(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_register(&sched_util_notifier_head, nb);
+}
+EXPORT_SYMBOL_GPL(sched_util_notifier_register);
+
+int sched_util_notifier_unregister(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_unregister(&sched_util_notifier_head, nb);
+}
+EXPORT_SYMBOL_GPL(sched_util_notifier_unregister);
+
+static void sched_util_notify(enum sched_util_event event, int cpu,
+			      int src_cpu)
+{
+	struct sched_util_hint hint = {
+		.cpu = cpu,
+		.src_cpu = src_cpu,
+	};
+
+	atomic_notifier_call_chain(&sched_util_notifier_head, event, &hint);
+}
+
 #ifdef CONFIG_CFS_BANDWIDTH
 /*
  * Amount of runtime to allocate from global (tg) to local (per-cfs_rq) pool
@@ -971,6 +1013,238 @@ static inline void update_entity_shares_tick(struct cfs_rq *cfs_rq)
 }
 #endif /* CONFIG_FAIR_GROUP_SCHED */
 
+#ifdef CONFIG_SMP
+/*
+ * Per-entity load tracking: how runnable an entity has been, decayed so
+ * that the last 32ms weigh as much as all of the time before them.
+ * Note: the tables below depend on LOAD_AVG_PERIOD.
+ */
+#define LOAD_AVG_PERIOD 32
+#define LOAD_AVG_MAX 47742 /* maximum possible load avg */
+#define LOAD_AVG_MAX_N 345 /* number of full periods to produce LOAD_AVG_MAX */
+
+/* Precomputed fixed inverse multiplies for multiplication by y^n */
+static const u32 runnable_avg_yN_inv[] = {
+	0xffffffff, 0xfa83b2da, 0xf5257d14, 0xefe4b99a, 0xeac0c6e6, 0xe5b906e6,
+	0xe0ccdeeb, 0xdbfbb796, 0xd744fcc9, 0xd2a81d91, 0xce248c14, 0xc9b9bd85,
+	0xc5672a10, 0xc12c4cc9, 0xbd08a39e, 0xb8fbaf46, 0xb504f333, 0xb123f581,
+	0xad583ee9, 0xa9a15ab4, 0xa5fed6a9, 0xa2704302, 0x9ef5325f, 0x9b8d39b9,
+	0x9837f050, 0x94f4efa8, 0x91c3d373, 0x8ea4398a, 0x8b95c1e3, 0x88980e80,
+	0x85aac367, 0x82cd8698,
+};
+
+/*
+ * Precomputed \Sum y^k { 1<=k<=n }, floored so that combining them never
+ * over-estimates.
+ */
+static const u32 runnable_avg_yN_sum[] = {
+	    0, 1002, 1982, 2941, 3880, 4798, 5697, 6576, 7437, 8279, 9103,
+	 9909,10698,11470,12226,12966,13690,14398,15091,15769,16433,17082,
+	17718,18340,18949,19545,20128,20698,21256,21802,22336,22859,23371,
+};
+
+/*
+ * Approximate val * y^n in constant time: y^PERIOD = 1/2, so
+ * y^n = 1/2^(n/PERIOD) * y^(n%PERIOD), the latter from the table.
+ */
+static __always_inline u64 decay_load(u64 val, u64 n)
+{
+	unsigned int local_n;
+
+	if (!n)
+		return val;
+	else if (unlikely(n > LOAD_AVG_PERIOD * 63))
+		return 0;
+
+	/* after bounds checking we can collapse to 32-bit */
+	local_n = n;
+
+	if (unlikely(local_n >= LOAD_AVG_PERIOD)) {
+		val >>= local_n / LOAD_AVG_PERIOD;
+		local_n %= LOAD_AVG_PERIOD;
+	}
+
+	val *= runnable_avg_yN_inv[local_n];
+	/* always round down */
+	return val >> 32;
+}
+
+/*
+ * \Sum 1024*y^k { 1<=k<=n }: what n full runnable periods add after
+ * decaying, built from the precomputed sums half a table at a time.
+ */
+static u32 __compute_runnable_contrib(u64 n)
+{
+	u32 contrib = 0;
+
+	if (likely(n <= LOAD_AVG_PERIOD))
+		return runnable_avg_yN_sum[n];
+	else if (unlikely(n >= LOAD_AVG_MAX_N))
+		return LOAD_AVG_MAX;
+
+	do {
+		contrib /= 2; /* y^LOAD_AVG_PERIOD = 1/2 */
+		contrib += runnable_avg_yN_sum[LOAD_AVG_PERIOD];
+
+		n -= LOAD_AVG_PERIOD;
+	} while (n > LOAD_AVG_PERIOD);
+
+	contrib = decay_load(contrib, n);
+	return contrib + runnable_avg_yN_sum[n];
+}
+
+/*
+ * Account the time since the last update as runnable or not, and decay
+ * the history once per 1024us period crossed:
+ *
+ *   sum = u_0 + u_1*y + u_2*y^2 + ...
+ *
+ * where u_i is how much of the i-th most recent period the entity was
+ * runnable.  Returns whether a period boundary was crossed.
+ */
+static __always_inline int __update_entity_runnable_avg(u64 now,
+							struct sched_avg *sa,
+							int runnable)
+{
+	u64 delta, periods;
+	u32 runnable_contrib;
+	int delta_w, decayed = 0;
+
+	delta = now - sa->last_runnable_update;
+	/* Clocks of different cpus can be behind each other */
+	if ((s64)delta < 0) {
+		sa->last_runnable_update = now;
+		return 0;
+	}
+
+	/* 1024ns is close enough to 1us and cheap to compute */
+	delta >>= 10;
+	if (!delta)
+		return 0;
+	sa->last_runnable_update = now;
+
+	/* delta_w is what was already accumulated against the current period */
+	delta_w = sa->runnable_avg_period % 1024;
+	if (delta + delta_w >= 1024) {
+		decayed = 1;
+
+		/* Complete the current period first */
+		delta_w = 1024 - delta_w;
+		if (runnable)
+			sa->runnable_avg_sum += delta_w;
+		sa->runnable_avg_period += delta_w;
+
+		delta -= delta_w;
+
+		/* Then the full periods this update spans */
+		periods = delta / 1024;
+		delta %= 1024;
+
+		sa->runnable_avg_sum = decay_load(sa->runnable_avg_sum,
+						  periods + 1);
+		sa->runnable_avg_period = decay_load(sa->runnable_avg_period,
+						     periods + 1);
+
+		runnable_contrib = __compute_runnable_contrib(periods);
+		if (runnable)
+			sa->runnable_avg_sum += runnable_contrib;
+		sa->runnable_avg_period += runnable_contrib;
+	}
+
+	/* And the remainder against the new current period */
+	if (runnable)
+		sa->runnable_avg_sum += delta;
+	sa->runnable_avg_period += delta;
+
+	return decayed;
+}
+
+/* Recompute se's contribution to its cfs_rq; returns how much it changed */
+static long __update_entity_load_avg_contrib(struct sched_entity *se)
+{
+	long old_contrib = se->avg.load_avg_contrib;
+	u64 contrib;
+
+	contrib = (u64)se->avg.runnable_avg_sum *
+		  scale_load_down(se->load.weight);
+	contrib = div_u64(contrib, se->avg.runnable_avg_period + 1);
+	se->avg.load_avg_contrib = scale_load(contrib);
+
+	return se->avg.load_avg_contrib - old_contrib;
+}
+
+/*
+ * rq->clock rather than clock_task: averages are carried from one cpu to
+ * another, and the clock_task of different cpus drift apart by the irq
+ * time each of them has seen.
+ */
+static inline u64 cfs_rq_load_avg_clock(struct cfs_rq *cfs_rq)
+{
+	return rq_of(cfs_rq)->clock;
+}
+
+/*
+ * Bring se's average up to now, and its cfs_rq's sum with it while se is
+ * queued there.
+ */
+static void update_entity_load_avg(struct sched_entity *se)
+{
+	struct cfs_rq *cfs_rq = cfs_rq_of(se);
+	u64 now = cfs_rq_load_avg_clock(cfs_rq);
+	long contrib_delta;
+
+	if (!__update_entity_runnable_avg(now, &se->avg, se->on_rq))
+		return;
+
+	contrib_delta = __update_entity_load_avg_contrib(se);
+	if (se->on_rq)
+		cfs_rq->runnable_load_avg += contrib_delta;
+
+	if (entity_is_task(se))
+		trace_sched_load_avg_task(task_of(se), &se->avg);
+}
+
+static void enqueue_entity_load_avg(struct cfs_rq *cfs_rq,
+				    struct sched_entity *se, int wakeup)
+{
+	u64 now = cfs_rq_load_avg_clock(cfs_rq);
+
+	if (unlikely(!se->avg.last_runnable_update)) {
+		/* Never queued before: start tracking from here */
+		se->avg.last_runnable_update = now;
+		__update_entity_load_avg_contrib(se);
+	} else if (wakeup) {
+		/* Decay what it had before it slept */
+		if (__update_entity_runnable_avg(now, &se->avg, 0))
+			__update_entity_load_avg_contrib(se);
+	}
+
+	cfs_rq->runnable_load_avg += se->avg.load_avg_contrib;
+}
+
+static void dequeue_entity_load_avg(struct cfs_rq *cfs_rq,
+				    struct sched_entity *se)
+{
+	update_entity_load_avg(se);
+	cfs_rq->runnable_load_avg -= min(cfs_rq->runnable_load_avg,
+					 se->avg.load_avg_contrib);
+}
+#else
+static inline void update_entity_load_avg(struct sched_entity *se)
+{
+}
+
+static inline void enqueue_entity_load_avg(struct cfs_rq *cfs_rq,
+					   struct sched_entity *se, int wakeup)
+{
+}
+
+static inline void dequeue_entity_load_avg(struct cfs_rq *cfs_rq,
+					   struct sched_entity *se)
+{
+}
+#endif /* CONFIG_SMP */
+
 static void enqueue_sleeper(struct cfs_rq *cfs_rq, struct sched_entity *se)
 {
 #ifdef CONFIG_SCHEDSTATS
@@ -1097,6 +1371,7 @@ enqueue_entity(struct cfs_rq *cfs_rq, struct sched_entity *se, int flags)
 	 */
 	update_curr(cfs_rq);
 	update_cfs_load(cfs_rq, 0);
+	enqueue_entity_load_avg(cfs_rq, se, flags & ENQUEUE_WAKEUP);
 	account_entity_enqueue(cfs_rq, se);
 	update_cfs_shares(cfs_rq);
 
@@ -1190,6 +1465,7 @@ dequeue_entity(struct cfs_rq *cfs_rq, struct sched_entity *se, int flags)
 
 	if (se != cfs_rq->curr)
 		__dequeue_entity(cfs_rq, se);
+	dequeue_entity_load_avg(cfs_rq, se);
 	se->on_rq = 0;
 	update_cfs_load(cfs_rq, 0);
 	account_entity_dequeue(cfs_rq, se);
@@ -1340,6 +1616,7 @@ static void put_prev_entity(struct cfs_rq *cfs_rq, struct sched_entity *prev)
 		update_stats_wait_start(cfs_rq, prev);
 		/* Put 'current' back into the tree. */
 		__enqueue_entity(cfs_rq, prev);
+		update_entity_load_avg(prev);
 	}
 	cfs_rq->curr = NULL;
 }
@@ -1356,6 +1633,7 @@ entity_tick(struct cfs_rq *cfs_rq, struct sched_entity *curr, int queued)
 	 * Update share accounting for long-running entities.
 	 */
 	update_entity_shares_tick(cfs_rq);
+	update_entity_load_avg(curr);
 
 #ifdef CONFIG_SCHED_HRTICK
 	/*
@@ -2200,6 +2478,13 @@ enqueue_task_fair(struct rq *rq, struct task_struct *p, int flags)
 	struct cfs_rq *cfs_rq;
 	struct sched_entity *se = &p->se;
 
+	if (flags & ENQUEUE_WAKEUP) {
+		if (se->last_wakeup_runtime >= sysctl_sched_heavy_task)
+			sched_util_notify(SCHED_UTIL_WAKEUP, cpu_of(rq),
+					  cpu_of(rq));
+		se->wakeup_sum_exec_runtime = se->sum_exec_runtime;
+	}
+
 	for_each_sched_entity(se) {
 		if (se->on_rq)
 			break;
@@ -2248,6 +2533,10 @@ static void dequeue_task_fair(struct rq *rq, struct task_struct *p, int flags)
 	struct sched_entity *se = &p->se;
 	int task_sleep = flags & DEQUEUE_SLEEP;
 
+	if (task_sleep)
+		se->last_wakeup_runtime = se->sum_exec_runtime -
+					  se->wakeup_sum_exec_runtime;
+
 	for_each_sched_entity(se) {
 		cfs_rq = cfs_rq_of(se);
 		dequeue_entity(cfs_rq, se, flags);
@@ -2295,10 +2584,14 @@ static void dequeue_task_fair(struct rq *rq, struct task_struct *p, int flags)
 }
 
 #ifdef CONFIG_SMP
-/* Used instead of source_load when we know the type == 0 */
+/*
+ * Used instead of source_load when we know the type == 0.  The decayed
+ * load rather than the queued weight, so a cpu that just picked up a task
+ * that mostly sleeps doesn't look as busy as one running a hog.
+ */
 static unsigned long weighted_cpuload(const int cpu)
 {
-	return cpu_rq(cpu)->load.weight;
+	return cpu_rq(cpu)->cfs.runnable_load_avg;
 }
 
 /*
@@ -2345,7 +2638,7 @@ static unsigned long cpu_avg_load_per_task(int cpu)
 	unsigned long nr_running = ACCESS_ONCE(rq->nr_running);
 
 	if (nr_running)
-		return rq->load.weight / nr_running;
+		return rq->cfs.runnable_load_avg / nr_running;
 
 	return 0;
 }
@@ -2510,14 +2803,14 @@ static int wake_affine(struct sched_domain *sd, struct task_struct *p, int sync)
 	 */
 	if (sync) {
 		tg = task_group(current);
-		weight = current->se.load.weight;
+		weight = current->se.avg.load_avg_contrib;
 
 		this_load += effective_load(tg, this_cpu, -weight, -weight);
 		load += effective_load(tg, prev_cpu, 0, -weight);
 	}
 
 	tg = task_group(p);
-	weight = p->se.load.weight;
+	weight = p->se.avg.load_avg_contrib;
 
 	/*
 	 * In low-load situations, where prev_cpu is idle and this_cpu is idle
@@ -2651,6 +2944,81 @@ find_idlest_cpu(struct sched_group *group, struct task_struct *p, int this_cpu)
 /*
  * Try and locate an idle CPU in the sched_domain.
  */
+/*
+ * Cache refill a task pays to run on cpu after running on prev_cpu: the
+ * measured migration cost of the lowest domain spanning both.
+ */
+static unsigned int wake_migration_cost(int prev_cpu, int cpu)
+{
+	struct sched_domain *sd;
+	unsigned int cost = 0;
+
+	if (cpu == prev_cpu)
+		return 0;
+
+	for_each_domain(prev_cpu, sd) {
+		cost = sd->migration_cost;
+		if (cpumask_test_cpu(cpu, sched_domain_span(sd)))
+			break;
+	}
+	return cost;
+}
+
+/*
+ * How cold an idle cpu has got: the longer it has been idle, the more of
+ * its cache is gone, up to the cost of refilling all of it.  Once it has
+ * been idle for longer than its recent idle periods, it has likely gone
+ * into a deep idle state and is taken as fully cold.
+ */
+static unsigned int wake_idle_cost(int cpu, u64 now, unsigned int max_cost)
+{
+	struct rq *rq = cpu_rq(cpu);
+	u64 idle_stamp = ACCESS_ONCE(rq->idle_stamp);
+	u64 idle_for;
+
+	/* Without a stamp it is unknown how long it has idled; assume cold */
+	if (!idle_stamp)
+		return max_cost;
+	if ((s64)(now - idle_stamp) <= 0)
+		return 0;
+
+	idle_for = now - idle_stamp;
+	if (idle_for >= ACCESS_ONCE(rq->avg_idle))
+		return max_cost;
+	return min_t(u64, idle_for, max_cost);
+}
+
+/*
+ * The idle cpu sharing a cache with target that p gets going on soonest:
+ * the least cache refill from prev_cpu plus the least coldness of the cpu
+ * itself.  Returns -1 if none is idle.
+ */
+static int select_warm_idle_sibling(struct task_struct *p, int prev_cpu,
+				    int target)
+{
+	struct sched_domain *sd = rcu_dereference(per_cpu(sd_llc, target));
+	unsigned int cost, best_cost = UINT_MAX;
+	int i, best = -1;
+	u64 now;
+
+	if (!sd)
+		return -1;
+
+	now = local_clock();
+	for_each_cpu_and(i, sched_domain_span(sd), tsk_cpus_allowed(p)) {
+		if (!idle_cpu(i))
+			continue;
+
+		cost = wake_migration_cost(prev_cpu, i) +
+			wake_idle_cost(i, now, sd->migration_cost);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = i;
+		}
+	}
+	return best;
+}
+
 static int select_idle_sibling(struct task_struct *p, int target)
 {
 	int cpu = smp_processor_id();
@@ -2663,15 +3031,34 @@ static int select_idle_sibling(struct task_struct *p, int target)
 	 * If the task is going to be woken-up on this cpu and if it is
 	 * already idle, then it is the right target.
 	 */
-	if (target == cpu && idle_cpu(cpu))
+	if (target == cpu && idle_cpu(cpu)) {
+		schedstat_inc(this_rq(), wake_place_target);
 		return cpu;
+	}
 
 	/*
 	 * If the task is going to be woken-up on the cpu where it previously
 	 * ran and if it is currently idle, then it the right target.
 	 */
-	if (target == prev_cpu && idle_cpu(prev_cpu))
+	if (target == prev_cpu && idle_cpu(prev_cpu)) {
+		schedstat_inc(this_rq(), wake_place_prev);
 		return prev_cpu;
+	}
+
+	/*
+	 * A light task runs briefly and is gone again, so it does best on
+	 * a warm cpu.  Heavy ones get a whole idle core below.
+	 */
+	if (sysctl_sched_wake_placement == SCHED_WAKE_PLACEMENT_WARM_IDLE &&
+	    p->se.last_wakeup_runtime < sysctl_sched_heavy_task) {
+		i = select_warm_idle_sibling(p, prev_cpu, target);
+		if (i >= 0) {
+			schedstat_inc(this_rq(), wake_place_warm);
+			return i;
+		}
+		schedstat_inc(this_rq(), wake_place_busy);
+		return target;
+	}
 
 	/*
 	 * Otherwise, iterate the domains and find an elegible idle cpu.
@@ -2689,14 +3076,14 @@ static int select_idle_sibling(struct task_struct *p, int target)
 					goto next;
 			}
 
-			target = cpumask_first_and(sched_group_cpus(sg),
+			schedstat_inc(this_rq(), wake_place_idle_group);
+			return cpumask_first_and(sched_group_cpus(sg),
 					tsk_cpus_allowed(p));
-			goto done;
 next:
 			sg = sg->next;
 		} while (sg != sd->groups);
 	}
-done:
+	schedstat_inc(this_rq(), wake_place_busy);
 	return target;
 }
 
@@ -3115,10 +3502,19 @@ struct lb_env {
  */
 static void move_task(struct task_struct *p, struct lb_env *env)
 {
+	struct sched_entity *se = &p->se;
+
 	deactivate_task(env->src_rq, p, 0);
 	set_task_cpu(p, env->dst_cpu);
 	activate_task(env->dst_rq, p, 0);
 	check_preempt_curr(env->dst_rq, p, 0);
+
+	/* A task that never sleeps is heavy by what it ran since waking */
+	if (max(se->last_wakeup_runtime,
+		se->sum_exec_runtime - se->wakeup_sum_exec_runtime) >=
+	    sysctl_sched_heavy_task)
+		sched_util_notify(SCHED_UTIL_MIGRATE, env->dst_cpu,
+				  env->src_cpu);
 }
 
 /*
@@ -3381,11 +3777,11 @@ static int tg_load_down(struct task_group *tg, void *data)
 	long cpu = (long)data;
 
 	if (!tg->parent) {
-		load = cpu_rq(cpu)->load.weight;
+		load = cpu_rq(cpu)->cfs.runnable_load_avg;
 	} else {
 		load = tg->parent->cfs_rq[cpu]->h_load;
-		load *= tg->se[cpu]->load.weight;
-		load /= tg->parent->cfs_rq[cpu]->load.weight + 1;
+		load *= tg->se[cpu]->avg.load_avg_contrib;
+		load /= tg->parent->cfs_rq[cpu]->runnable_load_avg + 1;
 	}
 
 	tg->cfs_rq[cpu]->h_load = load;
@@ -3405,8 +3801,8 @@ static unsigned long task_h_load(struct task_struct *p)
 	struct cfs_rq *cfs_rq = task_cfs_rq(p);
 	unsigned long load;
 
-	load = p->se.load.weight;
-	load = div_u64(load * cfs_rq->h_load, cfs_rq->load.weight + 1);
+	load = p->se.avg.load_avg_contrib;
+	load = div_u64(load * cfs_rq->h_load, cfs_rq->runnable_load_avg + 1);
 
 	return load;
 }
@@ -3421,7 +3817,7 @@ static inline void update_h_load(long cpu)
 
 static unsigned long task_h_load(struct task_struct *p)
 {
-	return p->se.load.weight;
+	return p->se.avg.load_avg_contrib;
 }
 #endif
 
@@ -222,6 +222,11 @@ struct cfs_rq {
 	unsigned int nr_spread_over;
 #endif
 
+#ifdef CONFIG_SMP
+	/* Sum of the load_avg_contrib of the entities queued here */
+	unsigned long runnable_load_avg;
+#endif
+
 #ifdef CONFIG_FAIR_GROUP_SCHED
 	struct rq *rq;	/* cpu runqueue to which this cfs_rq is attached */
 
@@ -239,9 +244,9 @@ struct cfs_rq {
 
 #ifdef CONFIG_SMP
 	/*
-	 *   h_load = weight * f(tg)
+	 *   h_load = runnable_load_avg * f(tg)
 	 *
-	 * Where f(tg) is the recursive weight fraction assigned to
+	 * Where f(tg) is the recursive load fraction assigned to
 	 * this group.
 	 */
 	unsigned long h_load;
@@ -463,6 +468,13 @@ struct rq {
 	/* try_to_wake_up() stats */
 	unsigned int ttwu_count;
 	unsigned int ttwu_local;
+
+	/* select_idle_sibling() outcomes of the wakeups done from here */
+	unsigned int wake_place_target;
+	unsigned int wake_place_prev;
+	unsigned int wake_place_warm;
+	unsigned int wake_place_idle_group;
+	unsigned int wake_place_busy;
 #endif
 
 #ifdef CONFIG_SMP
@@ -0,0 +1,151 @@
+/*
+ * LZ4 - Fast LZ compression algorithm
+ *
+ * Compressor for the LZ4 block format, see lz4defs.h.  A single-entry
+ * hash table of 4-byte sequences finds matches; runs without matches
+ * are skipped over with an increasing stride.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+/* Returns the number of equal bytes at ip and ref, stopping at limit */
+static inline size_t lz4_count(const u8 *ip, const u8 *ref, const u8 *limit)
+{
+	const u8 *start = ip;
+
+	while (ip < limit - (sizeof(unsigned long) - 1)) {
+		unsigned long diff = LZ4_READ_LONG(ref) ^ LZ4_READ_LONG(ip);
+
+		if (!diff) {
+			ip += sizeof(unsigned long);
+			ref += sizeof(unsigned long);
+			continue;
+		}
+#ifdef __LITTLE_ENDIAN
+		ip += __ffs(diff) >> 3;
+#else
+		ip += (BITS_PER_LONG - 1 - __fls(diff)) >> 3;
+#endif
+		return ip - start;
+	}
+	while (ip < limit && *ip == *ref) {
+		ip++;
+		ref++;
+	}
+	return ip - start;
+}
+
+static inline u8 *lz4_write_length(u8 *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+static inline u8 *lz4_write_literals(u8 *op, u8 *token, const u8 *anchor,
+				     size_t len)
+{
+	if (len >= RUN_MASK) {
+		*token = RUN_MASK << ML_BITS;
+		op = lz4_write_length(op, len - RUN_MASK);
+	} else {
+		*token = len << ML_BITS;
+	}
+	memcpy(op, anchor, len);
+	return op + len;
+}
+
+/*
+ * The hash table holds offsets from src.  It is not cleared between
+ * calls: a stale entry can only produce a candidate that fails the
+ * range or content checks, which saves clearing 16KB per call.
+ */
+int lz4_compress(const unsigned char *src, size_t src_len,
+		 unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	u32 *hash_table = wrkmem;
+	const u8 *ip = src;
+	const u8 *anchor = src;
+	const u8 *const iend = src + src_len;
+	const u8 *const mflimit = iend - MFLIMIT;
+	const u8 *const matchlimit = iend - LASTLITERALS;
+	u8 *op = dst;
+	u8 *token;
+	const u8 *ref;
+	size_t len;
+	u32 h, attempts;
+
+	if (src_len < MINLENGTH)
+		goto last_literals;
+
+	hash_table[LZ4_HASH_VALUE(ip)] = 0;
+	ip++;
+
+	for (;;) {
+		/* Find a match */
+		attempts = (1U << SKIPSTRENGTH) + 3;
+		for (;;) {
+			if (unlikely(ip > mflimit))
+				goto last_literals;
+			h = LZ4_HASH_VALUE(ip);
+			ref = src + hash_table[h];
+			hash_table[h] = ip - src;
+			if (ref < ip && ip - ref <= MAX_DISTANCE &&
+			    LZ4_READ32(ref) == LZ4_READ32(ip))
+				break;
+			ip += attempts++ >> SKIPSTRENGTH;
+		}
+
+		/* Catch up */
+		while (ip > anchor && ref > (const u8 *)src &&
+		       ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* Literal run and offset */
+		token = op++;
+		op = lz4_write_literals(op, token, anchor, ip - anchor);
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		/* Match length */
+		ip += MINMATCH;
+		ref += MINMATCH;
+		len = lz4_count(ip, ref, matchlimit);
+		ip += len;
+		if (len >= ML_MASK) {
+			*token += ML_MASK;
+			op = lz4_write_length(op, len - ML_MASK);
+		} else {
+			*token += len;
+		}
+		anchor = ip;
+
+		if (ip > mflimit)
+			break;
+		/* Fill the table with a position inside the match */
+		hash_table[LZ4_HASH_VALUE(ip - 2)] = ip - 2 - src;
+	}
+
+last_literals:
+	token = op++;
+	op = lz4_write_literals(op, token, anchor, iend - anchor);
+
+	*dst_len = op - dst;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 compressor");
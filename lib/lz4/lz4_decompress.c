@@ -0,0 +1,100 @@
+/*
+ * LZ4 Decompressor for Linux kernel
+ *
+ * Decoder for the LZ4 block format, see lz4defs.h.  Every length and
+ * offset read from the input is checked against the input and output
+ * bounds, so corrupted data yields an error rather than an overrun.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+/* Adds length extension bytes to *len, false on truncated input */
+static inline bool lz4_read_length(const u8 **ip, const u8 *iend,
+				   size_t *len)
+{
+	unsigned int s;
+
+	do {
+		if (unlikely(*ip >= iend))
+			return false;
+		s = *(*ip)++;
+		*len += s;
+	} while (s == 255);
+	return true;
+}
+
+int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
+				     unsigned char *dest, size_t *dest_len)
+{
+	const u8 *ip = src;
+	const u8 *const iend = src + src_len;
+	u8 *op = dest;
+	u8 *const oend = dest + *dest_len;
+	const u8 *ref;
+	unsigned int token;
+	size_t len, offset;
+
+	for (;;) {
+		if (unlikely(ip >= iend))
+			goto malformed;
+		token = *ip++;
+
+		/* Literals */
+		len = token >> ML_BITS;
+		if (len == RUN_MASK && !lz4_read_length(&ip, iend, &len))
+			goto malformed;
+		if (unlikely(len > (size_t)(iend - ip) ||
+			     len > (size_t)(oend - op)))
+			goto malformed;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		/* The last sequence ends after its literals */
+		if (ip == iend)
+			break;
+
+		/* Match */
+		if (unlikely(iend - ip < 2))
+			goto malformed;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		if (unlikely(offset == 0 || offset > (size_t)(op - dest)))
+			goto malformed;
+		ref = op - offset;
+
+		len = token & ML_MASK;
+		if (len == ML_MASK && !lz4_read_length(&ip, iend, &len))
+			goto malformed;
+		len += MINMATCH;
+		if (unlikely(len > (size_t)(oend - op)))
+			goto malformed;
+
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* Overlapping match repeats the last offset bytes */
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+
+	*dest_len = op - dest;
+	return 0;
+
+malformed:
+	return -1;
+}
+EXPORT_SYMBOL_GPL(lz4_decompress_unknownoutputsize);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
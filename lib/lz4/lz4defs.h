@@ -0,0 +1,41 @@
+/*
+ * lz4defs.h -- architecture specific defines
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * LZ4 block format: a sequence is a token byte (literal run length in
+ * the high nibble, match length - MINMATCH in the low one), optional
+ * length extension bytes for the literal run, the literals, a 16-bit
+ * little endian match offset and optional length extension bytes for
+ * the match.  The last sequence carries literals only.
+ */
+#define MINMATCH	4
+
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+
+/* The last 5 bytes are always literals, the last match starts 12 before */
+#define LASTLITERALS	5
+#define MFLIMIT		(8 + MINMATCH)
+#define MINLENGTH	(MFLIMIT + 1)
+
+#define MAXD_LOG	16
+#define MAX_DISTANCE	((1 << MAXD_LOG) - 1)
+
+#define HASH_LOG	12
+#define HASHTABLESIZE	(1 << HASH_LOG)
+
+/* Speeds up skipping over incompressible data */
+#define SKIPSTRENGTH	6
+
+#define LZ4_READ32(p)		get_unaligned((const u32 *)(p))
+#define LZ4_READ_LONG(p)	get_unaligned((const unsigned long *)(p))
+
+#define LZ4_HASH_VALUE(p)	\
+	((LZ4_READ32(p) * 2654435761U) >> ((MINMATCH * 8) - HASH_LOG))
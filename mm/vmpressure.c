@@ -19,6 +19,8 @@
 #include <linux/mm.h>
 #include <linux/vmstat.h>
 #include <linux/eventfd.h>
+#include <linux/export.h>
+#include <linux/notifier.h>
 #include <linux/swap.h>
 #include <linux/printk.h>
 #include <linux/slab.h>
@@ -91,19 +93,19 @@ static struct vmpressure *vmpressure_parent(struct vmpressure *vmpr)
 	return memcg_to_vmpressure(memcg);
 }
 
-enum vmpressure_levels {
-	VMPRESSURE_LOW = 0,
-	VMPRESSURE_MEDIUM,
-	VMPRESSURE_CRITICAL,
-	VMPRESSURE_NUM_LEVELS,
-};
-
 static const char * const vmpressure_str_levels[] = {
 	[VMPRESSURE_LOW] = "low",
 	[VMPRESSURE_MEDIUM] = "medium",
 	[VMPRESSURE_CRITICAL] = "critical",
 };
 
+/*
+ * In-kernel listeners for pressure on the root cgroup, i.e. on the
+ * whole system.  They are called from process context with the level
+ * as the notifier value.
+ */
+static BLOCKING_NOTIFIER_HEAD(vmpressure_notifier);
+
 static enum vmpressure_levels vmpressure_level(unsigned long pressure)
 {
 	if (pressure >= vmpressure_level_critical)
@@ -188,6 +190,10 @@ static void vmpressure_work_fn(struct work_struct *work)
 	vmpr->reclaimed = 0;
 	mutex_unlock(&vmpr->sr_lock);
 
+	if (!vmpressure_parent(vmpr))
+		blocking_notifier_call_chain(&vmpressure_notifier,
+				vmpressure_calc_level(scanned, reclaimed), NULL);
+
 	do {
 		if (vmpressure_event(vmpr, scanned, reclaimed))
 			break;
@@ -359,6 +365,29 @@ void vmpressure_unregister_event(struct cgroup *cg, struct cftype *cft,
 	mutex_unlock(&vmpr->events_lock);
 }
 
+/**
+ * vmpressure_notifier_register() - Get notified of system-wide pressure
+ * @nb:		notifier block to call
+ *
+ * @nb is called with one of enum vmpressure_levels whenever the pressure
+ * on the root cgroup is evaluated, whether or not userland listens.
+ */
+int vmpressure_notifier_register(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_notifier_register);
+
+/**
+ * vmpressure_notifier_unregister() - Stop system-wide pressure notifications
+ * @nb:		notifier block passed to vmpressure_notifier_register()
+ */
+int vmpressure_notifier_unregister(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_notifier_unregister);
+
 /**
  * vmpressure_init() - Initialize vmpressure control structure
  * @vmpr:	Structure to be initialized
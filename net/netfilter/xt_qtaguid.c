@@ -15,11 +15,14 @@
 #define DEBUG
 
 #include <linux/file.h>
+#include <linux/hash.h>
 #include <linux/inetdevice.h>
 #include <linux/module.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter/xt_qtaguid.h>
 #include <linux/ratelimit.h>
+#include <linux/rculist.h>
+#include <linux/seqlock.h>
 #include <linux/skbuff.h>
 #include <linux/workqueue.h>
 #include <net/addrconf.h>
@@ -185,17 +188,23 @@ static struct proc_dir_entry *iface_stat_fmt_procfile;
  *     iface_stat_list_lock
  *
  * qtaguid_mt()
+ *   iface_stat_update_from_skb()
+ *     rcu_read_lock_bh()
  *   account_for_uid()
  *     if_tag_stat_update()
- *       get_sock_stat()
- *         sock_tag_list_lock
- *       struct iface_stat->tag_stat_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *       rcu_read_lock_bh()
+ *         get_sock_stat()
  *         tag_stat_update()
  *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *         struct iface_stat->tag_stat_list_lock
+ *           tag_stat_update()
+ *             get_active_counter_set()
+ *
+ * The match never takes sock_tag_list_lock or tag_counter_set_list_lock:
+ * it looks up iface_stat_list, sock_tag_hash, iface_stat->tag_stat_hash
+ * and tag_counter_set_hash under rcu_read_lock_bh(). Writers update those
+ * under the same locks as the matching trees, and free with call_rcu_bh().
+ * The tag_stat_list_lock is only taken to create a missing tag_stat.
  *
  *
  * qtaguid_ctrl_parse()
@@ -224,9 +233,13 @@ static LIST_HEAD(iface_stat_list);
 static DEFINE_SPINLOCK(iface_stat_list_lock);
 
 static struct rb_root sock_tag_tree = RB_ROOT;
+static struct hlist_head sock_tag_hash[1 << SOCK_TAG_HASH_BITS];
 static DEFINE_SPINLOCK(sock_tag_list_lock);
+/* Lets the match read a sock_tag.tag that is being retagged in place */
+static seqcount_t sock_tag_seq = SEQCNT_ZERO;
 
 static struct rb_root tag_counter_set_tree = RB_ROOT;
+static struct hlist_head tag_counter_set_hash[1 << TAG_COUNTER_SET_HASH_BITS];
 static DEFINE_SPINLOCK(tag_counter_set_list_lock);
 
 static struct rb_root uid_tag_data_tree = RB_ROOT;
@@ -269,6 +282,37 @@ static inline void dc_add_byte_packets(struct data_counters *counters, int set,
 	counters->bpc[set][direction][ifs_proto].packets += packets;
 }
 
+static struct data_counters_pcpu *data_counters_pcpu_alloc(void)
+{
+	return kcalloc(nr_cpu_ids, sizeof(struct data_counters_pcpu),
+		       GFP_ATOMIC);
+}
+
+/* Sum up the per-cpu copies into dc. */
+void data_counters_fold(struct data_counters *dc,
+			struct data_counters_pcpu *pdc)
+{
+	struct data_counters snap;
+	struct byte_packet_counters *sum, *bpc;
+	unsigned int start;
+	int cpu, i;
+
+	memset(dc, 0, sizeof(*dc));
+	for_each_possible_cpu(cpu) {
+		do {
+			start = u64_stats_fetch_begin_bh(&pdc[cpu].syncp);
+			snap = pdc[cpu].dc;
+		} while (u64_stats_fetch_retry_bh(&pdc[cpu].syncp, start));
+
+		sum = &dc->bpc[0][0][0];
+		bpc = &snap.bpc[0][0][0];
+		for (i = 0; i < sizeof(snap.bpc) / sizeof(*bpc); i++) {
+			sum[i].bytes += bpc[i].bytes;
+			sum[i].packets += bpc[i].packets;
+		}
+	}
+}
+
 static struct tag_node *tag_node_tree_search(struct rb_root *root, tag_t tag)
 {
 	struct rb_node *node = root->rb_node;
@@ -332,6 +376,39 @@ static struct tag_stat *tag_stat_tree_search(struct rb_root *root, tag_t tag)
 	return rb_entry(&node->node, struct tag_stat, tn.node);
 }
 
+static struct hlist_head *tag_stat_hash_head(struct iface_stat *iface_entry,
+					     tag_t tag)
+{
+	return &iface_entry->tag_stat_hash[hash_64(tag, TAG_STAT_HASH_BITS)];
+}
+
+/*
+ * Caller must hold rcu_read_lock_bh() or
+ * iface_entry->tag_stat_list_lock.
+ */
+static struct tag_stat *tag_stat_hash_search(struct iface_stat *iface_entry,
+					     tag_t tag)
+{
+	struct tag_stat *ts_entry;
+	struct hlist_node *node;
+
+	hlist_for_each_entry_rcu(ts_entry, node,
+				 tag_stat_hash_head(iface_entry, tag),
+				 hash_node) {
+		if (ts_entry->tn.tag == tag)
+			return ts_entry;
+	}
+	return NULL;
+}
+
+static void tag_stat_free_rcu(struct rcu_head *head)
+{
+	struct tag_stat *ts_entry = container_of(head, struct tag_stat, rcu);
+
+	kfree(ts_entry->counters);
+	kfree(ts_entry);
+}
+
 static void tag_counter_set_tree_insert(struct tag_counter_set *data,
 					struct rb_root *root)
 {
@@ -348,6 +425,30 @@ static struct tag_counter_set *tag_counter_set_tree_search(struct rb_root *root,
 
 }
 
+static struct hlist_head *tag_counter_set_hash_head(tag_t tag)
+{
+	return &tag_counter_set_hash[hash_64(tag, TAG_COUNTER_SET_HASH_BITS)];
+}
+
+/* Caller must hold rcu_read_lock_bh() or tag_counter_set_list_lock */
+static struct tag_counter_set *tag_counter_set_hash_search(tag_t tag)
+{
+	struct tag_counter_set *tcs;
+	struct hlist_node *node;
+
+	hlist_for_each_entry_rcu(tcs, node, tag_counter_set_hash_head(tag),
+				 hash_node) {
+		if (tcs->tn.tag == tag)
+			return tcs;
+	}
+	return NULL;
+}
+
+static void tag_counter_set_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct tag_counter_set, rcu));
+}
+
 static void tag_ref_tree_insert(struct tag_ref *data, struct rb_root *root)
 {
 	tag_node_tree_insert(&data->tn, root);
@@ -401,6 +502,16 @@ static void sock_tag_tree_insert(struct sock_tag *data, struct rb_root *root)
 	rb_insert_color(&data->sock_node, root);
 }
 
+static struct hlist_head *sock_tag_hash_head(const struct sock *sk)
+{
+	return &sock_tag_hash[hash_ptr((void *)sk, SOCK_TAG_HASH_BITS)];
+}
+
+static void sock_tag_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct sock_tag, rcu));
+}
+
 static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
 {
 	struct rb_node *node;
@@ -417,7 +528,7 @@ static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
 			 get_uid_from_tag(st_entry->tag));
 		rb_erase(&st_entry->sock_node, st_to_free_tree);
 		sockfd_put(st_entry->socket);
-		kfree(st_entry);
+		call_rcu_bh(&st_entry->rcu, sock_tag_free_rcu);
 	}
 }
 
@@ -738,17 +849,17 @@ static int get_active_counter_set(tag_t tag)
 		 tag, get_uid_from_tag(tag));
 	/* For now we only handle UID tags for active sets */
 	tag = get_utag_from_tag(tag);
-	spin_lock_bh(&tag_counter_set_list_lock);
-	tcs = tag_counter_set_tree_search(&tag_counter_set_tree, tag);
+	rcu_read_lock_bh();
+	tcs = tag_counter_set_hash_search(tag);
 	if (tcs)
-		active_set = tcs->active_set;
-	spin_unlock_bh(&tag_counter_set_list_lock);
+		active_set = ACCESS_ONCE(tcs->active_set);
+	rcu_read_unlock_bh();
 	return active_set;
 }
 
 /*
  * Find the entry for tracking the specified interface.
- * Caller must hold iface_stat_list_lock
+ * Caller must hold iface_stat_list_lock or rcu_read_lock_bh().
  */
 static struct iface_stat *get_iface_entry(const char *ifname)
 {
@@ -761,7 +872,7 @@ static struct iface_stat *get_iface_entry(const char *ifname)
 	}
 
 	/* Iterate over interfaces */
-	list_for_each_entry(iface_entry, &iface_stat_list, list) {
+	list_for_each_entry_rcu(iface_entry, &iface_stat_list, list) {
 		if (!strcmp(ifname, iface_entry->ifname))
 			goto done;
 	}
@@ -788,9 +899,10 @@ static int pp_iface_stat_line(bool header, char *outp,
 			       "tx_other_bytes tx_other_packets\n"
 			);
 	} else {
-		struct data_counters *cnts;
+		struct data_counters totals_via_skb;
+		struct data_counters *cnts = &totals_via_skb;
 		int cnt_set = 0;   /* We only use one set for the device */
-		cnts = &iface_entry->totals_via_skb;
+		data_counters_fold(cnts, iface_entry->totals_via_skb);
 		len = snprintf(
 			outp, char_count,
 			"%s "
@@ -991,6 +1103,14 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 		kfree(new_iface);
 		return NULL;
 	}
+	new_iface->totals_via_skb = data_counters_pcpu_alloc();
+	if (new_iface->totals_via_skb == NULL) {
+		pr_err("qtaguid: iface_stat: create(%s): "
+		       "counters alloc failed\n", net_dev->name);
+		kfree(new_iface->ifname);
+		kfree(new_iface);
+		return NULL;
+	}
 	spin_lock_init(&new_iface->tag_stat_list_lock);
 	new_iface->tag_stat_tree = RB_ROOT;
 	_iface_stat_set_active(new_iface, net_dev, true);
@@ -1004,6 +1124,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 		pr_err("qtaguid: iface_stat: create(%s): "
 		       "work alloc failed\n", new_iface->ifname);
 		_iface_stat_set_active(new_iface, net_dev, false);
+		kfree(new_iface->totals_via_skb);
 		kfree(new_iface->ifname);
 		kfree(new_iface);
 		return NULL;
@@ -1011,7 +1132,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 	isw->iface_entry = new_iface;
 	INIT_WORK(&isw->iface_work, iface_create_proc_worker);
 	schedule_work(&isw->iface_work);
-	list_add(&new_iface->list, &iface_stat_list);
+	list_add_rcu(&new_iface->list, &iface_stat_list);
 	return new_iface;
 }
 
@@ -1192,16 +1313,33 @@ static struct sock_tag *get_sock_stat_nl(const struct sock *sk)
 	return sock_tag_tree_search(&sock_tag_tree, sk);
 }
 
+/* Caller must hold rcu_read_lock_bh() */
 static struct sock_tag *get_sock_stat(const struct sock *sk)
 {
 	struct sock_tag *sock_tag_entry;
+	struct hlist_node *node;
 	MT_DEBUG("qtaguid: get_sock_stat(sk=%p)\n", sk);
 	if (!sk)
 		return NULL;
-	spin_lock_bh(&sock_tag_list_lock);
-	sock_tag_entry = get_sock_stat_nl(sk);
-	spin_unlock_bh(&sock_tag_list_lock);
-	return sock_tag_entry;
+	hlist_for_each_entry_rcu(sock_tag_entry, node, sock_tag_hash_head(sk),
+				 hash_node) {
+		if (sock_tag_entry->sk == sk)
+			return sock_tag_entry;
+	}
+	return NULL;
+}
+
+/* The tag is 64 bits, so it can't be read atomically everywhere. */
+static tag_t get_sock_stat_tag(const struct sock_tag *sock_tag_entry)
+{
+	unsigned int seq;
+	tag_t tag;
+
+	do {
+		seq = read_seqcount_begin(&sock_tag_seq);
+		tag = sock_tag_entry->tag;
+	} while (read_seqcount_retry(&sock_tag_seq, seq));
+	return tag;
 }
 
 static int ipx_proto(const struct sk_buff *skb,
@@ -1244,6 +1382,18 @@ data_counters_update(struct data_counters *dc, int set,
 	}
 }
 
+/* Caller must have bottom halves disabled. */
+static void data_counters_pcpu_update(struct data_counters_pcpu *pdc, int set,
+				      enum ifs_tx_rx direction, int proto,
+				      int bytes)
+{
+	struct data_counters_pcpu *cnts = &pdc[smp_processor_id()];
+
+	u64_stats_update_begin(&cnts->syncp);
+	data_counters_update(&cnts->dc, set, direction, proto, bytes);
+	u64_stats_update_end(&cnts->syncp);
+}
+
 /*
  * Update stats for the specified interface. Do nothing if the entry
  * does not exist (when a device was never configured with an IP address).
@@ -1352,21 +1502,21 @@ static void iface_stat_update_from_skb(const struct sk_buff *skb,
 		 par->hooknum, __func__, el_dev->name, el_dev->type,
 		 par->family, proto, direction);
 
-	spin_lock_bh(&iface_stat_list_lock);
+	rcu_read_lock_bh();
 	entry = get_iface_entry(el_dev->name);
 	if (entry == NULL) {
 		IF_DEBUG("qtaguid[%d]: iface_stat: %s(%s): not tracked\n",
 			 par->hooknum, __func__, el_dev->name);
-		spin_unlock_bh(&iface_stat_list_lock);
+		rcu_read_unlock_bh();
 		return;
 	}
 
 	IF_DEBUG("qtaguid[%d]: %s(%s): entry=%p\n", par->hooknum,  __func__,
 		 el_dev->name, entry);
 
-	data_counters_update(&entry->totals_via_skb, 0, direction, proto,
-			     bytes);
-	spin_unlock_bh(&iface_stat_list_lock);
+	data_counters_pcpu_update(entry->totals_via_skb, 0, direction, proto,
+				  bytes);
+	rcu_read_unlock_bh();
 }
 
 static void tag_stat_update(struct tag_stat *tag_entry,
@@ -1378,11 +1528,11 @@ static void tag_stat_update(struct tag_stat *tag_entry,
 		 "dir=%d proto=%d bytes=%d)\n",
 		 tag_entry->tn.tag, get_uid_from_tag(tag_entry->tn.tag),
 		 active_set, direction, proto, bytes);
-	data_counters_update(&tag_entry->counters, active_set, direction,
-			     proto, bytes);
+	data_counters_pcpu_update(tag_entry->counters, active_set, direction,
+				  proto, bytes);
 	if (tag_entry->parent_counters)
-		data_counters_update(tag_entry->parent_counters, active_set,
-				     direction, proto, bytes);
+		data_counters_pcpu_update(tag_entry->parent_counters,
+					  active_set, direction, proto, bytes);
 }
 
 /*
@@ -1390,8 +1540,9 @@ static void tag_stat_update(struct tag_stat *tag_entry,
  * the interface.
  * iface_entry->tag_stat_list_lock should be held.
  */
-static struct tag_stat *create_if_tag_stat(struct iface_stat *iface_entry,
-					   tag_t tag)
+static struct tag_stat *create_if_tag_stat(
+	struct iface_stat *iface_entry, tag_t tag,
+	struct data_counters_pcpu *parent_counters)
 {
 	struct tag_stat *new_tag_stat_entry = NULL;
 	IF_DEBUG("qtaguid: iface_stat: %s(): ife=%p tag=0x%llx"
@@ -1402,8 +1553,19 @@ static struct tag_stat *create_if_tag_stat(struct iface_stat *iface_entry,
 		pr_err("qtaguid: iface_stat: tag stat alloc failed\n");
 		goto done;
 	}
+	new_tag_stat_entry->counters = data_counters_pcpu_alloc();
+	if (!new_tag_stat_entry->counters) {
+		pr_err("qtaguid: iface_stat: tag stat counters alloc failed\n");
+		kfree(new_tag_stat_entry);
+		new_tag_stat_entry = NULL;
+		goto done;
+	}
 	new_tag_stat_entry->tn.tag = tag;
+	new_tag_stat_entry->parent_counters = parent_counters;
 	tag_stat_tree_insert(new_tag_stat_entry, &iface_entry->tag_stat_tree);
+	/* Fully set up before the match can find it */
+	hlist_add_head_rcu(&new_tag_stat_entry->hash_node,
+			   tag_stat_hash_head(iface_entry, tag));
 done:
 	return new_tag_stat_entry;
 }
@@ -1415,7 +1577,7 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	struct tag_stat *tag_stat_entry;
 	tag_t tag, acct_tag;
 	tag_t uid_tag;
-	struct data_counters *uid_tag_counters;
+	struct data_counters_pcpu *uid_tag_counters;
 	struct sock_tag *sock_tag_entry;
 	struct iface_stat *iface_entry;
 	struct tag_stat *new_tag_stat = NULL;
@@ -1423,12 +1585,12 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 		"uid=%u sk=%p dir=%d proto=%d bytes=%d)\n",
 		 ifname, uid, sk, direction, proto, bytes);
 
-
+	rcu_read_lock_bh();
 	iface_entry = get_iface_entry(ifname);
 	if (!iface_entry) {
 		pr_err_ratelimited("qtaguid: tag_stat: stat_update() "
 				   "%s not found\n", ifname);
-		return;
+		goto unlock_rcu;
 	}
 	/* It is ok to process data when an iface_entry is inactive */
 
@@ -1441,7 +1603,7 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	 */
 	sock_tag_entry = get_sock_stat(sk);
 	if (sock_tag_entry) {
-		tag = sock_tag_entry->tag;
+		tag = get_sock_stat_tag(sock_tag_entry);
 		acct_tag = get_atag_from_tag(tag);
 		uid_tag = get_utag_from_tag(tag);
 	} else {
@@ -1452,19 +1614,24 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	MT_DEBUG("qtaguid: tag_stat: stat_update(): "
 		 " looking for tag=0x%llx (uid=%u) in ife=%p\n",
 		 tag, get_uid_from_tag(tag), iface_entry);
-	/* Loop over tag list under this interface for {acct_tag,uid_tag} */
+	/*
+	 * Updating the {acct_tag, uid_tag} entry handles both stats:
+	 * {0, uid_tag} will also get updated.
+	 */
+	tag_stat_entry = tag_stat_hash_search(iface_entry, tag);
+	if (tag_stat_entry) {
+		tag_stat_update(tag_stat_entry, direction, proto, bytes);
+		goto unlock_rcu;
+	}
+
+	/* Not there yet: recheck and create under the lock. */
 	spin_lock_bh(&iface_entry->tag_stat_list_lock);
 
 	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
 					      tag);
 	if (tag_stat_entry) {
-		/*
-		 * Updating the {acct_tag, uid_tag} entry handles both stats:
-		 * {0, uid_tag} will also get updated.
-		 */
 		tag_stat_update(tag_stat_entry, direction, proto, bytes);
-		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
-		return;
+		goto unlock;
 	}
 
 	/* Loop over tag list under this interface for {0,uid_tag} */
@@ -1476,20 +1643,20 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 		 * No parent counters. So
 		 *  - No {0, uid_tag} stats and no {acc_tag, uid_tag} stats.
 		 */
-		new_tag_stat = create_if_tag_stat(iface_entry, uid_tag);
+		new_tag_stat = create_if_tag_stat(iface_entry, uid_tag, NULL);
 		if (!new_tag_stat)
 			goto unlock;
-		uid_tag_counters = &new_tag_stat->counters;
+		uid_tag_counters = new_tag_stat->counters;
 	} else {
-		uid_tag_counters = &tag_stat_entry->counters;
+		uid_tag_counters = tag_stat_entry->counters;
 	}
 
 	if (acct_tag) {
 		/* Create the child {acct_tag, uid_tag} and hook up parent. */
-		new_tag_stat = create_if_tag_stat(iface_entry, tag);
+		new_tag_stat = create_if_tag_stat(iface_entry, tag,
+						  uid_tag_counters);
 		if (!new_tag_stat)
 			goto unlock;
-		new_tag_stat->parent_counters = uid_tag_counters;
 	} else {
 		/*
 		 * For new_tag_stat to be still NULL here would require:
@@ -1504,6 +1671,8 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	tag_stat_update(new_tag_stat, direction, proto, bytes);
 unlock:
 	spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+unlock_rcu:
+	rcu_read_unlock_bh();
 }
 
 static int iface_netdev_event_handler(struct notifier_block *nb,
@@ -2095,6 +2264,7 @@ static int ctrl_cmd_delete(const char *input)
 
 		if (!acct_tag || st_entry->tag == tag) {
 			rb_erase(&st_entry->sock_node, &sock_tag_tree);
+			hlist_del_rcu(&st_entry->hash_node);
 			/* Can't sockfd_put() within spinlock, do it later. */
 			sock_tag_tree_insert(st_entry, &st_to_free_tree);
 			tr_entry = lookup_tag_ref(st_entry->tag, NULL);
@@ -2127,7 +2297,8 @@ static int ctrl_cmd_delete(const char *input)
 			 get_uid_from_tag(tcs_entry->tn.tag),
 			 tcs_entry->active_set);
 		rb_erase(&tcs_entry->tn.node, &tag_counter_set_tree);
-		kfree(tcs_entry);
+		hlist_del_rcu(&tcs_entry->hash_node);
+		call_rcu_bh(&tcs_entry->rcu, tag_counter_set_free_rcu);
 	}
 	spin_unlock_bh(&tag_counter_set_list_lock);
 
@@ -2158,7 +2329,8 @@ static int ctrl_cmd_delete(const char *input)
 					 entry_uid);
 				rb_erase(&ts_entry->tn.node,
 					 &iface_entry->tag_stat_tree);
-				kfree(ts_entry);
+				hlist_del_rcu(&ts_entry->hash_node);
+				call_rcu_bh(&ts_entry->rcu, tag_stat_free_rcu);
 			}
 		}
 		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
@@ -2240,12 +2412,15 @@ static int ctrl_cmd_counter_set(const char *input)
 			goto err;
 		}
 		tcs->tn.tag = tag;
+		tcs->active_set = counter_set;
 		tag_counter_set_tree_insert(tcs, &tag_counter_set_tree);
+		hlist_add_head_rcu(&tcs->hash_node,
+				   tag_counter_set_hash_head(tag));
 		CT_DEBUG("qtaguid: ctrl_counterset(%s): added tcs tag=0x%llx "
 			 "(uid=%u) set=%d\n",
 			 input, tag, get_uid_from_tag(tag), counter_set);
 	}
-	tcs->active_set = counter_set;
+	ACCESS_ONCE(tcs->active_set) = counter_set;
 	spin_unlock_bh(&tag_counter_set_list_lock);
 	atomic64_inc(&qtu_events.counter_set_changes);
 	res = 0;
@@ -2342,7 +2517,9 @@ static int ctrl_cmd_tag(const char *input)
 		BUG_ON(IS_ERR_OR_NULL(prev_tag_ref_entry));
 		BUG_ON(prev_tag_ref_entry->num_sock_tags <= 0);
 		prev_tag_ref_entry->num_sock_tags--;
+		write_seqcount_begin(&sock_tag_seq);
 		sock_tag_entry->tag = full_tag;
+		write_seqcount_end(&sock_tag_seq);
 	} else {
 		CT_DEBUG("qtaguid: ctrl_tag(%s): newtag for sk=%p\n",
 			 input, el_socket->sk);
@@ -2382,6 +2559,8 @@ static int ctrl_cmd_tag(const char *input)
 		spin_unlock_bh(&uid_tag_data_tree_lock);
 
 		sock_tag_tree_insert(sock_tag_entry, &sock_tag_tree);
+		hlist_add_head_rcu(&sock_tag_entry->hash_node,
+				   sock_tag_hash_head(sock_tag_entry->sk));
 		atomic64_inc(&qtu_events.sockets_tagged);
 	}
 	spin_unlock_bh(&sock_tag_list_lock);
@@ -2448,6 +2627,7 @@ static int ctrl_cmd_untag(const char *input)
 	 * so it can do whatever it wants to it.
 	 */
 	rb_erase(&sock_tag_entry->sock_node, &sock_tag_tree);
+	hlist_del_rcu(&sock_tag_entry->hash_node);
 
 	tag_ref_entry = lookup_tag_ref(sock_tag_entry->tag, &utd_entry);
 	BUG_ON(!tag_ref_entry);
@@ -2484,7 +2664,7 @@ static int ctrl_cmd_untag(const char *input)
 		 atomic_long_read(&el_socket->file->f_count) - 1);
 	sockfd_put(el_socket);
 
-	kfree(sock_tag_entry);
+	call_rcu_bh(&sock_tag_entry->rcu, sock_tag_free_rcu);
 	atomic64_inc(&qtu_events.sockets_untagged);
 
 	return 0;
@@ -2563,6 +2743,7 @@ struct proc_print_info {
 	char **num_items_returned;
 	struct iface_stat *iface_entry;
 	struct tag_stat *ts_entry;
+	struct data_counters ts_counters;  /* ts_entry's, folded */
 	int item_index;
 	int items_to_skip;
 	int char_count;
@@ -2602,7 +2783,7 @@ static int pp_stats_line(struct proc_print_info *ppi, int cnt_set)
 		}
 		if (ppi->item_index++ < ppi->items_to_skip)
 			return 0;
-		cnts = &ppi->ts_entry->counters;
+		cnts = &ppi->ts_counters;
 		len = snprintf(
 			ppi->outp, ppi->char_count,
 			"%d %s 0x%llx %u %u "
@@ -2643,6 +2824,8 @@ static bool pp_sets(struct proc_print_info *ppi)
 {
 	int len;
 	int counter_set;
+
+	data_counters_fold(&ppi->ts_counters, ppi->ts_entry->counters);
 	for (counter_set = 0; counter_set < IFS_MAX_COUNTER_SETS;
 	     counter_set++) {
 		len = pp_stats_line(ppi, counter_set);
@@ -2850,6 +3033,7 @@ static int qtudev_release(struct inode *inode, struct file *file)
 		free_tag_ref_from_utd_entry(tr, utd_entry);
 
 		rb_erase(&st_entry->sock_node, &sock_tag_tree);
+		hlist_del_rcu(&st_entry->hash_node);
 		list_del(&st_entry->list);
 		/* Can't sockfd_put() within spinlock, do it later. */
 		sock_tag_tree_insert(st_entry, &st_to_free_tree);
@@ -0,0 +1,252 @@
+/*
+ * Load generator for the xt_qtaguid match.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * On load, one thread per online cpu pushes synthetic UDP packets through
+ * the match the way an egress packet goes through OUTPUT and POSTROUTING,
+ * then the cost per packet is logged. The packets are accounted against
+ * the "ifname" interface like real traffic, so only load this on a test
+ * device.
+ */
+#include <linux/completion.h>
+#include <linux/cpu.h>
+#include <linux/err.h>
+#include <linux/ip.h>
+#include <linux/kthread.h>
+#include <linux/module.h>
+#include <linux/net.h>
+#include <linux/netdevice.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/x_tables.h>
+#include <linux/netfilter/xt_qtaguid.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/udp.h>
+#include <net/net_namespace.h>
+#include <net/sock.h>
+
+static unsigned int packets = 1000000;
+module_param(packets, uint, S_IRUGO);
+MODULE_PARM_DESC(packets, "Packets sent through the match by each thread");
+
+static unsigned int payload = 512;
+module_param(payload, uint, S_IRUGO);
+MODULE_PARM_DESC(payload, "UDP payload size of each packet");
+
+static char *ifname = "lo";
+module_param(ifname, charp, S_IRUGO);
+MODULE_PARM_DESC(ifname, "Interface the packets are accounted against");
+
+struct qtaguid_bench {
+	struct task_struct *task;
+	struct socket *sock;
+	struct sk_buff *skb;
+	int cpu;
+	u64 ns;
+};
+
+static struct xt_match *bench_match;
+static struct net_device *bench_dev;
+static DECLARE_COMPLETION(bench_start);
+static DECLARE_COMPLETION(bench_done);
+static atomic_t bench_running;
+
+static struct sk_buff *qtaguid_bench_skb(struct sock *sk)
+{
+	unsigned int len = sizeof(struct iphdr) + sizeof(struct udphdr) +
+		payload;
+	struct sk_buff *skb;
+	struct iphdr *iph;
+	struct udphdr *uh;
+
+	skb = alloc_skb(LL_MAX_HEADER + len, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+	skb_reserve(skb, LL_MAX_HEADER);
+	skb_reset_network_header(skb);
+	iph = (struct iphdr *)skb_put(skb, len);
+	memset(iph, 0, len);
+	iph->version = 4;
+	iph->ihl = sizeof(*iph) / 4;
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->tot_len = htons(len);
+	iph->saddr = htonl(INADDR_LOOPBACK);
+	iph->daddr = htonl(INADDR_LOOPBACK);
+	skb_set_transport_header(skb, sizeof(*iph));
+	uh = udp_hdr(skb);
+	uh->source = htons(9);
+	uh->dest = htons(9);
+	uh->len = htons(len - sizeof(*iph));
+	skb->protocol = htons(ETH_P_IP);
+	skb->dev = bench_dev;
+	/* Not owned: cleared again before the skb is freed */
+	skb->sk = sk;
+	return skb;
+}
+
+static int qtaguid_bench_thread(void *data)
+{
+	struct qtaguid_bench *qb = data;
+	/* No uid/gid match requested, so the match only does accounting */
+	struct xt_qtaguid_match_info info = { 0 };
+	struct xt_action_param par = {
+		.match = bench_match,
+		.matchinfo = &info,
+		.out = bench_dev,
+		.family = NFPROTO_IPV4,
+	};
+	ktime_t start;
+	unsigned int i;
+
+	wait_for_completion(&bench_start);
+
+	start = ktime_get();
+	for (i = 0; i < packets; i++) {
+		/* Like ipt_do_table(), run the match with bh disabled */
+		local_bh_disable();
+		par.hooknum = NF_INET_LOCAL_OUT;
+		bench_match->match(qb->skb, &par);
+		par.hooknum = NF_INET_POST_ROUTING;
+		bench_match->match(qb->skb, &par);
+		local_bh_enable();
+		if (!(i & 1023))
+			cond_resched();
+	}
+	qb->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if (atomic_dec_and_test(&bench_running))
+		complete(&bench_done);
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static void qtaguid_bench_free(struct qtaguid_bench *benches, int count)
+{
+	struct qtaguid_bench *qb;
+
+	for (qb = benches; qb < benches + count; qb++) {
+		/* Threads that never got woken up exit right away */
+		if (qb->task)
+			kthread_stop(qb->task);
+		if (qb->skb) {
+			qb->skb->sk = NULL;
+			kfree_skb(qb->skb);
+		}
+		if (qb->sock)
+			sock_release(qb->sock);
+	}
+	kfree(benches);
+}
+
+static int qtaguid_bench_setup(struct qtaguid_bench *qb, int cpu)
+{
+	int err;
+
+	qb->cpu = cpu;
+	err = sock_create_kern(PF_INET, SOCK_DGRAM, IPPROTO_UDP, &qb->sock);
+	if (err) {
+		qb->sock = NULL;
+		return err;
+	}
+	qb->skb = qtaguid_bench_skb(qb->sock->sk);
+	if (!qb->skb)
+		return -ENOMEM;
+	qb->task = kthread_create(qtaguid_bench_thread, qb,
+				  "qtaguid_bench/%d", cpu);
+	if (IS_ERR(qb->task)) {
+		err = PTR_ERR(qb->task);
+		qb->task = NULL;
+		return err;
+	}
+	kthread_bind(qb->task, cpu);
+	return 0;
+}
+
+static int __init qtaguid_bench_init(void)
+{
+	struct qtaguid_bench *benches;
+	struct qtaguid_bench *qb;
+	u64 max_ns = 0;
+	int count = 0;
+	int cpu;
+	int err;
+
+	/* qtaguid masquerades as revision 1 of the owner match */
+	bench_match = xt_request_find_match(NFPROTO_IPV4, "owner", 1);
+	if (IS_ERR(bench_match)) {
+		pr_err("qtaguid_bench: qtaguid match not found\n");
+		return PTR_ERR(bench_match);
+	}
+	bench_dev = dev_get_by_name(&init_net, ifname);
+	if (!bench_dev) {
+		pr_err("qtaguid_bench: no device %s\n", ifname);
+		err = -ENODEV;
+		goto err_put_match;
+	}
+
+	/* Keep the cpus the threads are bound to around for the run */
+	get_online_cpus();
+	benches = kcalloc(num_online_cpus(), sizeof(*benches), GFP_KERNEL);
+	if (!benches) {
+		err = -ENOMEM;
+		goto err_put_cpus;
+	}
+	for_each_online_cpu(cpu) {
+		err = qtaguid_bench_setup(&benches[count++], cpu);
+		if (err) {
+			qtaguid_bench_free(benches, count);
+			goto err_put_cpus;
+		}
+	}
+
+	atomic_set(&bench_running, count);
+	for (qb = benches; qb < benches + count; qb++)
+		wake_up_process(qb->task);
+	complete_all(&bench_start);
+	wait_for_completion(&bench_done);
+
+	for (qb = benches; qb < benches + count; qb++) {
+		pr_info("qtaguid_bench: cpu%d: %u packets in %llu ns, "
+			"%llu ns/packet\n", qb->cpu, packets, qb->ns,
+			div_u64(qb->ns, max(packets, 1U)));
+		max_ns = max(max_ns, qb->ns);
+	}
+	pr_info("qtaguid_bench: %d threads on %s: %llu packets/s\n",
+		count, ifname,
+		div64_u64((u64)packets * count * NSEC_PER_SEC,
+			  max_t(u64, max_ns, 1)));
+
+	qtaguid_bench_free(benches, count);
+	put_online_cpus();
+	return 0;
+
+err_put_cpus:
+	put_online_cpus();
+	dev_put(bench_dev);
+err_put_match:
+	module_put(bench_match->me);
+	return err;
+}
+
+static void __exit qtaguid_bench_exit(void)
+{
+	dev_put(bench_dev);
+	module_put(bench_match->me);
+}
+
+module_init(qtaguid_bench_init);
+module_exit(qtaguid_bench_exit);
+MODULE_DESCRIPTION("Xtables: qtaguid match load generator");
+MODULE_LICENSE("GPL");
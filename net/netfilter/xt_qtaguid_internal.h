@@ -11,8 +11,12 @@
 #define __XT_QTAGUID_INTERNAL_H__
 
 #include <linux/types.h>
+#include <linux/cache.h>
+#include <linux/list.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
 #include <linux/spinlock_types.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/workqueue.h>
 
 /* Iface handling */
@@ -179,6 +183,20 @@ struct data_counters {
 	struct byte_packet_counters bpc[IFS_MAX_COUNTER_SETS][IFS_MAX_DIRECTIONS][IFS_MAX_PROTOS];
 };
 
+/*
+ * The counters are updated from the match with bottom halves disabled, one
+ * copy per possible cpu (indexed by cpu id), and folded when read.
+ * A plain per-cpu allocation can't be used since tag_stats get created from
+ * the packet path.
+ */
+struct data_counters_pcpu {
+	struct data_counters dc;
+	struct u64_stats_sync syncp;
+} ____cacheline_aligned_in_smp;
+
+void data_counters_fold(struct data_counters *dc,
+			struct data_counters_pcpu *pdc);
+
 static inline uint64_t dc_sum_bytes(struct data_counters *counters,
 				    int set,
 				    enum ifs_tx_rx direction)
@@ -204,14 +222,25 @@ struct tag_node {
 	tag_t tag;
 };
 
+/*
+ * The sock_tag, tag_stat and tag_counter_set trees are only used by the
+ * control side. The match looks entries up without locks through these
+ * hashes, and entries are freed after an RCU-bh grace period.
+ */
+#define SOCK_TAG_HASH_BITS 8
+#define TAG_STAT_HASH_BITS 6
+#define TAG_COUNTER_SET_HASH_BITS 6
+
 struct tag_stat {
 	struct tag_node tn;
-	struct data_counters counters;
+	struct hlist_node hash_node;  /* in iface_stat.tag_stat_hash */
+	struct data_counters_pcpu *counters;
 	/*
 	 * If this tag is acct_tag based, we need to count against the
 	 * matching parent uid_tag.
 	 */
-	struct data_counters *parent_counters;
+	struct data_counters_pcpu *parent_counters;
+	struct rcu_head rcu;
 };
 
 struct iface_stat {
@@ -222,7 +251,7 @@ struct iface_stat {
 	struct net_device *net_dev;
 
 	struct byte_packet_counters totals_via_dev[IFS_MAX_DIRECTIONS];
-	struct data_counters totals_via_skb;
+	struct data_counters_pcpu *totals_via_skb;
 	/*
 	 * We keep the last_known, because some devices reset their counters
 	 * just before NETDEV_UP, while some will reset just before
@@ -238,6 +267,7 @@ struct iface_stat {
 	struct proc_dir_entry *proc_ptr;
 
 	struct rb_root tag_stat_tree;
+	struct hlist_head tag_stat_hash[1 << TAG_STAT_HASH_BITS];
 	spinlock_t tag_stat_list_lock;
 };
 
@@ -255,6 +285,7 @@ struct iface_stat_work {
  */
 struct sock_tag {
 	struct rb_node sock_node;
+	struct hlist_node hash_node;  /* in sock_tag_hash */
 	struct sock *sk;  /* Only used as a number, never dereferenced */
 	/* The socket is needed for sockfd_put() */
 	struct socket *socket;
@@ -262,7 +293,9 @@ struct sock_tag {
 	struct list_head list;   /* in proc_qtu_data.sock_tag_list */
 	pid_t pid;
 
+	/* Retagging in place is guarded by sock_tag_seq for the match */
 	tag_t tag;
+	struct rcu_head rcu;
 };
 
 struct qtaguid_event_counts {
@@ -300,7 +333,9 @@ struct qtaguid_event_counts {
 /* Track the set active_set for the given tag. */
 struct tag_counter_set {
 	struct tag_node tn;
+	struct hlist_node hash_node;  /* in tag_counter_set_hash */
 	int active_set;
+	struct rcu_head rcu;
 };
 
 /*----------------------------------------------*/
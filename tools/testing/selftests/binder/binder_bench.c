@@ -0,0 +1,642 @@
+/*
+ * Binder IPC benchmark
+ *
+ * Licensed under the terms of the GNU GPL License version 2
+ *
+ * Drives /dev/binder directly, without any Android userspace: one
+ * process registers itself as the context manager and serves calls from
+ * a pool of looper threads, while a number of client processes issue
+ * transactions against it and report latency and throughput.  Payload
+ * size and the number of file descriptors and binder objects carried by
+ * each transaction can be varied to exercise the object translation
+ * paths of the driver.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define BINDER_DEV		"/dev/binder"
+#define BINDER_VM_SIZE		((1 * 1024 * 1024) - (4096 * 2))
+#define LATENCY_BUCKETS		32
+#define MAX_OBJECTS		64
+
+#define CODE_GET_SERVICE	1
+#define CODE_PING		2
+
+#define ALIGN_PTR(x)	(((x) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+static int nr_clients = 1;
+static int nr_threads = 1;
+static int payload_size;
+static int nr_fds;
+static int nr_objects;
+static int nr_iterations = 10000;
+static int oneway;
+
+struct client_result {
+	unsigned long long calls;
+	unsigned long long failed;
+	unsigned long long total_ns;
+	unsigned long long min_ns;
+	unsigned long long max_ns;
+	unsigned long long hist[LATENCY_BUCKETS];
+};
+
+struct binder_state {
+	int fd;
+	void *mapped;
+};
+
+/* Outgoing command stream for one BINDER_WRITE_READ */
+struct cmd_buf {
+	size_t len;
+	uint8_t data[512];
+};
+
+static void cmd_put(struct cmd_buf *out, const void *data, size_t len)
+{
+	if (out->len + len > sizeof(out->data)) {
+		fprintf(stderr, "binder_bench: command buffer overflow\n");
+		exit(1);
+	}
+	memcpy(out->data + out->len, data, len);
+	out->len += len;
+}
+
+static void cmd_put_u32(struct cmd_buf *out, uint32_t val)
+{
+	cmd_put(out, &val, sizeof(val));
+}
+
+static void cmd_put_ptr(struct cmd_buf *out, const void *ptr)
+{
+	cmd_put(out, &ptr, sizeof(ptr));
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int binder_open_dev(struct binder_state *bs)
+{
+	bs->fd = open(BINDER_DEV, O_RDWR);
+	if (bs->fd < 0)
+		return -1;
+	bs->mapped = mmap(NULL, BINDER_VM_SIZE, PROT_READ, MAP_PRIVATE,
+			  bs->fd, 0);
+	if (bs->mapped == MAP_FAILED) {
+		close(bs->fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Sends the queued commands and, if rbuf is given, reads returns into
+ * it.  Returns the number of bytes read or -1.
+ */
+static long binder_write_read(struct binder_state *bs, struct cmd_buf *out,
+			      void *rbuf, size_t rsize)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = out->len;
+	bwr.write_buffer = (unsigned long)out->data;
+	bwr.read_size = rsize;
+	bwr.read_buffer = (unsigned long)rbuf;
+
+	do {
+		ret = ioctl(bs->fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR && bwr.write_consumed == 0 &&
+		 bwr.read_consumed == 0);
+	if (ret < 0) {
+		perror("binder_bench: BINDER_WRITE_READ");
+		return -1;
+	}
+	if (bwr.write_consumed != bwr.write_size) {
+		fprintf(stderr, "binder_bench: short write %ld of %ld\n",
+			bwr.write_consumed, bwr.write_size);
+		return -1;
+	}
+	out->len = 0;
+	return bwr.read_consumed;
+}
+
+struct read_result {
+	int complete;
+	int replied;
+	int failed;
+	struct binder_transaction_data reply;
+};
+
+typedef void (*transaction_handler)(struct binder_transaction_data *tr,
+				    struct cmd_buf *out, void *priv);
+
+/*
+ * Walks the return stream.  Reference count requests for our own nodes
+ * are acknowledged through out, incoming transactions are passed to
+ * handler.
+ */
+static int binder_parse(uint8_t *ptr, long size, struct cmd_buf *out,
+			struct read_result *res, transaction_handler handler,
+			void *priv)
+{
+	uint8_t *end = ptr + size;
+
+	while (ptr < end) {
+		uint32_t cmd = *(uint32_t *)ptr;
+
+		ptr += sizeof(uint32_t);
+		switch (cmd) {
+		case BR_NOOP:
+		case BR_OK:
+		case BR_SPAWN_LOOPER:
+			break;
+		case BR_TRANSACTION_COMPLETE:
+			res->complete = 1;
+			break;
+		case BR_INCREFS:
+		case BR_ACQUIRE: {
+			struct binder_ptr_cookie *pc = (void *)ptr;
+
+			cmd_put_u32(out, cmd == BR_INCREFS ?
+				    BC_INCREFS_DONE : BC_ACQUIRE_DONE);
+			cmd_put_ptr(out, pc->ptr);
+			cmd_put_ptr(out, pc->cookie);
+			ptr += sizeof(*pc);
+			break;
+		}
+		case BR_RELEASE:
+		case BR_DECREFS:
+			ptr += sizeof(struct binder_ptr_cookie);
+			break;
+		case BR_DEAD_BINDER:
+		case BR_CLEAR_DEATH_NOTIFICATION_DONE:
+			ptr += sizeof(void *);
+			break;
+		case BR_ERROR:
+			ptr += sizeof(int);
+			res->failed = 1;
+			break;
+		case BR_DEAD_REPLY:
+		case BR_FAILED_REPLY:
+			res->failed = 1;
+			break;
+		case BR_TRANSACTION: {
+			struct binder_transaction_data *tr = (void *)ptr;
+
+			if (handler)
+				handler(tr, out, priv);
+			ptr += sizeof(*tr);
+			break;
+		}
+		case BR_REPLY:
+			memcpy(&res->reply, ptr, sizeof(res->reply));
+			res->replied = 1;
+			ptr += sizeof(res->reply);
+			break;
+		default:
+			fprintf(stderr, "binder_bench: unexpected return %x\n",
+				cmd);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Server side */
+
+static int service_token;
+
+struct server_thread {
+	struct binder_state *bs;
+	struct flat_binder_object obj;
+	size_t obj_offset;
+};
+
+static void server_reply(struct cmd_buf *out, const void *data,
+			 size_t data_size, const void *offsets,
+			 size_t offsets_size)
+{
+	struct binder_transaction_data tr;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.data_size = data_size;
+	tr.offsets_size = offsets_size;
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offsets;
+	cmd_put_u32(out, BC_REPLY);
+	cmd_put(out, &tr, sizeof(tr));
+}
+
+static void server_handle(struct binder_transaction_data *tr,
+			  struct cmd_buf *out, void *priv)
+{
+	struct server_thread *st = priv;
+	const uint8_t *data = tr->data.ptr.buffer;
+	const size_t *offs = tr->data.ptr.offsets;
+	size_t i;
+
+	if (tr->code == CODE_GET_SERVICE) {
+		/* Hand out a node that accepts file descriptors */
+		memset(&st->obj, 0, sizeof(st->obj));
+		st->obj.type = BINDER_TYPE_BINDER;
+		st->obj.flags = FLAT_BINDER_FLAG_ACCEPTS_FDS | 0x7f;
+		st->obj.binder = &service_token;
+		st->obj.cookie = &service_token;
+		st->obj_offset = 0;
+		server_reply(out, &st->obj, sizeof(st->obj),
+			     &st->obj_offset, sizeof(st->obj_offset));
+	} else {
+		for (i = 0; i < tr->offsets_size / sizeof(size_t); i++) {
+			const struct flat_binder_object *fp;
+
+			fp = (const void *)(data + offs[i]);
+			if (fp->type == BINDER_TYPE_FD)
+				close(fp->handle);
+		}
+		if (!(tr->flags & TF_ONE_WAY))
+			server_reply(out, data, tr->data_size, NULL, 0);
+	}
+	cmd_put_u32(out, BC_FREE_BUFFER);
+	cmd_put_ptr(out, tr->data.ptr.buffer);
+}
+
+static void *server_loop(void *arg)
+{
+	struct server_thread *st = arg;
+	struct read_result res;
+	struct cmd_buf out;
+	uint32_t rbuf[128];
+	long n;
+
+	out.len = 0;
+	cmd_put_u32(&out, BC_ENTER_LOOPER);
+	for (;;) {
+		n = binder_write_read(st->bs, &out, rbuf, sizeof(rbuf));
+		if (n < 0)
+			break;
+		memset(&res, 0, sizeof(res));
+		if (binder_parse((uint8_t *)rbuf, n, &out, &res, server_handle,
+				 st))
+			break;
+	}
+	exit(1);
+	return NULL;
+}
+
+static void run_server(int ready_fd)
+{
+	static struct binder_state bs;
+	struct server_thread *threads;
+	pthread_t tid;
+	char status = 0;
+	int max_threads = 0;
+	int i;
+
+	if (binder_open_dev(&bs)) {
+		perror("binder_bench: open " BINDER_DEV);
+		goto fail;
+	}
+	if (ioctl(bs.fd, BINDER_SET_MAX_THREADS, &max_threads) ||
+	    ioctl(bs.fd, BINDER_SET_CONTEXT_MGR, 0)) {
+		perror("binder_bench: BINDER_SET_CONTEXT_MGR");
+		goto fail;
+	}
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		goto fail;
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].bs = &bs;
+		if (i > 0 && pthread_create(&tid, NULL, server_loop,
+					    &threads[i]))
+			goto fail;
+	}
+
+	status = 1;
+	if (write(ready_fd, &status, 1) != 1)
+		exit(1);
+	close(ready_fd);
+	server_loop(&threads[0]);
+
+fail:
+	if (write(ready_fd, &status, 1) != 1)
+		exit(1);
+	exit(1);
+}
+
+/* Client side */
+
+/*
+ * Sends one transaction and waits until it has been answered (or, for
+ * one-way calls, queued).  Any buffer we still own from a previous reply
+ * is freed in the same BINDER_WRITE_READ.
+ */
+static int client_transact(struct binder_state *bs, struct cmd_buf *out,
+			   uint32_t handle, uint32_t code, uint32_t flags,
+			   const void *data, size_t data_size,
+			   const size_t *offsets, size_t offsets_size,
+			   struct read_result *res)
+{
+	struct binder_transaction_data tr;
+	uint32_t rbuf[64];
+	long n;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.flags = flags | TF_ACCEPT_FDS;
+	tr.data_size = data_size;
+	tr.offsets_size = offsets_size;
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offsets;
+	cmd_put_u32(out, BC_TRANSACTION);
+	cmd_put(out, &tr, sizeof(tr));
+
+	memset(res, 0, sizeof(*res));
+	for (;;) {
+		n = binder_write_read(bs, out, rbuf, sizeof(rbuf));
+		if (n < 0)
+			return -1;
+		if (binder_parse((uint8_t *)rbuf, n, out, res, NULL, NULL))
+			return -1;
+		if (res->failed)
+			return 1;
+		if (res->replied)
+			break;
+		if ((flags & TF_ONE_WAY) && res->complete)
+			break;
+	}
+	if (res->replied) {
+		cmd_put_u32(out, BC_FREE_BUFFER);
+		cmd_put_ptr(out, res->reply.data.ptr.buffer);
+	}
+	return 0;
+}
+
+static void record_latency(struct client_result *r, unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	int bucket = 0;
+
+	while (us && bucket < LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	r->hist[bucket]++;
+	r->calls++;
+	r->total_ns += ns;
+	if (!r->min_ns || ns < r->min_ns)
+		r->min_ns = ns;
+	if (ns > r->max_ns)
+		r->max_ns = ns;
+}
+
+static void run_client(struct client_result *r)
+{
+	struct binder_state bs;
+	struct read_result res;
+	struct cmd_buf out;
+	struct flat_binder_object *fp;
+	static int node_tokens[MAX_OBJECTS];
+	size_t offsets[MAX_OBJECTS];
+	size_t data_size, obj_start;
+	uint32_t service;
+	uint8_t *data;
+	int devnull, i;
+
+	if (binder_open_dev(&bs)) {
+		perror("binder_bench: open " BINDER_DEV);
+		exit(1);
+	}
+	out.len = 0;
+
+	/* Look up the fd-accepting service node through the context manager */
+	if (client_transact(&bs, &out, 0, CODE_GET_SERVICE, 0, NULL, 0,
+			    NULL, 0, &res) || !res.replied ||
+	    res.reply.data_size < sizeof(*fp)) {
+		fprintf(stderr, "binder_bench: service lookup failed\n");
+		exit(1);
+	}
+	fp = (void *)res.reply.data.ptr.buffer;
+	service = fp->handle;
+	/*
+	 * Take our own reference on the handle before the queued
+	 * BC_FREE_BUFFER drops the one held by the reply buffer.
+	 */
+	out.len = 0;
+	cmd_put_u32(&out, BC_ACQUIRE);
+	cmd_put_u32(&out, service);
+	cmd_put_u32(&out, BC_FREE_BUFFER);
+	cmd_put_ptr(&out, res.reply.data.ptr.buffer);
+
+	devnull = open("/dev/null", O_RDONLY);
+	if (devnull < 0) {
+		perror("binder_bench: open /dev/null");
+		exit(1);
+	}
+
+	obj_start = ALIGN_PTR(payload_size);
+	data_size = obj_start + (nr_fds + nr_objects) * sizeof(*fp);
+	data = calloc(1, data_size ? data_size : 1);
+	if (!data)
+		exit(1);
+	memset(data, 0xa5, payload_size);
+	for (i = 0; i < nr_fds + nr_objects; i++) {
+		offsets[i] = obj_start + i * sizeof(*fp);
+		fp = (void *)(data + offsets[i]);
+		if (i < nr_fds) {
+			fp->type = BINDER_TYPE_FD;
+			fp->handle = devnull;
+		} else {
+			fp->type = BINDER_TYPE_BINDER;
+			fp->flags = 0x7f;
+			fp->binder = &node_tokens[i];
+			fp->cookie = &node_tokens[i];
+		}
+	}
+
+	for (i = 0; i < nr_iterations; i++) {
+		unsigned long long start = now_ns();
+		int ret;
+
+		ret = client_transact(&bs, &out, service, CODE_PING,
+				      oneway ? TF_ONE_WAY : 0, data, data_size,
+				      offsets,
+				      (nr_fds + nr_objects) * sizeof(size_t),
+				      &res);
+		if (ret < 0)
+			exit(1);
+		if (ret > 0) {
+			r->failed++;
+			continue;
+		}
+		record_latency(r, now_ns() - start);
+	}
+	exit(0);
+}
+
+static unsigned long long hist_percentile(unsigned long long *hist,
+					  unsigned long long total, int pct)
+{
+	unsigned long long seen = 0;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen * 100 >= total * pct)
+			return 1ULL << i;
+	}
+	return 1ULL << (LATENCY_BUCKETS - 1);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-c clients] [-t server threads] [-s payload bytes]\n"
+		"       [-f fds] [-o binder objects] [-n iterations] [-a]\n"
+		"  -a  issue one-way transactions\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct client_result *results, total;
+	unsigned long long start, elapsed;
+	pid_t server, *clients;
+	int ready[2];
+	char status = 0;
+	int opt, i, j, ret = 0;
+
+	while ((opt = getopt(argc, argv, "c:t:s:f:o:n:a")) != -1) {
+		switch (opt) {
+		case 'c':
+			nr_clients = atoi(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 's':
+			payload_size = atoi(optarg);
+			break;
+		case 'f':
+			nr_fds = atoi(optarg);
+			break;
+		case 'o':
+			nr_objects = atoi(optarg);
+			break;
+		case 'n':
+			nr_iterations = atoi(optarg);
+			break;
+		case 'a':
+			oneway = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_clients < 1 || nr_threads < 1 || payload_size < 0 ||
+	    nr_fds < 0 || nr_objects < 0 || nr_iterations < 1 ||
+	    nr_fds + nr_objects > MAX_OBJECTS)
+		usage(argv[0]);
+
+	if (access(BINDER_DEV, R_OK | W_OK)) {
+		printf("binder_bench: %s not available, skipping\n", BINDER_DEV);
+		return 0;
+	}
+
+	results = mmap(NULL, nr_clients * sizeof(*results),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		       -1, 0);
+	clients = calloc(nr_clients, sizeof(*clients));
+	if (results == MAP_FAILED || !clients || pipe(ready)) {
+		perror("binder_bench");
+		return 1;
+	}
+	memset(results, 0, nr_clients * sizeof(*results));
+
+	server = fork();
+	if (server == 0) {
+		close(ready[0]);
+		run_server(ready[1]);
+	}
+	close(ready[1]);
+	if (server < 0 || read(ready[0], &status, 1) != 1 || !status) {
+		fprintf(stderr, "binder_bench: server failed to start\n");
+		if (server > 0)
+			waitpid(server, NULL, 0);
+		return 1;
+	}
+
+	start = now_ns();
+	for (i = 0; i < nr_clients; i++) {
+		clients[i] = fork();
+		if (clients[i] == 0)
+			run_client(&results[i]);
+		if (clients[i] < 0) {
+			perror("binder_bench: fork");
+			ret = 1;
+			nr_clients = i;
+			break;
+		}
+	}
+	for (i = 0; i < nr_clients; i++) {
+		int wstatus;
+
+		waitpid(clients[i], &wstatus, 0);
+		if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus))
+			ret = 1;
+	}
+	elapsed = now_ns() - start;
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < nr_clients; i++) {
+		total.calls += results[i].calls;
+		total.failed += results[i].failed;
+		total.total_ns += results[i].total_ns;
+		if (results[i].min_ns &&
+		    (!total.min_ns || results[i].min_ns < total.min_ns))
+			total.min_ns = results[i].min_ns;
+		if (results[i].max_ns > total.max_ns)
+			total.max_ns = results[i].max_ns;
+		for (j = 0; j < LATENCY_BUCKETS; j++)
+			total.hist[j] += results[i].hist[j];
+	}
+
+	printf("clients %d threads %d size %d fds %d objects %d%s: "
+	       "%llu calls, %llu failed, %.0f calls/s\n",
+	       nr_clients, nr_threads, payload_size, nr_fds, nr_objects,
+	       oneway ? " oneway" : "", total.calls, total.failed,
+	       total.calls * 1e9 / elapsed);
+	if (total.calls)
+		printf("  latency us: avg %.1f min %.1f max %.1f "
+		       "p50 < %llu p99 < %llu\n",
+		       total.total_ns / 1000.0 / total.calls,
+		       total.min_ns / 1000.0, total.max_ns / 1000.0,
+		       hist_percentile(total.hist, total.calls, 50),
+		       hist_percentile(total.hist, total.calls, 99));
+	return ret;
+}